@@ -1,10 +1,13 @@
 #ifndef __BINGEWATCH_BLOCK_LIST_BUFFER_H__
 #define __BINGEWATCH_BLOCK_LIST_BUFFER_H__
 
+#include <stdint.h>
+
 #include "machine.h"
 
 #define BLOCK_FULL(b) (b->size == b->bytes)
 #define BLOCK_EMPTY(b) (0 == b->bytes)
+#define BLOCK_UNREAD(b) (b->bytes - b->offset)
 
 enum block_state_e {
     BLB_STATE_NORMAL,
@@ -27,12 +30,18 @@ struct __block_t {
     // Number of bytes in use
     size_t bytes;
 
+    // Number of bytes already read (partial reads advance this, not the data)
+    size_t offset;
+
     // Block state
     enum block_state_e state;
 
     // Data Return Val
     int d_ret;
 
+    // Metadata for the first byte (valid if meta.flags & BLOCK_META_VALID)
+    struct block_meta_t meta;
+
     // Placeholder for extension
     void *__block_t_impl;
 };
@@ -56,10 +65,12 @@ typedef void (*buffer_init)(IO_DESC *);
 // Empty List Allocation
 struct __block_t *block_list_alloc(POOL *p, size_t block_count);
 struct __block_t *block_list_alloc_custom(POOL *p, size_t size_of, size_t block_count);
+void block_list_free(POOL *p, struct __block_t *blocks);
 
 // List Data Allocation
 size_t block_data_alloc(POOL *p, void *block, size_t bytes_per_block);
 size_t block_data_fastalloc(POOL *p, void *block, size_t bytes_per_block);
+size_t block_data_fastalloc_flags(POOL *p, void *block, size_t bytes_per_block, uint32_t flags);
 
 // Buffer Management
 struct blb_rw_t *blb_init_rw(POOL *pool, size_t bytes_per_block, size_t n_blocks);
@@ -0,0 +1,25 @@
+#ifndef __BW_COPY__
+#define __BW_COPY__
+
+#include <stddef.h>
+
+/*
+ * Shared copy layer for block buffers
+ *
+ * bw_memcpy() is a cached copy, for data the caller is about to use.
+ * bw_memcpy_stream() is for filling buffer blocks: copies of at least the
+ * non-temporal threshold bypass the cache, so a 10 MB block doesn't evict the
+ * producer's working set on its way to a consumer that reads it much later.
+ *
+ * The streaming kernel (AVX2, SSE2, or libc) is selected at runtime from the
+ * CPU, or set with BW_COPY_KERNEL or bw_copy_set_kernel() if the CPU supports
+ * it.  Set the threshold to 0 to disable non-temporal copies.
+ */
+void *bw_memcpy(void *dst, const void *src, size_t n);
+void *bw_memcpy_stream(void *dst, const void *src, size_t n);
+
+void bw_copy_set_nt_threshold(size_t bytes);
+int bw_copy_set_kernel(const char *name);
+const char *bw_copy_kernel_name();
+
+#endif
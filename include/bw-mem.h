@@ -0,0 +1,50 @@
+#ifndef __BW_MEM__
+#define __BW_MEM__
+
+#include <stdint.h>
+
+#include "simple-buffers.h"
+
+/*
+ * Block buffer memory
+ *
+ * Without allocation flags, buffer memory is a plain palloc().  With any of
+ * BF_HUGEPAGE, BF_PREFAULT or BF_MLOCK, it is mapped directly:
+ *   BF_HUGEPAGE: MAP_HUGETLB if huge pages are reserved, otherwise
+ *                transparent huge pages (madvise)
+ *   BF_PREFAULT: every page is faulted in before the buffer is used
+ *   BF_MLOCK:    the buffer is locked in RAM
+ * Mappings belong to the pool they were allocated for, and are unmapped when
+ * the pool, or the pool it is a subpool of, is freed.
+ *
+ * BW_BUF_ALLOC (e.g. "hugepage,prefault,mlock") sets flags for every buffer.
+ */
+#define BF_ALLOC_MASK (BF_HUGEPAGE | BF_PREFAULT | BF_MLOCK)
+
+void *bw_mem_alloc(POOL *p, size_t bytes, uint32_t flags);
+void bw_mem_free(POOL *p, void *addr);
+uint32_t bw_mem_default_flags();
+
+/*
+ * Memory budget
+ *
+ * Buffer memory is charged to an account for the pool it was allocated for.
+ * Machine pools are linked to their stream's pool when they're added to a
+ * segment, and subpools to their owner's, so a charge also counts against
+ * every account above it, and against the process-wide account.  An account
+ * with a limit refuses allocations (bw_mem_alloc() returns NULL, errno
+ * EDQUOT) that would take current + reserved bytes past it.  A pool's account
+ * is closed, returning what it holds, when the pool is freed.
+ *
+ * BW_MEM_LIMIT (e.g. "8G") sets the process-wide limit.
+ */
+void bw_mem_set_limit(size_t bytes);
+void bw_mem_set_pool_limit(POOL *p, size_t bytes);
+void bw_mem_link(POOL *p, POOL *parent);
+int bw_mem_charge(POOL *p, size_t bytes);
+void bw_mem_uncharge(POOL *p, size_t bytes);
+int bw_mem_reserve(POOL *p, size_t bytes);
+void bw_mem_unreserve(POOL *p, size_t bytes);
+void bw_mem_get_usage(POOL *p, struct io_metrics_mem_t *usage);
+
+#endif
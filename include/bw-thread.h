@@ -0,0 +1,39 @@
+#ifndef __BW_THREAD__
+#define __BW_THREAD__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BW_MAX_CPUS 1024
+
+// Scheduling policies (same values as <sched.h>)
+#define BW_SCHED_OTHER 0
+#define BW_SCHED_FIFO  1
+#define BW_SCHED_RR    2
+
+/*
+ * Thread placement for segment threads
+ *
+ * Affinity pins the thread to a CPU set.  Priority requests SCHED_FIFO or
+ * SCHED_RR (needs CAP_SYS_NICE or an rtprio limit; failures are logged and
+ * the thread keeps running at normal priority).  With NUMA placement on, the
+ * thread prefers memory on the node of its first pinned CPU, so buffers it
+ * allocates or first touches are local to it.
+ */
+struct bw_thread_attr_t {
+    uint64_t cpus[BW_MAX_CPUS / 64];    // CPU set (used if n_cpus > 0)
+    int n_cpus;                         // CPUs in the set
+    int policy;                         // BW_SCHED_OTHER, _FIFO, or _RR
+    int priority;                       // Realtime priority
+    int numa;                           // Allocate on the node of the pinned CPUs
+};
+
+void bw_thread_attr_init(struct bw_thread_attr_t *attr);
+int bw_thread_attr_set_cpus(struct bw_thread_attr_t *attr, const int *cpus, int n_cpus);
+int bw_thread_apply(const struct bw_thread_attr_t *attr);
+
+int bw_numa_node_of_cpu(int cpu);
+int bw_numa_get_node();
+void bw_numa_place(void *addr, size_t bytes, int node);
+
+#endif
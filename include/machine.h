@@ -2,6 +2,7 @@
 #define __BINGEWATCH_MACHINE_H__
 
 #include <pthread.h>
+#include <stdint.h>
 #include <memex.h>
 #include <sys/time.h>
 
@@ -16,6 +17,15 @@
     #define GB (KB*MB)
 #endif
 
+/*
+ * Memex pools, with bookkeeping: buffer memory and budget accounts (see
+ * bw-mem.h) belong to a pool, and go when it or its owner is freed.  Use
+ * these for any pool that machine memory is charged to.
+ */
+POOL *bw_create_pool();
+POOL *bw_create_subpool(POOL *owner);
+void bw_free_pool(POOL *p);
+
 typedef int IO_HANDLE;
 
 enum bw_status {
@@ -47,6 +57,33 @@ typedef int (*io_rw)(IO_HANDLE, void*, size_t*);
 typedef struct io_desc *(*io_getter)(IO_HANDLE);
 typedef void *(*io_meta)(IO_HANDLE);
 
+// Block borrowing (see block-list-buffer.h)
+struct __block_t;
+typedef int (*io_block_get)(IO_HANDLE, size_t, struct __block_t**);
+typedef int (*io_block_put)(IO_HANDLE, struct __block_t*, size_t);
+
+// Block metadata flags
+#define BLOCK_META_VALID    0x1     // The record is set
+#define BLOCK_META_TIME     0x2     // time_ns is set
+#define BLOCK_META_DISCONT  0x4     // Not contiguous with the data before it
+
+/*
+ * Fixed-size metadata for the first byte of a block (or of a read/write).
+ * Buffers carry it with their blocks, and segments pass it along, so
+ * downstream stages can align and index data without scanning it.
+ */
+struct block_meta_t {
+    uint64_t time_ns;       // Time of the first sample
+    uint64_t sample_index;  // Index of the first sample
+    double sample_rate;     // Samples per second (0: unknown)
+    uint32_t sample_bytes;  // Bytes per sample (0: unknown)
+    uint32_t flags;         // BLOCK_META_*
+    uint32_t source_id;     // Producer (e.g. the source machine handle)
+};
+
+typedef int (*io_meta_get)(IO_HANDLE, struct block_meta_t*);
+typedef int (*io_meta_set)(IO_HANDLE, const struct block_meta_t*);
+
 typedef struct bw_machine {
     // Interface functions
     io_creator create;
@@ -60,6 +97,16 @@ typedef struct bw_machine {
     io_rw write;
     io_meta metrics;
 
+    // Optional block borrowing (NULL if unsupported)
+    io_block_get acquire_read_block;    // Borrow the next full block
+    io_block_put release_read_block;    // Return it, after consuming some bytes
+    io_block_get acquire_write_block;   // Borrow the next empty block
+    io_block_put commit_write_block;    // Publish bytes written into it
+
+    // Optional block metadata (NULL if unsupported)
+    io_meta_get get_read_meta;          // Metadata for the last read
+    io_meta_set set_write_meta;         // Metadata for the next write
+
     // String to identify this io machine
     char *name;
 
@@ -141,9 +188,31 @@ typedef struct io_metrics_data_t {
     void *__impl;
 } IO_METRICS;
 
+// Data discarded by a buffer's overflow policy (updated atomically)
+struct io_metrics_drop_t {
+    size_t bytes;
+    size_t blocks;
+};
+
+// Entries queued and dequeued by entry-based machines (updated atomically)
+struct io_metrics_entries_t {
+    size_t in;
+    size_t out;
+};
+
 struct io_metrics_t {
     IO_METRICS in;
     IO_METRICS out;
+    struct io_metrics_drop_t drop;
+    struct io_metrics_entries_t entries;
+};
+
+// Buffer memory held by a machine (see bw-mem.h)
+struct io_metrics_mem_t {
+    size_t current;
+    size_t peak;
+    size_t reserved;
+    size_t limit;
 };
 
 // Generic struct for describing a machine input or output
@@ -169,15 +238,29 @@ struct io_desc {
     struct io_desc *next;
 };
 
+// Readiness notification (event count) for machines that signal new data
+struct io_event_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t seq;           // Incremented on every notification
+    uint32_t waiters;       // Number of threads parked on cond
+    int closed;             // Machine destroyed: waits return at once
+
+    // Cross-process events: seq and waiters live in shared memory, and
+    // waiters park on a futex instead of cond (NULL: process-local)
+    uint32_t *shared;
+};
+
 typedef struct machine_desc_t {
     IO_HANDLE handle;         // Unique IO Handle
     IOM *machine;             // IO Machine
     POOL *pool;               // Memory management pool
-    char in_use;              // Flag designates machine memory in use
+    int in_use;               // Count of callers using machine memory
     pthread_mutex_t lock;     // Mutex lock for this machine
     struct io_desc *io_read;  // IO read descriptor for this machine
     struct io_desc *io_write; // IO write descriptor for this machine
     struct io_metrics_t *metrics;
+    struct io_event_t *event; // Readiness notification (NULL if unsupported)
     void *next;
 
     // Implementation-specific 
@@ -202,6 +285,11 @@ void machine_metrics_print_start(size_t ms);
 void machine_metrics_print_stop();
 
 struct io_metrics_t *machine_metrics_create(POOL *pool);
+void machine_metrics_drop(struct io_metrics_t *m, size_t bytes, size_t blocks);
+void machine_metrics_get_drop(struct io_metrics_t *m, struct io_metrics_drop_t *drop);
+void machine_metrics_entries(struct io_metrics_t *m, size_t in, size_t out);
+void machine_metrics_get_entries(struct io_metrics_t *m, struct io_metrics_entries_t *entries);
+void machine_metrics_get_mem(IO_HANDLE h, struct io_metrics_mem_t *mem);
 
 void machine_register_desc(struct machine_desc_t *addme, IO_HANDLE *handle);
 struct machine_desc_t *machine_get_desc(IO_HANDLE h);
@@ -211,6 +299,23 @@ int machine_desc_write(IO_HANDLE h, void *buf, size_t *bytes);
 void machine_disable_write(IO_HANDLE h);
 void machine_disable_read(IO_HANDLE h);
 void machine_stop(IO_HANDLE h);
+int machine_desc_event_init(IO_DESC *d);
+int machine_desc_event_init_shared(IO_DESC *d, uint32_t *words);
+void machine_desc_notify(IO_DESC *d);
+int machine_desc_event_seq(IO_DESC *d, uint32_t *seq);
+int machine_desc_event_wait(IO_DESC *d, uint32_t seq, size_t timeout_us);
+void machine_notify(IO_HANDLE h);
+int machine_desc_can_borrow_read(IO_DESC *d);
+int machine_desc_can_borrow_write(IO_DESC *d);
+int machine_desc_acquire_read_block(IO_DESC *d, size_t bytes, struct __block_t **b);
+int machine_desc_release_read_block(IO_DESC *d, struct __block_t *b, size_t bytes);
+int machine_desc_acquire_write_block(IO_DESC *d, size_t bytes, struct __block_t **b);
+int machine_desc_commit_write_block(IO_DESC *d, struct __block_t *b, size_t bytes);
+int machine_desc_get_read_meta(IO_DESC *d, struct block_meta_t *meta);
+int machine_desc_set_write_meta(IO_DESC *d, const struct block_meta_t *meta);
+int machine_get_read_meta(IO_HANDLE h, struct block_meta_t *meta);
+int machine_set_write_meta(IO_HANDLE h, const struct block_meta_t *meta);
+void block_meta_advance(struct block_meta_t *meta, size_t bytes);
 void *machine_metrics(IO_HANDLE h);
 void machine_metrics_print(IO_METRICS *m);
 void machine_metrics_update(IO_METRICS *m);
@@ -222,6 +327,9 @@ IOM *get_machine(const char *name);
 int machine_desc_init(POOL *p, IOM *machine, IO_DESC *b);
 const IOM *get_machine_ref(IO_HANDLE handle);
 IO_HANDLE request_handle(IOM *machine);
+IO_DESC *machine_handle_get_desc(IO_HANDLE handle);
+int machine_handle_set_desc(IO_HANDLE handle, IO_DESC *desc);
+IO_DESC *machine_handle_release(IO_HANDLE handle);
 void machine_cleanup();
 
 #endif
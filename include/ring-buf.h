@@ -7,4 +7,12 @@
 int rb_acquire_write_block(IO_HANDLE h, size_t init_bytes, const struct __block_t **b);
 void rb_release_write_block(IO_HANDLE h, size_t bytes);
 
+int spsc_acquire_write_block(IO_HANDLE h, const struct __block_t **b);
+void spsc_release_write_block(IO_HANDLE h, size_t bytes);
+
+int mirror_acquire_read(IO_HANDLE h, const void **ptr, size_t *bytes);
+void mirror_release_read(IO_HANDLE h, size_t bytes);
+int mirror_acquire_write(IO_HANDLE h, void **ptr, size_t *bytes);
+void mirror_commit_write(IO_HANDLE h, size_t bytes);
+
 #endif
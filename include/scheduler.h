@@ -0,0 +1,32 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+/*
+ * Worker-pool scheduler
+ *
+ * Tasks run on a fixed pool of worker threads shared by every stream that
+ * asks for it.  Each worker has its own run queue, and idle workers steal
+ * from the others.  A task runs for a short quantum and returns:
+ *   SCHED_TASK_YIELD: made progress, requeue it
+ *   SCHED_TASK_IDLE:  its source had no data, requeue it (the worker backs off
+ *                     when everything it holds is idle)
+ *   SCHED_TASK_DONE:  finished, drop it
+ */
+enum sched_task_status_e {
+    SCHED_TASK_DONE=0,
+    SCHED_TASK_YIELD,
+    SCHED_TASK_IDLE,
+};
+
+typedef int (*sched_task_fn)(void*);
+
+struct sched_task_t {
+    sched_task_fn fn;
+    void *arg;
+    struct sched_task_t *next;
+};
+
+int sched_submit(struct sched_task_t *task);
+int sched_get_workers();
+
+#endif
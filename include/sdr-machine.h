@@ -73,6 +73,11 @@ struct sdr_channel_t {
 
     int allow_overruns;
 
+    // Sample metadata: hw_meta is for the next hardware read (drivers set
+    // time_ns and BLOCK_META_TIME when the hardware timestamps samples)
+    struct block_meta_t hw_meta;
+    struct block_meta_t rmeta;
+
     sdr_chan_fn destroy_channel_impl;
 
     void *_impl;
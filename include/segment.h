@@ -1,6 +1,8 @@
 #ifndef __SEGMENT_H__
 #define __SEGMENT_H__
 
+#include <pthread.h>
+
 #include "stream-state.h"
 
 typedef void (*seg_callback)(void*);
@@ -8,17 +10,24 @@ typedef void* IO_SEGMENT;
 
 void segment_register_callback_complete(IO_SEGMENT, seg_callback fn, void *arg);
 void segment_register_callback_error(IO_SEGMENT, seg_callback fn, void *arg);
+void segment_register_callback_stop(IO_SEGMENT, seg_callback fn, void *arg);
 
 IO_SEGMENT segment_create_src(POOL *pool, IO_HANDLE in, IO_HANDLE *src_buf);
 IO_SEGMENT segment_create_1_1(POOL *pool, IO_HANDLE in, IO_HANDLE out);
 IO_SEGMENT segment_create_1_2(POOL *pool, IO_HANDLE in, IO_HANDLE out0, IO_HANDLE out1);
 
-void segment_start(IO_SEGMENT seg, enum stream_state_e *state);
+void segment_start(IO_SEGMENT seg, enum stream_state_e *state, pthread_barrier_t *start);
 void segment_join(IO_SEGMENT seg);
+void segment_set_pooled(IO_SEGMENT seg, int pooled);
 void segment_destroy(IO_SEGMENT seg);
 int segment_is_running(IO_SEGMENT seg);
 
 void segment_set_default_buflen(IO_SEGMENT seg, size_t len);
+void segment_set_wait_policy(IO_SEGMENT seg, size_t spin, size_t park_us);
+int segment_set_affinity(IO_SEGMENT seg, const int *cpus, int n_cpus);
+void segment_set_priority(IO_SEGMENT seg, int policy, int priority);
+void segment_set_numa(IO_SEGMENT seg, int enable);
+void segment_wake(IO_SEGMENT seg);
 void segment_set_group(IO_SEGMENT seg, char **group);
 void segment_set_name(IO_SEGMENT seg, char *name);
 void segment_enable_metrics(IO_SEGMENT seg);
@@ -14,15 +14,99 @@
 
 #define BF_BLOCKFILL 0x1
 
+// Buffer allocation flags (see bw-mem.h)
+#define BF_HUGEPAGE  0x2    // Back the buffer with huge pages
+#define BF_PREFAULT  0x4    // Fault in every page at allocation
+#define BF_MLOCK     0x8    // Lock the buffer in RAM
+
+/*
+ * Overflow policies, for when a buffer is full at its size cap.  Dropped data
+ * is counted in the machine's metrics (struct io_metrics_drop_t).
+ */
+enum bf_overflow_e {
+    BF_OVERFLOW_GROW=0,         // Grow up to the cap, then hold writes back
+    BF_OVERFLOW_DROP_NEWEST,    // Drop incoming data
+    BF_OVERFLOW_DROP_OLDEST,    // Overwrite the oldest unread data
+    BF_OVERFLOW_BLOCK,          // Wait for the reader, dropping incoming data on timeout
+    BF_OVERFLOW_SPILL,          // Ring buffers: spill to a file (rb_set_spill)
+};
+
 extern const IOM *rb_machine;
+struct rbiom_args {
+    size_t buf_bytes;       // 0: allocate on the first write
+    size_t block_bytes;
+    uint32_t flags;         // BF_HUGEPAGE, BF_PREFAULT, BF_MLOCK
+    size_t max_bytes;       // Hard size cap (0: unbounded)
+    uint32_t reclaim_ms;    // Cool-down before idle expansions are released (0: never)
+};
+
 const IOM *get_rb_machine();
 IO_HANDLE new_rb_machine();
+IO_HANDLE new_rb_machine_flags(size_t buffer_size, size_t block_size, uint32_t flags);
 void rb_set_high_water_mark(IO_HANDLE h, size_t bytes);
+void rb_set_max_size(IO_HANDLE h, size_t bytes);
+void rb_set_reclaim_ms(IO_HANDLE h, uint32_t ms);
+void rb_set_overflow(IO_HANDLE h, enum bf_overflow_e policy, uint32_t timeout_ms);
+int rb_set_spill(IO_HANDLE h, const char *dir);
+size_t rb_get_spilled(IO_HANDLE h);
 
 // Deprecated
 size_t rb_get_size(IO_HANDLE h);
 size_t rb_get_bytes(IO_HANDLE h);
 
+// Single-producer/single-consumer Ring Buffer
+extern const IOM *spsc_machine;
+struct spsciom_args {
+    size_t buf_bytes;
+    size_t block_bytes;
+};
+
+const IOM *get_spsc_machine();
+IO_HANDLE new_spsc_machine(size_t buffer_size, size_t block_size);
+size_t spsc_get_size(IO_HANDLE h);
+size_t spsc_get_bytes(IO_HANDLE h);
+
+// Mirrored Ring Buffer (any span up to the capacity is contiguous)
+extern const IOM *mirror_machine;
+struct mirroriom_args {
+    size_t buf_bytes;
+};
+
+const IOM *get_mirror_machine();
+IO_HANDLE new_mirror_machine(size_t buffer_size);
+size_t mirror_get_size(IO_HANDLE h);
+size_t mirror_get_bytes(IO_HANDLE h);
+
+// Shared-memory Ring Buffer (one writer process, one reader process)
+extern const IOM *shm_machine;
+struct shmiom_args {
+    const char *name;
+    size_t buf_bytes;
+};
+
+const IOM *get_shm_machine();
+IO_HANDLE new_shm_machine(const char *name, size_t buffer_size);
+size_t shm_get_size(IO_HANDLE h);
+size_t shm_get_bytes(IO_HANDLE h);
+
+// Broadcast Ring Buffer (one writer, many readers)
+extern const IOM *bcast_machine;
+
+enum bcast_policy_e {
+    BCAST_STALL=0,      // The writer waits for this reader
+    BCAST_DROP,         // This reader skips ahead when it falls behind
+};
+
+struct bcastiom_args {
+    size_t buf_bytes;
+    size_t block_bytes;
+};
+
+const IOM *get_bcast_machine();
+IO_HANDLE new_bcast_machine(size_t buffer_size, size_t block_size);
+IO_HANDLE bcast_add_reader(IO_HANDLE h, enum bcast_policy_e policy, size_t max_lag_bytes);
+size_t bcast_get_dropped(IO_HANDLE reader);
+
 // Fixed-size Block Buffer
 extern const IOM *fbb_machine;
 struct fbbiom_args {
@@ -34,6 +118,10 @@ struct fbbiom_args {
 
 const IOM *get_fbb_machine();
 IO_HANDLE new_fbb_machine(size_t buffer_size, size_t block_size);
+IO_HANDLE new_fbb_machine_flags(size_t buffer_size, size_t block_size, uint32_t flags);
+IO_HANDLE new_fbb_machine_fill(size_t buffer_size, size_t block_size);
+void fbb_set_max_size(IO_HANDLE h, size_t bytes);
+void fbb_set_overflow(IO_HANDLE h, enum bf_overflow_e policy, uint32_t timeout_ms);
 
 // Deprecated
 size_t fbb_get_size(IO_HANDLE h);
@@ -47,16 +135,22 @@ struct sync_iom_args {
     uint16_t align;
 };
 
-// Asynchronous Variable-Block Buffer
+// Asynchronous Variable-Block Buffer (one whole record per read; a read
+// too small for the next record returns IO_ERROR and leaves it queued)
+extern const IOM *avbb_machine;
 struct avbb_args {
-    size_t block_bytes;
-    size_t block_count;
+    size_t block_bytes;     // Largest record
+    size_t block_count;     // Largest records the arena holds
 };
 
 const IOM *get_avbb_machine();
 void avbbiom_update_defaults(struct avbb_args *rb);
+IO_HANDLE new_avbb_machine(size_t record_bytes, size_t record_count);
+size_t avbb_get_size(IO_HANDLE h);
+size_t avbb_get_bytes(IO_HANDLE h);
 
 // Asynchronous Fixed Packet Buffer
+extern const IOM *afpb_machine;
 struct afpbiom_args {
     size_t header_bytes;
     size_t payload_bytes;
@@ -65,6 +159,7 @@ struct afpbiom_args {
 
 const IOM *get_afpb_machine();
 void afpbiom_update_defaults(struct afpbiom_args *afpb);
+IO_HANDLE new_afpb_machine(size_t header_bytes, size_t payload_bytes, size_t packet_count);
 
 struct afpb_packet {
     char *packet;
@@ -84,11 +179,12 @@ extern const IOM *hq_machine;
 enum handle_queue_type_e {
     HQ_TYPE_FIFO=0,
     HQ_TYPE_STACK,
+    HQ_TYPE_PRIORITY,   // Earliest "tv" first, within a reorder window
 };
 
 #define HQ_TAGLEN 64
 typedef struct hqiom_entry_t {
-    POOL *pool;
+    POOL *pool;         // Owns "buf" (NULL for recycled buffers)
     void *buf;
     size_t bytes;
     struct timeval tv;
@@ -96,11 +192,21 @@ typedef struct hqiom_entry_t {
 
 struct hqiom_args {
     int type;
+    size_t window_us;       // HQ_TYPE_PRIORITY: reorder window
+    uint32_t latency_ms;    // HQ_TYPE_PRIORITY: longest an entry is held
 };
 
 IO_HANDLE new_hq_machine();
 IO_HANDLE new_hq_fifo_machine();
 IO_HANDLE new_hq_stack_machine();
+IO_HANDLE new_hq_priority_machine(size_t window_us, uint32_t latency_ms);
+
+// Entries read from a queue are returned with hq_entry_release()
+int hq_entry_alloc(IO_HANDLE h, size_t bytes, HQ_ENTRY *e);
+int hq_write_entry(IO_HANDLE h, HQ_ENTRY *e);
+int hq_write_entries(IO_HANDLE h, HQ_ENTRY *e, size_t *n);
+int hq_read_entries(IO_HANDLE h, HQ_ENTRY *e, size_t *n);
+void hq_entry_release(HQ_ENTRY *e);
 
 int is_in_use(IO_HANDLE h);
 
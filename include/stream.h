@@ -6,6 +6,11 @@ typedef int IO_STREAM;
 #define BW_NOFLAGS  0x0
 #define BW_BUFFERED 0x1
 
+enum stream_scheduler_e {
+    STREAM_SCHED_THREAD=0,  // One thread per segment
+    STREAM_SCHED_POOL,      // Segments share a pool of worker threads
+};
+
 IO_STREAM new_stream();
 int start_stream(IO_STREAM s);
 int stop_stream(IO_STREAM s);
@@ -16,9 +21,24 @@ void stream_cleanup();
 int io_stream_add_src_segment(IO_STREAM h, int in, int out);
 int io_stream_add_segment(IO_STREAM h, int in, int out);
 int io_stream_add_tee_segment(IO_STREAM h, int in, int out, int out1);
+int io_stream_add_fanout_segment(IO_STREAM h, int in, int *out, int n_out, int policy, size_t max_lag_bytes);
 void stream_set_name(IO_STREAM h, const char *name);
 void stream_enable_metrics(IO_STREAM h);
 void stream_print_metrics(IO_STREAM h);
 void stream_set_default_buflen(IO_STREAM h, size_t len);
+void stream_set_wait_policy(IO_STREAM h, size_t spin, size_t park_us);
+void stream_set_scheduler(IO_STREAM h, int sched);
+
+// Memory budget (see bw-mem.h)
+struct io_metrics_mem_t;
+void stream_set_mem_limit(IO_STREAM h, size_t bytes);
+void stream_get_mem(IO_STREAM h, struct io_metrics_mem_t *mem);
+
+// Thread placement (policy: SCHED_OTHER, SCHED_FIFO or SCHED_RR)
+#define STREAM_ALL_SEGMENTS -1
+int stream_get_segment_count(IO_STREAM h);
+int stream_set_affinity(IO_STREAM h, int segment, const int *cpus, int n_cpus);
+int stream_set_priority(IO_STREAM h, int segment, int policy, int priority);
+void stream_set_numa(IO_STREAM h, int enable);
 
 #endif
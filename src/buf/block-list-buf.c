@@ -4,51 +4,72 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/sysinfo.h>
 
 #include "machine.h"
 #include "filter.h"
 #include "block-list-buffer.h"
 #include "bw-util.h"
+#include "bw-thread.h"
+#include "bw-mem.h"
 
 #define LOGEX_TAG "BL-BUF"
 #include "logging.h"
 #include "bw-log.h"
 
+#define BLOCK_LIST_ALIGN 64
+
 // Holds all of the __buffer structs
 static pthread_mutex_t buffer_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Returns a linked list of empty, custom-sized block descriptors
+ *
+ * The descriptors are one cache-aligned array (a segment), linked in array
+ * order, so walking the list walks memory sequentially.  Lists that grow add
+ * a segment at a time.  A segment is freed as a whole, with block_list_free().
  */
 struct __block_t *
 block_list_alloc_custom(POOL *p, size_t size_of, size_t block_count)
 {
-    struct __block_t *blocks = NULL;
-    struct __block_t *b = NULL;
-
     if (0 == block_count) {
         printf("%s: WARNING: Block count is zero\n", __FUNCTION__);
         return NULL;
     }
 
-    size_t remaining = block_count;
-    while (remaining--) {
-        struct __block_t *new = pcalloc(p, size_of);
-        if (!new) {
-            printf("Failed to allocate %zu bytes for block descriptor\n", size_of);
-            return NULL;
-        }
+    // The allocation's address is kept just before the array, for freeing
+    size_t bytes = size_of * block_count;
+    char *mem = pcalloc(p, bytes + BLOCK_LIST_ALIGN + sizeof(void *));
+    if (!mem) {
+        printf("Failed to allocate %zu bytes for block descriptors\n", bytes);
+        return NULL;
+    }
 
-        if (!b) {
-            blocks = new;
-        } else {
-            b->next = new;
-        }
-        b = new;
+    uintptr_t addr = (uintptr_t)(mem + sizeof(void *));
+    addr = (addr + BLOCK_LIST_ALIGN - 1) & ~(uintptr_t)(BLOCK_LIST_ALIGN - 1);
+    char *blocks = (char *)addr;
+    ((void **)blocks)[-1] = mem;
+
+    size_t n = 0;
+    for (; n < block_count - 1; n++) {
+        struct __block_t *b = (struct __block_t *)(blocks + n * size_of);
+        b->next = blocks + (n + 1) * size_of;
     }
 
-    return blocks;
+    return (struct __block_t *)blocks;
+}
+
+/*
+ * Free a segment of block descriptors from block_list_alloc()
+ */
+void
+block_list_free(POOL *p, struct __block_t *blocks)
+{
+    if (!blocks) {
+        return;
+    }
+    pfree(p, ((void **)blocks)[-1]);
 }
 
 /*
@@ -112,6 +133,15 @@ block_data_alloc(POOL *p, void *block, size_t bytes_per_block) {
  */
 size_t
 block_data_fastalloc(POOL *p, void *block, size_t bytes_per_block) {
+    return block_data_fastalloc_flags(p, block, bytes_per_block, 0);
+}
+
+/*
+ * Same, with buffer allocation flags (BF_HUGEPAGE, BF_PREFAULT, BF_MLOCK).
+ * Flags from BW_BUF_ALLOC are always added.
+ */
+size_t
+block_data_fastalloc_flags(POOL *p, void *block, size_t bytes_per_block, uint32_t flags) {
     if (!block) {
         return 0;
     }
@@ -147,12 +177,18 @@ block_data_fastalloc(POOL *p, void *block, size_t bytes_per_block) {
 
     // Allocate memory
     size_t bytes = n_blocks * bytes_per_block;
-    char *buf = palloc(p, bytes);
-    if (!buf) {
+    char *buf = bw_mem_alloc(p, bytes, flags | bw_mem_default_flags());
+    if (!buf && errno == EDQUOT) {
+        debug("Block buffer is over the memory budget");
+        return 0;
+    } else if (!buf) {
         error("Failed to allocate bytes for block buffer", bytes);
         return 0;
     }
 
+    // Threads with NUMA placement keep their buffers local
+    bw_numa_place(buf, bytes, bw_numa_get_node());
+
     // Partition buffer into blocks
     struct __block_t *final_next = b;
     b = (struct __block_t *)block;
@@ -191,7 +227,8 @@ forge_ring(void *blocklist)
 struct blb_rw_t *
 blb_init_rw(POOL *pool, size_t bytes_per_block, size_t n_blocks)
 {
-    POOL *p = create_subpool(pool);
+    POOL *p = bw_create_subpool(pool);
+    bw_mem_link(p, pool);
 
     // Init BLB
     struct blb_rw_t *ret = palloc(p, sizeof(struct blb_rw_t));
@@ -219,7 +256,7 @@ blb_rw_destroy(struct blb_rw_t *rw)
     }
 
     POOL *freeme = rw->pool;
-    free_pool(freeme);
+    bw_free_pool(freeme);
 }
 
 int
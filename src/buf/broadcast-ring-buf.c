@@ -0,0 +1,717 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+
+#define LOGEX_TAG "BCAST-BUF"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_BUF_BYTES 64*MB
+#define DEFAULT_BLK_BYTES  1*MB
+
+static size_t default_buf_bytes = DEFAULT_BUF_BYTES;
+static size_t default_blk_bytes = DEFAULT_BLK_BYTES;
+
+const IOM *bcast_machine;
+static IOM *_bcast_machine = NULL;
+static IOM *_bcast_reader_machine = NULL;
+
+struct bcast_t;
+
+/*
+ * Reader endpoint
+ *
+ * Each reader is its own machine (and handle), so it can be the input of its
+ * own segment.  "tail" is the sequence number of the next block to read.
+ */
+struct bcast_reader_t {
+    IO_DESC _b;  // Generic buffer
+
+    struct bcast_t *ring;       // Shared ring (NULL once the ring is destroyed)
+    enum bcast_policy_e policy; // What happens when this reader falls behind
+    size_t max_lag;             // Max blocks behind the writer (DROP)
+
+    size_t tail;                // Next block to read
+    size_t offset;              // Bytes already read from the tail block
+    int pinned;                 // Reading blocks from tail, outside the lock
+    int detached;               // Stopped: the writer no longer waits for it
+    struct __block_t view;      // Private view of a borrowed block
+
+    size_t dropped_blocks;      // Blocks skipped to catch up
+    size_t dropped_bytes;
+
+    struct bcast_reader_t *next;
+};
+
+/*
+ * Broadcast ring: one writer, many readers
+ *
+ * Blocks are addressed by free-running sequence numbers.  The writer may fill
+ * sequence "head" once every STALL reader (and every pinned DROP reader) is
+ * less than a full ring behind it.  Unpinned DROP readers are never waited on;
+ * they skip ahead on their next read.  Cursors are guarded by rlock, and the
+ * data is copied outside of it.
+ */
+struct bcast_t {
+    IO_DESC _b;  // Generic buffer
+
+    struct __block_t *blocks;   // Contiguous block descriptors
+    size_t n_blocks;            // Number of blocks in the ring
+    size_t block_size;          // Bytes per block
+    size_t size;                // Total buffer capacity in bytes
+
+    pthread_mutex_t rlock;      // Cursor lock
+    pthread_cond_t space;       // Signalled when readers release blocks
+    size_t head;                // Next block to publish
+    int writing;                // The writer is filling block "head"
+    int flush;                  // Keep reading available until readers drain
+
+    struct bcast_reader_t *readers;
+};
+
+static inline struct __block_t *
+bcast_block(struct bcast_t *r, size_t n)
+{
+    return r->blocks + (n % r->n_blocks);
+}
+
+/*
+ * Oldest sequence number the writer must not overwrite (rlock held)
+ */
+static size_t
+oldest_hold(struct bcast_t *r)
+{
+    size_t hold = r->head;
+
+    struct bcast_reader_t *rd = r->readers;
+    for (; rd; rd = rd->next) {
+        if (rd->detached) {
+            continue;
+        }
+
+        if (rd->policy == BCAST_STALL || rd->pinned) {
+            if (rd->tail < hold) {
+                hold = rd->tail;
+            }
+        }
+    }
+    return hold;
+}
+
+/*
+ * Claim block "head" for writing.  Waits for STALL readers to make room.
+ * Returns NULL if the ring was stopped while waiting.
+ */
+static struct __block_t *
+writer_claim(struct bcast_t *r)
+{
+    struct __block_t *b = NULL;
+
+    pthread_mutex_lock(&r->rlock);
+    while (!r->flush && (r->head - oldest_hold(r)) >= r->n_blocks) {
+        pthread_cond_wait(&r->space, &r->rlock);
+    }
+
+    if (!r->flush) {
+        r->writing = 1;
+        b = bcast_block(r, r->head);
+    }
+    pthread_mutex_unlock(&r->rlock);
+
+    return b;
+}
+
+static void
+writer_publish(struct bcast_t *r, struct __block_t *b, size_t bytes)
+{
+    pthread_mutex_lock(&r->rlock);
+    r->writing = 0;
+    if (bytes) {
+        b->bytes = bytes;
+        r->head++;
+    }
+    pthread_mutex_unlock(&r->rlock);
+
+    // Readers share the ring's event
+    if (bytes) {
+        machine_desc_notify(&r->_b);
+    }
+}
+
+/*
+ * Skip a DROP reader forward if it lags too far behind, or if the writer is
+ * about to overwrite its next block (rlock held)
+ */
+static void
+reader_catch_up(struct bcast_t *r, struct bcast_reader_t *rd)
+{
+    if (rd->policy != BCAST_DROP) {
+        return;
+    }
+
+    size_t max_lag = rd->max_lag;
+    size_t limit = r->n_blocks - ((r->writing) ? 1 : 0);
+    if (max_lag == 0 || max_lag > limit) {
+        max_lag = limit;
+    }
+
+    size_t behind = r->head - rd->tail;
+    if (behind <= max_lag) {
+        return;
+    }
+
+    size_t skip = behind - max_lag;
+    rd->dropped_blocks += skip;
+    rd->dropped_bytes += skip * r->block_size - rd->offset;
+    rd->tail += skip;
+    rd->offset = 0;
+}
+
+/*
+ * Pin the reader to its tail, so its blocks aren't overwritten while they are
+ * copied.  Returns the number of readable blocks, or 0 if there are none.
+ */
+static size_t
+reader_pin(struct bcast_t *r, struct bcast_reader_t *rd, int *flush)
+{
+    pthread_mutex_lock(&r->rlock);
+    reader_catch_up(r, rd);
+
+    *flush = r->flush;
+    size_t avail = r->head - rd->tail;
+    if (avail) {
+        rd->pinned = 1;
+    }
+    pthread_mutex_unlock(&r->rlock);
+
+    return avail;
+}
+
+static void
+reader_unpin(struct bcast_t *r, struct bcast_reader_t *rd, size_t tail, size_t offset)
+{
+    pthread_mutex_lock(&r->rlock);
+    rd->tail = tail;
+    rd->offset = offset;
+    rd->pinned = 0;
+    pthread_cond_signal(&r->space);
+    pthread_mutex_unlock(&r->rlock);
+}
+
+static int
+reader_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get reader from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)d;
+    if (!rd || !rd->ring) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    struct bcast_t *r = rd->ring;
+
+    int flush;
+    size_t avail = reader_pin(r, rd, &flush);
+    if (avail == 0) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_SUCCESS;
+    }
+
+    char *data = IO_FILTER_ARGS_BUF;
+    size_t remaining = *IO_FILTER_ARGS_BYTES;
+    remaining -= remaining % IO_FILTER_ARGS_ALIGN;
+    size_t bytes_read = 0;
+
+    size_t tail = rd->tail;
+    size_t offset = rd->offset;
+    size_t end = tail + avail;
+
+    while (remaining && tail != end) {
+        struct __block_t *b = bcast_block(r, tail);
+        size_t unread = b->bytes - offset;
+        size_t n = (remaining < unread) ? remaining : unread;
+
+        bw_memcpy(data, b->data + offset, n);
+        data += n;
+        remaining -= n;
+        bytes_read += n;
+
+        // Partial reads advance the cursor
+        if (n < unread) {
+            offset += n;
+        } else {
+            tail++;
+            offset = 0;
+        }
+    }
+
+    reader_unpin(r, rd, tail, offset);
+
+    *IO_FILTER_ARGS_BYTES = bytes_read;
+    return IO_SUCCESS;
+}
+
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    char *data = IO_FILTER_ARGS_BUF;
+    size_t written = 0;
+    size_t remaining = *IO_FILTER_ARGS_BYTES;
+
+    while (remaining) {
+        struct __block_t *b = writer_claim(r);
+        if (!b) {
+            break;
+        }
+
+        size_t n = (remaining < b->size) ? remaining : b->size;
+        bw_memcpy_stream(b->data, data, n);
+        writer_publish(r, b, n);
+
+        data += n;
+        remaining -= n;
+        written += n;
+    }
+
+    *IO_FILTER_ARGS_BYTES = written;
+    return IO_SUCCESS;
+}
+
+/*
+ * Block borrowing
+ */
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(h);
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    *b = writer_claim(r);
+    return (*b) ? IO_SUCCESS : IO_COMPLETE;
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    writer_publish(r, b, bytes);
+    return IO_SUCCESS;
+}
+
+/*
+ * Readers borrow a private view of the shared block, since each has its own
+ * read offset
+ */
+static int
+reader_acquire_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)d;
+    if (!rd || !rd->ring) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    struct bcast_t *r = rd->ring;
+
+    int flush;
+    if (reader_pin(r, rd, &flush) == 0) {
+        *b = NULL;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    struct __block_t *src = bcast_block(r, rd->tail);
+    rd->view.data = src->data;
+    rd->view.size = src->size;
+    rd->view.bytes = src->bytes;
+    rd->view.offset = rd->offset;
+
+    *b = &rd->view;
+    return IO_SUCCESS;
+}
+
+static int
+reader_release_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)machine_get_desc(h);
+    if (!rd || !rd->ring) {
+        return IO_ERROR;
+    }
+
+    size_t tail = rd->tail;
+    size_t offset = rd->offset + bytes;
+    if (offset >= b->bytes) {
+        tail++;
+        offset = 0;
+    }
+
+    reader_unpin(rd->ring, rd, tail, offset);
+    return IO_SUCCESS;
+}
+
+/*
+ * Create/destroy broadcast buffers
+ */
+static void
+destroy_reader(IO_HANDLE h)
+{
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)machine_get_desc(h);
+    if (!rd) {
+        return;
+    }
+
+    // Unlink from the ring
+    struct bcast_t *r = rd->ring;
+    if (r) {
+        pthread_mutex_lock(&r->rlock);
+        struct bcast_reader_t **p = &r->readers;
+        while (*p && *p != rd) {
+            p = &(*p)->next;
+        }
+        if (*p) {
+            *p = rd->next;
+        }
+        pthread_cond_signal(&r->space);
+        pthread_mutex_unlock(&r->rlock);
+
+        // The event belongs to the writer: don't close it for the other
+        // readers, but wake this one if it might be parked
+        rd->_b.event = NULL;
+        if (__atomic_load_n(&rd->_b.in_use, __ATOMIC_ACQUIRE)) {
+            machine_desc_notify((IO_DESC *)r);
+        }
+    }
+
+    machine_destroy_desc(h);
+}
+
+static void
+destroy_bcast_machine(IO_HANDLE h)
+{
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(h);
+    if (!r) {
+        return;
+    }
+
+    // Readers share the ring's memory, so they go first
+    pthread_mutex_lock(&r->rlock);
+    struct bcast_reader_t *rd = r->readers;
+    r->readers = NULL;
+    pthread_mutex_unlock(&r->rlock);
+
+    while (rd) {
+        struct bcast_reader_t *next = rd->next;
+        rd->ring = NULL;
+        machine_destroy_desc(rd->_b.handle);
+        rd = next;
+    }
+
+    machine_destroy_desc(h);
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    size_t buf_bytes = default_buf_bytes;
+    size_t block_bytes = default_blk_bytes;
+
+    struct bcastiom_args *args = (struct bcastiom_args *)arg;
+    if (args && args->buf_bytes) {
+        buf_bytes = args->buf_bytes;
+    }
+    if (args && args->block_bytes) {
+        block_bytes = args->block_bytes;
+    }
+
+    size_t block_count = buf_bytes / block_bytes;
+    if ((block_count * block_bytes) < buf_bytes) {
+        block_count++;
+    }
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_bcast_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    // Create a new buffer descriptor
+    struct bcast_t *r = pcalloc(p, sizeof(struct bcast_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    // Block descriptors are a single array, linked for the block allocator
+    struct __block_t *blocks = pcalloc(p, block_count * sizeof(struct __block_t));
+    if (!blocks) {
+        error("Failed to create block descriptors");
+        goto free_and_return;
+    }
+
+    size_t i = 0;
+    for (; i < block_count; i++) {
+        blocks[i].next = &blocks[(i + 1) % block_count];
+    }
+
+    size_t bytes = block_data_fastalloc(p, blocks, block_bytes);
+    if (bytes == 0) {
+        error("Failed to allocate block data");
+        goto free_and_return;
+    }
+
+    r->blocks = blocks;
+    r->n_blocks = bytes / block_bytes;
+    r->block_size = block_bytes;
+    r->size = bytes;
+
+    pthread_mutex_init(&r->rlock, NULL);
+    pthread_cond_init(&r->space, NULL);
+
+    if (machine_desc_init(p, _bcast_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
+    if (!filter_write_init(p, "bcast_buf_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+free_and_return:
+    bw_free_pool(p);
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    IO_DESC *d = (IO_DESC *)r;
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+    }
+
+    // Allow readers to drain, and release a waiting writer
+    pthread_mutex_lock(&r->rlock);
+    r->flush = 1;
+    pthread_cond_broadcast(&r->space);
+    pthread_mutex_unlock(&r->rlock);
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
+}
+
+/*
+ * Stopping a reader detaches it, so a STALL reader that quits can't block the
+ * writer
+ */
+static void
+stop_reader(IO_HANDLE h)
+{
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)machine_get_desc(h);
+    if (!rd) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    struct bcast_t *r = rd->ring;
+    if (r) {
+        pthread_mutex_lock(&r->rlock);
+        rd->detached = 1;
+        pthread_cond_signal(&r->space);
+        pthread_mutex_unlock(&r->rlock);
+    }
+
+    IO_DESC *d = (IO_DESC *)rd;
+    if (d->io_read) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+    }
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    IO_DESC *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return d->metrics;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_bcast_machine()
+{
+    IOM *machine = _bcast_machine;
+    if (!machine) {
+        machine = machine_register("broadcast_ring_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_bcast_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+
+        _bcast_machine = machine;
+        bcast_machine = machine;
+
+        // Reader endpoints are created with bcast_add_reader()
+        IOM *reader = machine_register("broadcast_ring_reader");
+        reader->stop = stop_reader;
+        reader->destroy = destroy_reader;
+        reader->metrics = get_metrics;
+        reader->acquire_read_block = reader_acquire_block;
+        reader->release_read_block = reader_release_block;
+
+        _bcast_reader_machine = reader;
+    }
+    return (const IOM *)machine;
+}
+
+IO_HANDLE
+new_bcast_machine(size_t buffer_size, size_t block_size)
+{
+    const IOM *m = get_bcast_machine();
+
+    struct bcastiom_args args = {buffer_size, block_size};
+    return m->create(&args);
+}
+
+/*
+ * Add a reader endpoint.  New readers start at the writer's current position.
+ *   max_lag_bytes: DROP readers skip ahead once they are this far behind
+ *                  (0 means the whole ring)
+ */
+IO_HANDLE
+bcast_add_reader(IO_HANDLE h, enum bcast_policy_e policy, size_t max_lag_bytes)
+{
+    IO_HANDLE rh = 0;
+
+    struct bcast_t *r = (struct bcast_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return 0;
+    }
+
+    POOL *p = bw_create_subpool(_bcast_reader_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    struct bcast_reader_t *rd = pcalloc(p, sizeof(struct bcast_reader_t));
+    if (!rd) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    rd->ring = r;
+    rd->policy = policy;
+    rd->max_lag = (max_lag_bytes + r->block_size - 1) / r->block_size;
+
+    if (machine_desc_init(p, _bcast_reader_machine, (IO_DESC *)rd) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    // Readers wait on the writer's event
+    rd->_b.event = r->_b.event;
+
+    if (!filter_read_init(p, "bcast_buf_r", reader_read, (IO_DESC *)rd)) {
+        error("Failed to initialize read filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)rd, &rh);
+
+    pthread_mutex_lock(&r->rlock);
+    rd->tail = r->head;
+    rd->next = r->readers;
+    r->readers = rd;
+    pthread_mutex_unlock(&r->rlock);
+
+    return rh;
+
+free_and_return:
+    bw_free_pool(p);
+    return rh;
+}
+
+/*
+ * Number of blocks a DROP reader has skipped
+ */
+size_t
+bcast_get_dropped(IO_HANDLE reader)
+{
+    struct bcast_reader_t *rd = (struct bcast_reader_t *)machine_get_desc(reader);
+    if (!rd || !rd->ring) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&rd->ring->rlock);
+    size_t dropped = rd->dropped_blocks;
+    pthread_mutex_unlock(&rd->ring->rlock);
+
+    return dropped;
+}
@@ -3,11 +3,15 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
 
 #include "machine.h"
 #include "filter.h"
 #include "block-list-buffer.h"
 #include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
 
 #define LOGEX_TAG "FXB-BUF"
 #include "logging.h"
@@ -24,6 +28,13 @@ static uint16_t default_align = DEFAULT_ALIGN;
 const IOM *fbb_machine;
 static IOM *_fbb_machine = NULL;
 
+// Result of making room for the next block
+enum fbb_room_e {
+    FBB_ROOM_READY=0,       // The block after the write block is empty
+    FBB_ROOM_FULL,          // Full: hold the write back
+    FBB_ROOM_DROP,          // Full: drop the write
+};
+
 // Ring descriptor
 struct ring_t {
     IO_DESC _b;  // Generic buffer
@@ -35,11 +46,53 @@ struct ring_t {
     pthread_mutex_t wlock; // Mutex lock for writing to this ring
     pthread_mutex_t rlock; // Mutex lock for reading to this ring
     size_t block_size;   // Bytes per block
-    int fill;
+    int fill;            // BF_BLOCKFILL: pack writes into blocks
+    size_t wfill;        // BF_BLOCKFILL: bytes in the write block, not yet published
+    uint32_t alloc_flags;  // Buffer allocation flags (BF_HUGEPAGE, etc.)
+
+    size_t max_bytes;      // Hard cap on the ring size (0: unbounded)
+    enum bf_overflow_e overflow; // What to do when full at the cap
+    uint32_t timeout_ms;   // BF_OVERFLOW_BLOCK: longest wait for the reader
+    pthread_cond_t space;  // Signalled when the reader frees a block
+    int space_waiters;     // Writers waiting on "space"
+    struct __block_t *scratch; // Borrowed in place of a block that will be dropped
+    int scratch_out;       // The scratch block is borrowed
+
+    struct block_meta_t wmeta; // Metadata for the next write (advanced as it's written)
+    struct block_meta_t rmeta; // Metadata for the last read
 };
 
 static pthread_mutex_t fbb_machine_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static void publish_block(struct ring_t *ring, struct __block_t *b, size_t bytes);
+
+/*
+ * BF_BLOCKFILL: once the reader has caught up, publish the partly filled write
+ * block, unless a write is in progress.  Room after the write block was made
+ * when it was started.  Called with rlock held.
+ */
+static int
+flush_fill_block(struct ring_t *ring)
+{
+    if (!ring->fill || pthread_mutex_trylock(&ring->wlock) != 0) {
+        return 0;
+    }
+
+    size_t bytes = ring->wfill;
+    if (bytes == 0) {
+        pthread_mutex_unlock(&ring->wlock);
+        return 0;
+    }
+
+    ring->wfill = 0;
+    publish_block(ring, ring->wp, bytes);
+    return 1;
+}
+
+/*
+ * Reads return as much of the next block as fits; the rest is returned by the
+ * next read.
+ */
 static int
 buf_read(IO_FILTER_ARGS)
 {
@@ -55,7 +108,7 @@ buf_read(IO_FILTER_ARGS)
     pthread_mutex_lock(&ring->rlock);
     struct __block_t *b = ring->rp;
 
-    if (b->bytes == 0) {
+    if (BLOCK_UNREAD(b) == 0 && !flush_fill_block(ring)) {
         pthread_mutex_unlock(&ring->rlock);
         *IO_FILTER_ARGS_BYTES = 0;
         return IO_SUCCESS;
@@ -63,35 +116,203 @@ buf_read(IO_FILTER_ARGS)
 
     // Initialize read vars
     pthread_mutex_t *lock = &ring->_b.lock;
-    size_t bytes = b->bytes;
+    size_t bytes = BLOCK_UNREAD(b);
+    if (bytes > *IO_FILTER_ARGS_BYTES) {
+        bytes = *IO_FILTER_ARGS_BYTES;
+    }
 
     // Align bytes
     while (bytes % IO_FILTER_ARGS_ALIGN != 0) {
         bytes--;
     }
 
-    if (*IO_FILTER_ARGS_BYTES >= bytes) {
-        memcpy(IO_FILTER_ARGS_BUF, b->data, bytes);
-        *IO_FILTER_ARGS_BYTES = bytes;
-    } else {
-        printf("WARNING: block length (%zu) exceeds return buffer (%zu).  Ignoring this block\n",
-            b->bytes, *IO_FILTER_ARGS_BYTES);
-        *IO_FILTER_ARGS_BYTES = 0;
-    }
+    bw_memcpy(IO_FILTER_ARGS_BUF, b->data + b->offset, bytes);
+    *IO_FILTER_ARGS_BYTES = bytes;
+
+    ring->rmeta = b->meta;
+    block_meta_advance(&ring->rmeta, b->offset);
 
     pthread_mutex_lock(lock);
-    ring->bytes -= b->bytes;
-    b->bytes = 0;
+    b->offset += bytes;
+    ring->bytes -= bytes;
+
+    // Done with the block; an unaligned tail is dropped
+    if (BLOCK_UNREAD(b) < IO_FILTER_ARGS_ALIGN) {
+        ring->bytes -= BLOCK_UNREAD(b);
+        b->offset = 0;
+        b->bytes = 0;
+        ring->rp = b->next;
+        if (ring->space_waiters) {
+            pthread_cond_broadcast(&ring->space);
+        }
+    }
     pthread_mutex_unlock(lock);
 
     // Unlock reading from this buffer
-    ring->rp = b->next;
     pthread_mutex_unlock(&ring->rlock);
 
     return IO_SUCCESS;
 }
 
-// Write to a buffer
+/*
+ * Full at the cap: apply the overflow policy.  Called with wlock held.
+ */
+static enum fbb_room_e
+ring_full(struct ring_t *ring)
+{
+    pthread_mutex_t *lock = &ring->_b.lock;
+    struct __block_t *next = ring->wp->next;
+
+    switch (ring->overflow) {
+    case BF_OVERFLOW_DROP_NEWEST:
+        return FBB_ROOM_DROP;
+
+    case BF_OVERFLOW_DROP_OLDEST: {
+        // The block after the writer is the oldest unread block
+        pthread_mutex_lock(&ring->rlock);
+        pthread_mutex_lock(lock);
+        if (ring->rp != next) {
+            pthread_mutex_unlock(lock);
+            pthread_mutex_unlock(&ring->rlock);
+            return FBB_ROOM_FULL;
+        }
+
+        size_t bytes = BLOCK_UNREAD(next);
+        next->offset = 0;
+        next->bytes = 0;
+        ring->bytes -= bytes;
+        ring->rp = next->next;
+        pthread_mutex_unlock(lock);
+        pthread_mutex_unlock(&ring->rlock);
+
+        machine_metrics_drop(ring->_b.metrics, bytes, 1);
+        return FBB_ROOM_READY;
+    }
+
+    case BF_OVERFLOW_BLOCK: {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ring->timeout_ms / 1000;
+        ts.tv_nsec += (long)(ring->timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(lock);
+        ring->space_waiters++;
+        int rc = 0;
+        while (!BLOCK_EMPTY(next) && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&ring->space, lock, &ts);
+        }
+        ring->space_waiters--;
+        int empty = BLOCK_EMPTY(next);
+        pthread_mutex_unlock(lock);
+
+        return (empty) ? FBB_ROOM_READY : FBB_ROOM_DROP;
+    }
+
+    default:
+        return FBB_ROOM_FULL;
+    }
+}
+
+/*
+ * Make sure the block after the write block is empty before the write block
+ * is published, so the writer can always move on.  Grows the ring up to the
+ * cap; past it, the overflow policy decides.  Called with wlock held.
+ */
+static enum fbb_room_e
+make_room(struct ring_t *ring)
+{
+    pthread_mutex_t *lock = &ring->_b.lock;
+    struct __block_t *b = ring->wp;
+
+    pthread_mutex_lock(lock);
+    struct __block_t *next = b->next;
+    int empty = BLOCK_EMPTY(next);
+    pthread_mutex_unlock(lock);
+
+    if (empty) {
+        return FBB_ROOM_READY;
+    }
+
+    // Only growing rings expand without a cap
+    size_t cap = ring->max_bytes;
+    if (!cap && ring->overflow != BF_OVERFLOW_GROW) {
+        cap = ring->size;
+    }
+
+    // One extra block, or as many as fit under the cap
+    size_t block_count = 2;
+    if (cap) {
+        size_t room = (cap > ring->size) ? (cap - ring->size) / ring->block_size : 0;
+        if (room == 0) {
+            return ring_full(ring);
+        }
+        block_count = (block_count < room) ? block_count : room;
+    }
+
+    struct __block_t *add = block_list_alloc(ring->_b.pool, block_count);
+    size_t added = block_data_fastalloc_flags(ring->_b.pool, add, ring->block_size,
+        ring->alloc_flags);
+    if (added == 0) {
+        block_list_free(ring->_b.pool, add);
+        return FBB_ROOM_FULL;
+    }
+
+    struct __block_t *tail = add;
+    while (tail->next) {
+        tail = tail->next;
+    }
+
+    // Link the new blocks in after the (unpublished) write block
+    pthread_mutex_lock(lock);
+    b->next = add;
+    tail->next = next;
+    ring->size += added;
+    pthread_mutex_unlock(lock);
+
+    return FBB_ROOM_READY;
+}
+
+/*
+ * Queue a filled block for reading.  Called with wlock held, after
+ * make_room().
+ */
+static void
+queue_block(struct ring_t *ring, struct __block_t *b, size_t bytes)
+{
+    pthread_mutex_t *lock = &ring->_b.lock;
+
+    pthread_mutex_lock(lock);
+    b->bytes = bytes;
+    ring->bytes += bytes;
+    ring->wp = b->next;
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * Queue a filled block for reading, and unlock writing
+ */
+static void
+publish_block(struct ring_t *ring, struct __block_t *b, size_t bytes)
+{
+    queue_block(ring, b, bytes);
+
+    // Unlock writing to this buffer
+    pthread_mutex_unlock(&ring->wlock);
+
+    machine_desc_notify(&ring->_b);
+}
+
+/*
+ * Write to a buffer.  Writes larger than a block are split across consecutive
+ * blocks.  With BF_BLOCKFILL, writes are packed into the write block, which is
+ * published when full (or when the reader catches up); otherwise each write
+ * (or the end of one) is published as its own block.  If the ring fills up
+ * part way through, the bytes written so far are returned.
+ */
 static int
 buf_write(IO_FILTER_ARGS)
 {
@@ -103,60 +324,207 @@ buf_write(IO_FILTER_ARGS)
         return IO_ERROR;
     }
 
+    char *src = IO_FILTER_ARGS_BUF;
+    size_t remaining = *IO_FILTER_ARGS_BYTES;
+    size_t written = 0;
+    size_t published = 0;
+
     // Lock writing to this buffer
     pthread_mutex_lock(&ring->wlock);
-    struct __block_t *b = ring->wp;
 
-    if (*IO_FILTER_ARGS_BYTES > b->size) {
-        pthread_mutex_unlock(&ring->wlock);
-        printf("WARNING: Input buffer (%zu) exceeds block length (%zu).  Ignoring input bytes\n",
-            *IO_FILTER_ARGS_BYTES, b->size);
-        return IO_SUCCESS;
+    while (remaining) {
+        struct __block_t *b = ring->wp;
+
+        // Make room for the block before starting it
+        if (ring->wfill == 0) {
+            enum fbb_room_e room = make_room(ring);
+            if (room == FBB_ROOM_FULL) {
+                break;
+            }
+
+            // Dropped bytes count as written
+            if (room == FBB_ROOM_DROP) {
+                size_t drop = (remaining < b->size) ? remaining : b->size;
+                machine_metrics_drop(ring->_b.metrics, drop, 1);
+                block_meta_advance(&ring->wmeta, drop);
+                src += drop;
+                remaining -= drop;
+                written += drop;
+                continue;
+            }
+
+            b->meta = ring->wmeta;
+        }
+
+        // Write input bytes to buffer
+        size_t bytes = b->size - ring->wfill;
+        if (bytes > remaining) {
+            bytes = remaining;
+        }
+        bw_memcpy_stream(b->data + ring->wfill, src, bytes);
+        block_meta_advance(&ring->wmeta, bytes);
+
+        ring->wfill += bytes;
+        src += bytes;
+        remaining -= bytes;
+        written += bytes;
+
+        if (ring->fill && ring->wfill < b->size) {
+            break;
+        }
+
+        queue_block(ring, b, ring->wfill);
+        ring->wfill = 0;
+        published++;
     }
 
-    // Initialize write vars
-    pthread_mutex_t *lock = &ring->_b.lock;
-    size_t remaining = *IO_FILTER_ARGS_BYTES;
+    // Unlock writing to this buffer
+    pthread_mutex_unlock(&ring->wlock);
+
+    if (published) {
+        machine_desc_notify(&ring->_b);
+    }
+
+    *IO_FILTER_ARGS_BYTES = written;
+    return (written || !remaining) ? IO_SUCCESS : IO_NODATA;
+}
+
+/*
+ * Block borrowing: one borrowed block is one record, as with read()/write()
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    // Lock reading from this buffer until the block is released
+    pthread_mutex_lock(&ring->rlock);
+    struct __block_t *rp = ring->rp;
+
+    if (BLOCK_UNREAD(rp) == 0 && !flush_fill_block(ring)) {
+        pthread_mutex_unlock(&ring->rlock);
+        *b = NULL;
+        return IO_NODATA;
+    }
+
+    *b = rp;
+    return IO_SUCCESS;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
 
-    // Write input bytes to buffer
-    size_t bytes = *IO_FILTER_ARGS_BYTES;
-    memcpy(b->data, IO_FILTER_ARGS_BUF, bytes);
+    pthread_mutex_t *lock = &ring->_b.lock;
+    b->offset += bytes;
 
     pthread_mutex_lock(lock);
+    ring->bytes -= bytes;
+    if (BLOCK_UNREAD(b) == 0) {
+        b->offset = 0;
+        b->bytes = 0;
+        ring->rp = b->next;
+        if (ring->space_waiters) {
+            pthread_cond_broadcast(&ring->space);
+        }
+    }
+    pthread_mutex_unlock(lock);
 
-    b->bytes = bytes;
+    // Unlock reading from this buffer
+    pthread_mutex_unlock(&ring->rlock);
+    return IO_SUCCESS;
+}
 
-    // Queue up next block
-    struct __block_t *next = b->next;
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        *b = NULL;
+        return IO_ERROR;
+    }
 
-    // Expand buffer, if the next block isn't empty
-    if (!BLOCK_EMPTY(next)) {
-        // Add enough space + 1 extra block
-        size_t block_count = (remaining / ring->block_size) + 1;
+    // Lock writing to this buffer until the block is committed
+    pthread_mutex_lock(&ring->wlock);
 
-        struct __block_t *add = block_list_alloc(ring->_b.pool, block_count);
-        block_data_fastalloc(ring->_b.pool, add, ring->block_size);
+    // Borrowed blocks start empty: publish packed writes first
+    if (ring->wfill) {
+        queue_block(ring, ring->wp, ring->wfill);
+        ring->wfill = 0;
+        machine_desc_notify(&ring->_b);
+    }
 
-        // Link head of new block segment into ring
-        b->next = add;
+    enum fbb_room_e room = make_room(ring);
+    if (room == FBB_ROOM_FULL) {
+        pthread_mutex_unlock(&ring->wlock);
+        *b = NULL;
+        return IO_NODATA;
+    }
 
-        // Get last block
-        while (add->next) {
-            add = add->next;
+    // Data written to the scratch block is dropped on commit
+    if (room == FBB_ROOM_DROP) {
+        if (!ring->scratch) {
+            struct __block_t *s = pcalloc(ring->_b.pool, sizeof(struct __block_t));
+            char *data = (s) ? palloc(ring->_b.pool, ring->block_size) : NULL;
+            if (!data) {
+                pthread_mutex_unlock(&ring->wlock);
+                *b = NULL;
+                return IO_ERROR;
+            }
+            s->data = data;
+            s->size = ring->block_size;
+            ring->scratch = s;
         }
 
-        // Link tail of new block segment into ring
-        add->next = next;
+        ring->scratch_out = 1;
+        *b = ring->scratch;
+        return IO_SUCCESS;
     }
 
-    ring->bytes += bytes;
-    ring->wp = b->next;
-    pthread_mutex_unlock(lock);
+    // Pending metadata, unless the caller sets its own
+    ring->wp->meta = ring->wmeta;
 
+    *b = ring->wp;
+    return IO_SUCCESS;
+}
 
-    // Unlock writing to this buffer
-    pthread_mutex_unlock(&ring->wlock);
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    if (ring->scratch_out) {
+        ring->scratch_out = 0;
+        if (bytes) {
+            machine_metrics_drop(ring->_b.metrics, bytes, 1);
+        }
+        pthread_mutex_unlock(&ring->wlock);
+        return IO_SUCCESS;
+    }
+
+    if (bytes == 0) {
+        pthread_mutex_unlock(&ring->wlock);
+        return IO_SUCCESS;
+    }
+
+    // Later writes follow on from the block's metadata
+    if (b->meta.flags & BLOCK_META_VALID) {
+        ring->wmeta = b->meta;
+        block_meta_advance(&ring->wmeta, bytes);
+    }
 
+    publish_block(ring, b, bytes);
     return IO_SUCCESS;
 }
 
@@ -220,7 +588,7 @@ static IO_HANDLE
 create_buffer(void *arg)
 {
     // Create a new pool for this buffer
-    POOL *p = create_subpool(_fbb_machine->alloc);
+    POOL *p = bw_create_subpool(_fbb_machine->alloc);
     if (!p) {
         printf("ERROR: Failed to create memory pool\n");
         return 0;
@@ -230,7 +598,7 @@ create_buffer(void *arg)
     struct ring_t *ring = pcalloc(p, sizeof(struct ring_t));
     if (!ring) {
         printf("ERROR: Failed to allocate %#zx bytes for ring descriptor\n", sizeof(struct ring_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -249,42 +617,53 @@ create_buffer(void *arg)
     struct __block_t *blocks = block_list_alloc(p, block_count);
     if (!blocks) {
         printf("ERROR: Failed to create new buffer\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     // Create block data
-    if (block_data_fastalloc(p, blocks, block_size) < IO_SUCCESS) {
+    uint32_t alloc_flags = args->flags & BF_ALLOC_MASK;
+    size_t size = block_data_fastalloc_flags(p, blocks, block_size, alloc_flags);
+    if (size == 0) {
         printf("ERROR: Failed to create new buffer\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     forge_ring(blocks);
 
+    ring->size = size;
     ring->block_size = block_size;
     ring->wp = blocks;
     ring->rp = blocks;
 
     ring->fill = (args->flags & BF_BLOCKFILL) ? 1 : 0;
+    ring->alloc_flags = alloc_flags;
 
     pthread_mutex_init(&ring->wlock, NULL);
     pthread_mutex_init(&ring->rlock, NULL);
+    pthread_cond_init(&ring->space, NULL);
 
     if (machine_desc_init(p, _fbb_machine, (IO_DESC *)ring) < IO_SUCCESS) {
-        free_pool(p);
+        bw_free_pool(p);
+        return 0;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)ring) < IO_SUCCESS) {
+        printf("ERROR: Failed to initialize read event\n");
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_read_init(p, "_buf", buf_read, (IO_DESC *)ring)) {
         printf("ERROR: Failed to initialize read filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_write_init(p, "_buf", buf_write, (IO_DESC *)ring)) {
         printf("ERROR: Failed to initialize write filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -294,6 +673,50 @@ create_buffer(void *arg)
     return h;
 }
 
+static int
+get_read_meta(IO_HANDLE h, struct block_meta_t *meta)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&ring->rlock);
+    *meta = ring->rmeta;
+    pthread_mutex_unlock(&ring->rlock);
+    return IO_SUCCESS;
+}
+
+/*
+ * Writes are tagged with "meta", advanced by the bytes written, until it is
+ * set again
+ */
+static int
+set_write_meta(IO_HANDLE h, const struct block_meta_t *meta)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->wmeta = *meta;
+    pthread_mutex_unlock(&ring->wlock);
+    return IO_SUCCESS;
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return ring->_b.metrics;
+}
+
 /*
  * Mechanism for registering and accessing this io machine
  */
@@ -307,6 +730,13 @@ get_fbb_machine()
         // Local Functions
         machine->create = create_buffer;
         machine->destroy = destroy_fbb_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+        machine->get_read_meta = get_read_meta;
+        machine->set_write_meta = set_write_meta;
 
         _fbb_machine = machine;
         fbb_machine = machine;
@@ -331,6 +761,19 @@ new_fbb_machine(size_t buffer_size, size_t block_size)
     return m->create(&fbb_args);
 }
 
+/*
+ * flags: BF_BLOCKFILL, and allocation flags (BF_HUGEPAGE, BF_PREFAULT,
+ * BF_MLOCK)
+ */
+IO_HANDLE
+new_fbb_machine_flags(size_t buffer_size, size_t block_size, uint32_t flags)
+{
+    const IOM *m = get_fbb_machine();
+
+    struct fbbiom_args fbb_args = {buffer_size, block_size, 0, flags};
+    return m->create(&fbb_args);
+}
+
 size_t
 fbb_get_size(IO_HANDLE h)
 {
@@ -353,6 +796,46 @@ fbb_get_bytes(IO_HANDLE h)
     return ring->bytes;
 }
 
+/*
+ * Hard cap on the ring size (0: unbounded).  Past the cap, the overflow
+ * policy applies.
+ */
+void
+fbb_set_max_size(IO_HANDLE h, size_t bytes)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->max_bytes = bytes;
+    pthread_mutex_unlock(&ring->wlock);
+}
+
+/*
+ * What to do when the ring is full at its cap.  Without a cap, only
+ * BF_OVERFLOW_GROW expands the ring.  Dropped data is counted in the
+ * machine's metrics, which this enables.
+ */
+void
+fbb_set_overflow(IO_HANDLE h, enum bf_overflow_e policy, uint32_t timeout_ms)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    machine_metrics_enable(h);
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->overflow = policy;
+    ring->timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&ring->wlock);
+}
+
 void
 fbb_set_log_level(char *level)
 {
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+#include "bw-util.h"
+
+#define LOGEX_TAG "AFPB"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_HEADER_BYTES 64
+#define DEFAULT_PAYLOAD_BYTES 9000
+#define DEFAULT_BLOCK_COUNT 1024
+
+// Headers are preceded by a pointer back to their slot, and 16-byte aligned
+#define HEADER_ALIGN 16
+#define HEADER_PREFIX HEADER_ALIGN
+
+static size_t default_header_bytes = DEFAULT_HEADER_BYTES;
+static size_t default_payload_bytes = DEFAULT_PAYLOAD_BYTES;
+static size_t default_block_count = DEFAULT_BLOCK_COUNT;
+
+const IOM *afpb_machine;
+static IOM *_afpb_machine = NULL;
+
+struct afpb_t;
+
+struct afpb_slot_t {
+    struct afpb_t *buf;         // Owning buffer
+    char *header;
+    char *payload;
+    size_t header_len;
+    size_t payload_len;
+    struct afpb_slot_t *next;   // Free list
+};
+
+/*
+ * Asynchronous fixed-packet buffer
+ *
+ * A preallocated set of packet slots, each with a fixed-size header and a
+ * fixed-size payload.  Headers and payloads are kept in separate regions, so
+ * payloads stay aligned and contiguous with each other.  Each write fills one
+ * packet: the first "header_bytes" go to the header, the rest to the payload.
+ *
+ * Full packets are queued in write order.  Consumers either copy them out
+ * with read(), or borrow them in place with afpb_next_full_packet() and hand
+ * them back, in any order, with afpb_done_with_packet().  The address passed
+ * back is the packet's header, which is prefixed with a pointer to its slot.
+ */
+struct afpb_t {
+    IO_DESC _b;  // Generic buffer
+
+    size_t header_bytes;
+    size_t payload_bytes;
+    size_t count;               // Number of packet slots
+    size_t stride;              // Header region bytes per slot (with prefix)
+
+    struct afpb_slot_t *slots;
+
+    pthread_mutex_t lock;
+    struct afpb_slot_t *free;   // Empty slots (most recently used first)
+    struct afpb_slot_t **full;  // Full slots, in write order
+    size_t head;                // Full slots queued (free-running)
+    size_t tail;                // Full slots taken (free-running)
+    size_t borrowed;            // Slots lent out by afpb_next_full_packet()
+    int flush;                  // Keep reading available until the buffer is empty
+};
+
+static inline struct afpb_slot_t *
+take_full(struct afpb_t *r)
+{
+    if (r->tail == r->head) {
+        return NULL;
+    }
+    return r->full[r->tail++ % r->count];
+}
+
+static inline void
+put_free(struct afpb_t *r, struct afpb_slot_t *s)
+{
+    s->header_len = 0;
+    s->payload_len = 0;
+    s->next = r->free;
+    r->free = s;
+}
+
+static inline void
+packet_from_slot(struct afpb_slot_t *s, struct afpb_packet *packet)
+{
+    packet->packet = s->header;
+    packet->header = s->header;
+    packet->payload = s->payload;
+    packet->header_len = s->header_len;
+    packet->payload_len = s->payload_len;
+}
+
+// Read from a buffer
+static int
+buf_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get buffer from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct afpb_t *r = (struct afpb_t *)d;
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    struct afpb_slot_t *s = take_full(r);
+    int flush = r->flush;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!s) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_SUCCESS;
+    }
+
+    // Copy out header, then payload
+    size_t bytes = s->header_len + s->payload_len;
+    if (*IO_FILTER_ARGS_BYTES >= bytes) {
+        char *buf = IO_FILTER_ARGS_BUF;
+        bw_memcpy(buf, s->header, s->header_len);
+        bw_memcpy(buf + s->header_len, s->payload, s->payload_len);
+        *IO_FILTER_ARGS_BYTES = bytes;
+    } else {
+        warn("Packet length (%zu) exceeds return buffer (%zu).  Dropping this packet",
+            bytes, *IO_FILTER_ARGS_BYTES);
+        machine_metrics_drop(r->_b.metrics, bytes, 1);
+        *IO_FILTER_ARGS_BYTES = 0;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    put_free(r, s);
+    pthread_mutex_unlock(&r->lock);
+
+    return IO_SUCCESS;
+}
+
+// Write one packet to a buffer
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get buffer from handle
+    struct afpb_t *r = (struct afpb_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    struct afpb_slot_t *s = r->free;
+    if (s) {
+        r->free = s->next;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    // Every slot is full or borrowed
+    if (!s) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_NODATA;
+    }
+
+    // Anything past one packet is left for the next write
+    char *buf = IO_FILTER_ARGS_BUF;
+    size_t bytes = *IO_FILTER_ARGS_BYTES;
+    s->header_len = (bytes < r->header_bytes) ? bytes : r->header_bytes;
+    bytes -= s->header_len;
+    s->payload_len = (bytes < r->payload_bytes) ? bytes : r->payload_bytes;
+
+    bw_memcpy(s->header, buf, s->header_len);
+    bw_memcpy(s->payload, buf + s->header_len, s->payload_len);
+
+    pthread_mutex_lock(&r->lock);
+    r->full[r->head++ % r->count] = s;
+    pthread_mutex_unlock(&r->lock);
+
+    machine_desc_notify(&r->_b);
+
+    *IO_FILTER_ARGS_BYTES = s->header_len + s->payload_len;
+    return IO_SUCCESS;
+}
+
+/*
+ * Create/destroy packet buffers
+ */
+static void
+destroy_afpb_machine(IO_HANDLE h)
+{
+    struct afpb_t *r = (struct afpb_t *)machine_get_desc(h);
+    if (!r) {
+        return;
+    }
+
+    if (r->borrowed) {
+        warn("Destroying packet buffer with %zu packets still borrowed", r->borrowed);
+    }
+
+    pthread_mutex_destroy(&r->lock);
+    machine_destroy_desc(h);
+}
+
+static void
+sanitize_args(struct afpbiom_args *args)
+{
+    if (args->header_bytes == 0) {
+        args->header_bytes = default_header_bytes;
+    }
+    if (args->payload_bytes == 0) {
+        args->payload_bytes = default_payload_bytes;
+    }
+    if (args->block_count == 0) {
+        args->block_count = default_block_count;
+    }
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    struct afpbiom_args args = {0};
+    if (arg) {
+        args = *(struct afpbiom_args *)arg;
+    }
+    sanitize_args(&args);
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_afpb_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    // Create a new buffer descriptor
+    struct afpb_t *r = pcalloc(p, sizeof(struct afpb_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    size_t count = args.block_count;
+    size_t stride = HEADER_PREFIX +
+        ((args.header_bytes + HEADER_ALIGN - 1) & ~(size_t)(HEADER_ALIGN - 1));
+
+    r->slots = pcalloc(p, count * sizeof(struct afpb_slot_t));
+    r->full = pcalloc(p, count * sizeof(struct afpb_slot_t *));
+    if (!r->slots || !r->full) {
+        error("Failed to create packet descriptors");
+        goto free_and_return;
+    }
+
+    uint32_t alloc_flags = bw_mem_default_flags();
+    char *headers = bw_mem_alloc(p, count * stride, alloc_flags);
+    char *payloads = bw_mem_alloc(p, count * args.payload_bytes, alloc_flags);
+    if (!headers || !payloads) {
+        char bytestr[64];
+        size_t_fmt(bytestr, 64, count * (stride + args.payload_bytes));
+        error("Failed to allocate %sB for %zu packets", bytestr, count);
+        goto free_and_return;
+    }
+
+    r->header_bytes = args.header_bytes;
+    r->payload_bytes = args.payload_bytes;
+    r->count = count;
+    r->stride = stride;
+
+    // Every slot starts empty; the first one ends up on top of the free list
+    size_t i = count;
+    while (i--) {
+        struct afpb_slot_t *s = &r->slots[i];
+        char *prefix = headers + i * stride;
+
+        s->buf = r;
+        s->header = prefix + HEADER_PREFIX;
+        s->payload = payloads + i * args.payload_bytes;
+        *(struct afpb_slot_t **)prefix = s;
+
+        put_free(r, s);
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+
+    if (machine_desc_init(p, _afpb_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
+    if (!filter_read_init(p, "afpb_r", buf_read, (IO_DESC *)r)) {
+        error("Failed to initialize read filter");
+        goto free_and_return;
+    }
+
+    if (!filter_write_init(p, "afpb_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+free_and_return:
+    bw_free_pool(p);
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    // Disable writing
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+    }
+
+    // Allow reading until the buffer is empty
+    if (d->io_read) {
+        struct afpb_t *r = (struct afpb_t *)d;
+        pthread_mutex_lock(&r->lock);
+        r->flush = 1;
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct afpb_t *r = (struct afpb_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return r->_b.metrics;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_afpb_machine()
+{
+    IOM *machine = _afpb_machine;
+    if (!machine) {
+        machine = machine_register("async_fixed_packet_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_afpb_machine;
+        machine->metrics = get_metrics;
+
+        _afpb_machine = machine;
+        afpb_machine = machine;
+    }
+    return (const IOM *)machine;
+}
+
+/*
+ * Set the defaults used when create args are zero (zero fields are ignored)
+ */
+void
+afpbiom_update_defaults(struct afpbiom_args *afpb)
+{
+    if (afpb->header_bytes) {
+        default_header_bytes = afpb->header_bytes;
+    }
+    if (afpb->payload_bytes) {
+        default_payload_bytes = afpb->payload_bytes;
+    }
+    if (afpb->block_count) {
+        default_block_count = afpb->block_count;
+    }
+}
+
+IO_HANDLE
+new_afpb_machine(size_t header_bytes, size_t payload_bytes, size_t packet_count)
+{
+    const IOM *m = get_afpb_machine();
+
+    struct afpbiom_args args = {header_bytes, payload_bytes, packet_count};
+    return m->create(&args);
+}
+
+/*
+ * Borrow the oldest full packet in place.  Return it with
+ * afpb_done_with_packet(packet->packet) when finished; packets may be returned
+ * in any order, from any thread.  Returns IO_NODATA if no packet is ready, or
+ * IO_COMPLETE once the buffer is stopped and empty.
+ */
+int
+afpb_next_full_packet(IO_HANDLE h, struct afpb_packet *packet)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct afpb_t *r = (struct afpb_t *)d;
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    struct afpb_slot_t *s = take_full(r);
+    if (s) {
+        r->borrowed++;
+    }
+    int flush = r->flush;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!s) {
+        memset(packet, 0, sizeof(struct afpb_packet));
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    packet_from_slot(s, packet);
+    return IO_SUCCESS;
+}
+
+/*
+ * Return a packet from afpb_next_full_packet().  "addr" is the packet (or
+ * header) address.  The buffer must not have been destroyed.
+ */
+void
+afpb_done_with_packet(void *addr)
+{
+    if (!addr) {
+        return;
+    }
+
+    struct afpb_slot_t *s = *(struct afpb_slot_t **)((char *)addr - HEADER_PREFIX);
+    if (!s || s->header != addr) {
+        error("%p is not a borrowed packet", addr);
+        return;
+    }
+
+    struct afpb_t *r = s->buf;
+    pthread_mutex_lock(&r->lock);
+    r->borrowed--;
+    put_free(r, s);
+    pthread_mutex_unlock(&r->lock);
+}
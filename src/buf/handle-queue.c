@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <time.h>
+
 #include "machine.h"
 #include "filter.h"
 #include "simple-buffers.h"
@@ -6,19 +9,458 @@
 #include "logging.h"
 #include "bw-log.h"
 
+// Slab size classes: powers of two from 64 B to 1 MB
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 20
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+// Free buffers kept per class: at least SLAB_CACHE_MIN, up to SLAB_CACHE_BYTES
+#define SLAB_CACHE_MIN 8
+#define SLAB_CACHE_BYTES 16*MB
+
+#define SLAB_MAGIC 0x48515342   // "HQSB"
+
+// Priority heap: 4 children of 16 bytes fill one cache line
+#define HEAP_D 4
+#define HEAP_INIT_CAP 256
+#define HEAP_NODE(h, i) ((h)->nodes[(i) + HEAP_D - 1])
+
 const IOM *hq_machine;
 static IOM *_handle_queue_machine = NULL;
 
+struct hq_slab_t;
+
+// Prefix of every slab buffer (keeps the buffer 16-byte aligned)
+struct hq_slab_buf_t {
+    struct hq_slab_t *slab;
+    struct hq_slab_buf_t *next;     // Free list
+    uint32_t cls;
+    uint32_t magic;
+} __attribute__((aligned(16)));
+
+/*
+ * Entry buffer recycler
+ *
+ * Entry buffers up to 1 MB come from per-size-class free lists, so a steady
+ * stream of entries stops allocating once the lists are warm.  Each buffer is
+ * prefixed with a pointer back to its slab, so hq_entry_release() needs only
+ * the entry.  Larger entries get their own pool, as before.
+ */
+struct hq_slab_t {
+    pthread_mutex_t lock;
+    POOL *pool;
+    struct hq_slab_buf_t *free[SLAB_CLASSES];
+    size_t n_free[SLAB_CLASSES];
+};
+
+struct hq_heap_node_t {
+    uint64_t key;                   // Entry timestamp (us)
+    uint32_t slot;                  // Index into slots
+    uint32_t _pad;
+};
+
+struct hq_heap_slot_t {
+    HQ_ENTRY e;
+    uint64_t arrival_us;            // When the entry was queued
+};
+
+/*
+ * Timestamp-ordered queue (HQ_TYPE_PRIORITY)
+ *
+ * A d-ary min-heap of small {timestamp, slot} nodes, laid out so the children
+ * of a node share one cache line.  The entries themselves sit in a slot array
+ * and don't move.  The earliest entry is released once it is "window_us"
+ * older than the newest entry seen, or has been held for "latency_us",
+ * whichever comes first; inputs that are out of order by less than the window
+ * come out sorted.  Stopping the queue releases everything, in order.
+ */
+struct hq_heap_t {
+    pthread_mutex_t lock;
+    POOL *pool;
+
+    struct hq_heap_node_t *nodes;   // Cache-line aligned (see HEAP_NODE)
+    void *nodes_mem;
+    struct hq_heap_slot_t *slots;
+    uint32_t *free_slots;
+    size_t n_free;
+    size_t n;                       // Entries in the heap
+    size_t cap;
+
+    uint64_t newest;                // Latest timestamp seen
+    uint64_t window_us;             // Reorder window (0: none)
+    uint64_t latency_us;            // Longest hold (0: none)
+};
+
 struct hq_t {
     IO_DESC _b;  // IOM Descriptor
     MLIST *list;
+    struct hq_heap_t *heap;         // HQ_TYPE_PRIORITY (instead of list)
+    struct hq_slab_t slab;
 
     int flush;              // Flag used to keep reading available until the buffer is empty
 };
 
+static inline int
+slab_class(size_t bytes)
+{
+    int cls = 0;
+    while (((size_t)1 << (cls + SLAB_MIN_SHIFT)) < bytes) {
+        cls++;
+    }
+    return cls;
+}
+
+static void *
+slab_alloc(struct hq_slab_t *slab, size_t bytes)
+{
+    int cls = slab_class(bytes);
+
+    pthread_mutex_lock(&slab->lock);
+    struct hq_slab_buf_t *b = slab->free[cls];
+    if (b) {
+        slab->free[cls] = b->next;
+        slab->n_free[cls]--;
+    }
+    pthread_mutex_unlock(&slab->lock);
+
+    if (!b) {
+        size_t size = (size_t)1 << (cls + SLAB_MIN_SHIFT);
+        b = palloc(slab->pool, sizeof(struct hq_slab_buf_t) + size);
+        if (!b) {
+            return NULL;
+        }
+
+        b->slab = slab;
+        b->cls = (uint32_t)cls;
+        b->magic = SLAB_MAGIC;
+    }
+
+    b->next = NULL;
+    return (void *)(b + 1);
+}
+
+static void
+slab_free(struct hq_slab_buf_t *b)
+{
+    struct hq_slab_t *slab = b->slab;
+    int cls = (int)b->cls;
+
+    size_t keep = SLAB_CACHE_BYTES >> (cls + SLAB_MIN_SHIFT);
+    keep = (keep > SLAB_CACHE_MIN) ? keep : SLAB_CACHE_MIN;
+
+    pthread_mutex_lock(&slab->lock);
+    if (slab->n_free[cls] < keep) {
+        b->next = slab->free[cls];
+        slab->free[cls] = b;
+        slab->n_free[cls]++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&slab->lock);
+
+    // The free list is full: give the memory back
+    if (b) {
+        b->magic = 0;
+        pfree(slab->pool, b);
+    }
+}
+
+/*
+ * Get a buffer of "bytes" for "e": from the slab if it fits a size class,
+ * otherwise from a new pool
+ */
+static int
+entry_alloc(struct hq_t *q, size_t bytes, HQ_ENTRY *e)
+{
+    e->bytes = bytes;
+    timerclear(&e->tv);
+    if (bytes <= ((size_t)1 << SLAB_MAX_SHIFT)) {
+        e->pool = NULL;
+        e->buf = slab_alloc(&q->slab, bytes);
+        return (e->buf) ? IO_SUCCESS : IO_ERROR;
+    }
+
+    e->pool = bw_create_subpool(q->_b.pool);
+    if (!e->pool) {
+        e->buf = NULL;
+        return IO_ERROR;
+    }
+
+    e->buf = palloc(e->pool, bytes);
+    if (!e->buf) {
+        bw_free_pool(e->pool);
+        e->pool = NULL;
+        return IO_ERROR;
+    }
+    return IO_SUCCESS;
+}
+
+static inline uint64_t
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline uint64_t
+entry_key(const HQ_ENTRY *e)
+{
+    return (uint64_t)e->tv.tv_sec * 1000000 + (uint64_t)e->tv.tv_usec;
+}
+
+static int
+heap_grow(struct hq_heap_t *heap)
+{
+    size_t cap = (heap->cap) ? 2 * heap->cap : HEAP_INIT_CAP;
+
+    // Nodes: pad the front so sibling groups start on a cache line
+    size_t node_bytes = (cap + HEAP_D - 1) * sizeof(struct hq_heap_node_t);
+    void *nodes_mem = palloc(heap->pool, node_bytes + 64);
+    struct hq_heap_slot_t *slots = palloc(heap->pool, cap * sizeof(struct hq_heap_slot_t));
+    uint32_t *free_slots = palloc(heap->pool, cap * sizeof(uint32_t));
+    if (!nodes_mem || !slots || !free_slots) {
+        return IO_ERROR;
+    }
+
+    struct hq_heap_node_t *nodes = (struct hq_heap_node_t *)(((uintptr_t)nodes_mem + 63) & ~(uintptr_t)63);
+
+    if (heap->cap) {
+        memcpy(nodes, heap->nodes, (heap->n + HEAP_D - 1) * sizeof(struct hq_heap_node_t));
+        memcpy(slots, heap->slots, heap->cap * sizeof(struct hq_heap_slot_t));
+        memcpy(free_slots, heap->free_slots, heap->n_free * sizeof(uint32_t));
+        pfree(heap->pool, heap->nodes_mem);
+        pfree(heap->pool, heap->slots);
+        pfree(heap->pool, heap->free_slots);
+    }
+
+    // New slots are free
+    size_t i = cap;
+    while (i-- > heap->cap) {
+        free_slots[heap->n_free++] = (uint32_t)i;
+    }
+
+    heap->nodes = nodes;
+    heap->nodes_mem = nodes_mem;
+    heap->slots = slots;
+    heap->free_slots = free_slots;
+    heap->cap = cap;
+    return IO_SUCCESS;
+}
+
+// Caller holds heap->lock
+static int
+heap_insert(struct hq_heap_t *heap, HQ_ENTRY *e, uint64_t now)
+{
+    if (heap->n == heap->cap && heap_grow(heap) < IO_SUCCESS) {
+        error("Failed to grow priority queue");
+        return IO_ERROR;
+    }
+
+    uint32_t slot = heap->free_slots[--heap->n_free];
+    heap->slots[slot].e = *e;
+    heap->slots[slot].arrival_us = now;
+
+    struct hq_heap_node_t node = {entry_key(e), slot, 0};
+    if (node.key > heap->newest) {
+        heap->newest = node.key;
+    }
+
+    // Sift up
+    size_t i = heap->n++;
+    while (i > 0) {
+        size_t parent = (i - 1) / HEAP_D;
+        if (HEAP_NODE(heap, parent).key <= node.key) {
+            break;
+        }
+        HEAP_NODE(heap, i) = HEAP_NODE(heap, parent);
+        i = parent;
+    }
+    HEAP_NODE(heap, i) = node;
+
+    return IO_SUCCESS;
+}
+
+/*
+ * Take the earliest entry, if it's due (or "force" is set).  Returns 1 if an
+ * entry was taken.  Caller holds heap->lock.
+ */
+static int
+heap_take(struct hq_heap_t *heap, HQ_ENTRY *e, int force, uint64_t now)
+{
+    if (heap->n == 0) {
+        return 0;
+    }
+
+    struct hq_heap_node_t top = HEAP_NODE(heap, 0);
+    struct hq_heap_slot_t *s = &heap->slots[top.slot];
+
+    int due = force ||
+        (heap->window_us == 0 && heap->latency_us == 0) ||
+        (heap->window_us && heap->newest - top.key >= heap->window_us) ||
+        (heap->latency_us && now - s->arrival_us >= heap->latency_us);
+    if (!due) {
+        return 0;
+    }
+
+    *e = s->e;
+    heap->free_slots[heap->n_free++] = top.slot;
+
+    // Sift the last node down from the root
+    struct hq_heap_node_t node = HEAP_NODE(heap, --heap->n);
+    size_t i = 0;
+    while (1) {
+        size_t first = HEAP_D * i + 1;
+        if (first >= heap->n) {
+            break;
+        }
+
+        size_t last = (first + HEAP_D < heap->n) ? first + HEAP_D : heap->n;
+        size_t min = first;
+        size_t c = first + 1;
+        for (; c < last; c++) {
+            if (HEAP_NODE(heap, c).key < HEAP_NODE(heap, min).key) {
+                min = c;
+            }
+        }
+
+        if (node.key <= HEAP_NODE(heap, min).key) {
+            break;
+        }
+        HEAP_NODE(heap, i) = HEAP_NODE(heap, min);
+        i = min;
+    }
+    if (heap->n) {
+        HEAP_NODE(heap, i) = node;
+    }
+
+    return 1;
+}
+
+/*
+ * Insert up to "n" entries under one lock.  Returns the number inserted.
+ */
+static size_t
+heap_push(struct hq_heap_t *heap, HQ_ENTRY *e, size_t n)
+{
+    uint64_t now = now_us();
+    size_t i = 0;
+
+    pthread_mutex_lock(&heap->lock);
+    for (; i < n; i++) {
+        if (heap_insert(heap, &e[i], now) < IO_SUCCESS) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    return i;
+}
+
+/*
+ * Take up to "n" due entries under one lock.  Returns the number taken.
+ */
+static size_t
+heap_pop(struct hq_heap_t *heap, HQ_ENTRY *e, size_t n, int force)
+{
+    uint64_t now = now_us();
+    size_t i = 0;
+
+    pthread_mutex_lock(&heap->lock);
+    for (; i < n; i++) {
+        if (!heap_take(heap, &e[i], force, now)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    return i;
+}
+
+/*
+ * Queue "*n" entries, with one notification for the batch.  On return, "*n"
+ * is the number queued.
+ */
+static int
+queue_push(struct hq_t *q, HQ_ENTRY *e, size_t *n)
+{
+    // Entries without a timestamp are stamped when queued
+    struct timeval now;
+    timerclear(&now);
+    size_t i = 0;
+    for (; i < *n; i++) {
+        if (timerisset(&e[i].tv)) {
+            continue;
+        }
+        if (!timerisset(&now)) {
+            gettimeofday(&now, NULL);
+        }
+        e[i].tv = now;
+    }
+
+    int ret = IO_SUCCESS;
+    if (q->heap) {
+        i = heap_push(q->heap, e, *n);
+    } else {
+        for (i = 0; i < *n; i++) {
+            if (memex_list_push(q->list, &e[i]) != 0) {
+                break;
+            }
+        }
+    }
+
+    if (i < *n) {
+        ret = IO_ERROR;
+    }
+    *n = i;
+
+    if (i > 0) {
+        machine_metrics_entries(q->_b.metrics, i, 0);
+        machine_desc_notify(&q->_b);
+    }
+    return ret;
+}
+
+/*
+ * Take up to "*n" entries.  On return, "*n" is the number taken.
+ */
+static int
+queue_pop(struct hq_t *q, HQ_ENTRY *e, size_t *n)
+{
+    size_t i = 0;
+    if (q->heap) {
+        i = heap_pop(q->heap, e, *n, q->flush);
+    } else {
+        for (; i < *n; i++) {
+            uint32_t N = 0;
+            if (memex_list_pop(q->list, &e[i], &N) != 0) {
+                *n = i;
+                return IO_ERROR;
+            }
+            if (N == 0) {
+                break;
+            }
+        }
+    }
+
+    *n = i;
+    if (i > 0) {
+        machine_metrics_entries(q->_b.metrics, 0, i);
+    }
+    return IO_SUCCESS;
+}
+
 static void
 destroy_hq_machine(IO_HANDLE h)
 {
+    struct hq_t *q = (struct hq_t *)machine_get_desc(h);
+    if (!q) {
+        return;
+    }
+
+    if (q->heap) {
+        pthread_mutex_destroy(&q->heap->lock);
+    }
+    pthread_mutex_destroy(&q->slab.lock);
     machine_destroy_desc(h);
 }
 
@@ -40,14 +482,17 @@ queue_write(IO_FILTER_ARGS)
     size_t bytes = *IO_FILTER_ARGS_BYTES;
 
     HQ_ENTRY e;
-    gettimeofday(&e.tv, NULL);
-    e.pool = create_subpool(d->pool);
-    e.buf = palloc(e.pool, bytes);
-    e.bytes = bytes;
+    if (entry_alloc(q, bytes, &e) < IO_SUCCESS) {
+        error("Failed to allocate %zu byte entry", bytes);
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
     memcpy(e.buf, data, bytes);
+    gettimeofday(&e.tv, NULL);
 
-    if (memex_list_push(q->list, &e) != 0) {
-        free_pool(e.pool);
+    size_t n = 1;
+    if (queue_push(q, &e, &n) < IO_SUCCESS) {
+        hq_entry_release(&e);
         *IO_FILTER_ARGS_BYTES = 0;
         return IO_ERROR;
     }
@@ -79,8 +524,8 @@ queue_read(IO_FILTER_ARGS)
 
     HQ_ENTRY e;
     e.buf = NULL;
-    uint32_t N;
-    if (memex_list_pop(q->list, &e, &N) != 0) {
+    size_t N = 1;
+    if (queue_pop(q, &e, &N) < IO_SUCCESS) {
         *IO_FILTER_ARGS_BYTES = 0;
         return IO_ERROR;
     }
@@ -109,7 +554,7 @@ create_queue(void *arg)
     IO_HANDLE h = 0;
 
     // Create a new pool for this buffer
-    POOL *p = create_subpool(_handle_queue_machine->alloc);
+    POOL *p = bw_create_subpool(_handle_queue_machine->alloc);
     if (!p) {
         error("Failed to create memory pool");
         return 0;
@@ -122,6 +567,9 @@ create_queue(void *arg)
         goto free_and_return;
     }
 
+    q->slab.pool = p;
+    pthread_mutex_init(&q->slab.lock, NULL);
+
     // Create internal queue
     int type = HQ_TYPE_FIFO;
     struct hqiom_args *a = (struct hqiom_args *)arg;
@@ -129,6 +577,17 @@ create_queue(void *arg)
         q->list = memex_fifo_create(p, sizeof(HQ_ENTRY));
     } else if (a && a->type == HQ_TYPE_STACK) {
         q->list = memex_stack_create(p, sizeof(HQ_ENTRY));
+    } else if (a && a->type == HQ_TYPE_PRIORITY) {
+        q->heap = pcalloc(p, sizeof(struct hq_heap_t));
+        if (!q->heap) {
+            error("Failed to allocate memory");
+            goto free_and_return;
+        }
+
+        q->heap->pool = p;
+        q->heap->window_us = a->window_us;
+        q->heap->latency_us = (uint64_t)a->latency_ms * 1000;
+        pthread_mutex_init(&q->heap->lock, NULL);
     } else {
         q->list = memex_fifo_create(p, sizeof(HQ_ENTRY));
     }
@@ -138,6 +597,11 @@ create_queue(void *arg)
         goto free_and_return;
     }
 
+    if (machine_desc_event_init((IO_DESC *)q) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
     if (!filter_read_init(p, "ring_buf_r", queue_read, (IO_DESC *)q)) {
         error("Failed to initialize read filter");
         goto free_and_return;
@@ -152,7 +616,7 @@ create_queue(void *arg)
     return h;
 
 free_and_return:
-    free_pool(p);
+    bw_free_pool(p);
     return 0;
 }
 
@@ -175,6 +639,9 @@ stop_queue(IO_HANDLE h)
         struct hq_t *q = (struct hq_t *)d;
         q->flush = 1;
     }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
 }
 
 const IOM *
@@ -219,3 +686,169 @@ new_hq_stack_machine()
     struct hqiom_args args = {HQ_TYPE_STACK};
     return hq_machine->create(&args);
 }
+
+/*
+ * Timestamp-ordered queue: entries come out in "tv" order once they are
+ * "window_us" older than the newest entry, or after "latency_ms" in the queue
+ */
+IO_HANDLE
+new_hq_priority_machine(size_t window_us, uint32_t latency_ms)
+{
+    const IOM *hq_machine = get_hq_machine();
+    struct hqiom_args args = {HQ_TYPE_PRIORITY, window_us, latency_ms};
+    return hq_machine->create(&args);
+}
+
+/*
+ * Zero-copy entries.  hq_entry_alloc() gets a buffer for an entry from the
+ * queue's recycler; fill it, then hand it over with hq_write_entry().  Entries
+ * read from the queue belong to the reader, who returns them with
+ * hq_entry_release().
+ */
+int
+hq_entry_alloc(IO_HANDLE h, size_t bytes, HQ_ENTRY *e)
+{
+    struct hq_t *q = (struct hq_t *)machine_get_desc(h);
+    if (!q) {
+        return IO_ERROR;
+    }
+
+    return entry_alloc(q, bytes, e);
+}
+
+/*
+ * Queue "e" without copying it.  The buffer must come from hq_entry_alloc() or
+ * be owned by "e->pool".  On IO_SUCCESS the queue owns it; otherwise (e.g.
+ * IO_NODATA once the queue is stopped) it still belongs to the caller.
+ */
+int
+hq_write_entry(IO_HANDLE h, HQ_ENTRY *e)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct hq_t *q = (struct hq_t *)d;
+    if (!q) {
+        return IO_ERROR;
+    }
+
+    if (!d->io_write || d->io_write->state != IO_DESC_ENABLED) {
+        return IO_NODATA;
+    }
+
+    size_t n = 1;
+    return queue_push(q, e, &n);
+}
+
+/*
+ * Batches
+ *
+ * Move up to "*n" entries per call: one descriptor lookup, one state check, one
+ * metrics update and one reader wake-up per batch, and for priority queues,
+ * one lock acquisition.  Like hq_write_entry(), batches bypass the filter chain.
+ * On return, "*n" is the number of entries moved.
+ *
+ * hq_write_entries() takes ownership of the entries it queues; any after "*n"
+ * still belong to the caller.  Returns IO_NODATA if the queue isn't accepting
+ * writes.
+ *
+ * hq_read_entries() returns IO_SUCCESS, with "*n" possibly 0, or IO_COMPLETE
+ * once a stopped queue is empty.
+ */
+int
+hq_write_entries(IO_HANDLE h, HQ_ENTRY *e, size_t *n)
+{
+    size_t want = *n;
+    *n = 0;
+
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct hq_t *q = (struct hq_t *)d;
+    if (!q) {
+        return IO_ERROR;
+    }
+
+    if (!d->io_write || d->io_write->state != IO_DESC_ENABLED) {
+        return IO_NODATA;
+    }
+
+    machine_desc_acquire(d);
+    *n = want;
+    int ret = queue_push(q, e, n);
+
+    if (d->metrics) {
+        IO_METRICS *m = &d->metrics->in;
+        m->fn(m, want * sizeof(HQ_ENTRY), *n * sizeof(HQ_ENTRY));
+    }
+    machine_desc_release(d);
+
+    return ret;
+}
+
+int
+hq_read_entries(IO_HANDLE h, HQ_ENTRY *e, size_t *n)
+{
+    size_t want = *n;
+    *n = 0;
+
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct hq_t *q = (struct hq_t *)d;
+    if (!q || !d->io_read) {
+        return IO_ERROR;
+    }
+
+    switch (d->io_read->state) {
+    case IO_DESC_DISABLING:
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLED);
+        return IO_SUCCESS;
+
+    case IO_DESC_DISABLED:
+        return IO_SUCCESS;
+
+    case IO_DESC_STOPPED:
+        return IO_COMPLETE;
+
+    default:
+        break;
+    }
+
+    machine_desc_acquire(d);
+    *n = want;
+    int ret = queue_pop(q, e, n);
+
+    if (ret == IO_SUCCESS && *n == 0 && q->flush) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+        ret = IO_COMPLETE;
+    }
+
+    if (d->metrics) {
+        IO_METRICS *m = &d->metrics->out;
+        m->fn(m, want * sizeof(HQ_ENTRY), *n * sizeof(HQ_ENTRY));
+        if (ret == IO_COMPLETE) {
+            machine_metrics_update(m);
+        }
+    }
+    machine_desc_release(d);
+
+    return ret;
+}
+
+/*
+ * Return an entry's buffer: to its slab, or by freeing its pool
+ */
+void
+hq_entry_release(HQ_ENTRY *e)
+{
+    if (e->pool) {
+        bw_free_pool(e->pool);
+
+    } else if (e->buf) {
+        struct hq_slab_buf_t *b = (struct hq_slab_buf_t *)e->buf - 1;
+        if (b->magic != SLAB_MAGIC) {
+            error("%p is not a handle queue entry", e->buf);
+            return;
+        }
+        slab_free(b);
+    }
+
+    e->pool = NULL;
+    e->buf = NULL;
+    e->bytes = 0;
+}
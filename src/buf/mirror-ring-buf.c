@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "ring-buf.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+
+#define LOGEX_TAG "MIRROR-BUF"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_BUF_BYTES 64*MB
+#define CACHELINE 64
+
+static size_t default_buf_bytes = DEFAULT_BUF_BYTES;
+
+const IOM *mirror_machine;
+static IOM *_mirror_machine = NULL;
+
+/*
+ * Mirrored single-producer/single-consumer byte ring
+ *
+ * The buffer is a memfd mapped twice, back to back, so the byte after the end
+ * of the ring is the first byte of the ring again.  Any span of up to "size"
+ * bytes starting anywhere in the ring is contiguous: reads and writes never
+ * wrap, and a borrowed block is the whole readable (or writable) region.
+ *
+ * "head" and "tail" are free-running byte counters, owned by the producer and
+ * consumer respectively, like the spsc ring.
+ */
+struct mirror_t {
+    IO_DESC _b;  // Generic buffer
+
+    char *base;                 // First mapping (the second follows it)
+    size_t size;                // Capacity in bytes (page multiple)
+    int flush;                  // Keep reading available until the buffer is empty
+
+    char _pad0[CACHELINE];
+
+    // Producer
+    size_t head;                // Total bytes written
+    struct __block_t wview;     // Borrowed write region
+
+    char _pad1[CACHELINE];
+
+    // Consumer
+    size_t tail;                // Total bytes consumed
+    struct __block_t rview;     // Borrowed read region
+
+    char _pad2[CACHELINE];
+};
+
+static inline size_t
+readable(struct mirror_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+static inline size_t
+writable(struct mirror_t *r)
+{
+    return r->size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline void
+consume(struct mirror_t *r, size_t bytes)
+{
+    __atomic_store_n(&r->tail, r->tail + bytes, __ATOMIC_RELEASE);
+}
+
+static inline void
+publish(struct mirror_t *r, size_t bytes)
+{
+    __atomic_store_n(&r->head, r->head + bytes, __ATOMIC_RELEASE);
+    machine_desc_notify(&r->_b);
+}
+
+// Read from a buffer
+static int
+buf_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct mirror_t *r = (struct mirror_t *)d;
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    size_t avail = readable(r);
+    size_t n = *IO_FILTER_ARGS_BYTES;
+    n = (n < avail) ? n : avail;
+    n -= n % IO_FILTER_ARGS_ALIGN;
+
+    // One copy, however the data sits in the ring
+    if (n) {
+        bw_memcpy(IO_FILTER_ARGS_BUF, r->base + (r->tail % r->size), n);
+        consume(r, n);
+    }
+
+    *IO_FILTER_ARGS_BYTES = n;
+
+    if (flush && avail == 0) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+        return IO_COMPLETE;
+    }
+
+    return IO_SUCCESS;
+}
+
+// Write to a buffer
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    // Write what fits (a partial write when the ring is full)
+    size_t n = *IO_FILTER_ARGS_BYTES;
+    size_t space = writable(r);
+    n = (n < space) ? n : space;
+
+    if (n) {
+        bw_memcpy_stream(r->base + (r->head % r->size), IO_FILTER_ARGS_BUF, n);
+        publish(r, n);
+    }
+
+    *IO_FILTER_ARGS_BYTES = n;
+    return IO_SUCCESS;
+}
+
+/*
+ * Block borrowing: the borrowed "block" is the whole readable (or writable)
+ * region, viewed through the mirror.  Only the consumer thread may borrow read
+ * blocks, and only the producer thread may borrow write blocks.
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct mirror_t *r = (struct mirror_t *)d;
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    size_t avail = readable(r);
+    if (avail == 0) {
+        *b = NULL;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->rview;
+    v->data = r->base + (r->tail % r->size);
+    v->size = avail;
+    v->bytes = avail;
+    v->offset = 0;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    consume(r, bytes);
+    return IO_SUCCESS;
+}
+
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    size_t space = writable(r);
+    if (space == 0) {
+        *b = NULL;
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->wview;
+    v->data = r->base + (r->head % r->size);
+    v->size = space;
+    v->bytes = 0;
+    v->offset = 0;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    if (bytes) {
+        publish(r, bytes);
+    }
+    return IO_SUCCESS;
+}
+
+/*
+ * Map a memfd twice, back to back.  Returns NULL on failure.
+ */
+static char *
+map_mirror(size_t size)
+{
+#ifdef SYS_memfd_create
+    int fd = syscall(SYS_memfd_create, "bw-mirror", 0);
+#else
+    int fd = -1;
+    errno = ENOSYS;
+#endif
+    if (fd < 0) {
+        error("memfd_create failed (%s)", strerror(errno));
+        return NULL;
+    }
+
+    char *base = NULL;
+    if (ftruncate(fd, size) != 0) {
+        error("Failed to size mirror buffer (%s)", strerror(errno));
+        goto close_and_return;
+    }
+
+    // Reserve both halves, then map the file over each
+    void *addr = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        error("Failed to reserve mirror buffer (%s)", strerror(errno));
+        goto close_and_return;
+    }
+
+    char *lo = (char *)addr;
+    char *hi = lo + size;
+    if (mmap(lo, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(hi, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        error("Failed to map mirror buffer (%s)", strerror(errno));
+        munmap(addr, 2 * size);
+        goto close_and_return;
+    }
+
+    base = lo;
+
+close_and_return:
+    // The mappings keep the memory alive
+    close(fd);
+    return base;
+}
+
+/*
+ * Create/destroy mirror buffers
+ */
+static void
+destroy_mirror_machine(IO_HANDLE h)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        return;
+    }
+
+    // The mapping isn't pool memory
+    char *base = r->base;
+    size_t size = r->size;
+
+    machine_destroy_desc(h);
+    munmap(base, 2 * size);
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    size_t buf_bytes = default_buf_bytes;
+
+    struct mirroriom_args *args = (struct mirroriom_args *)arg;
+    if (args && args->buf_bytes) {
+        buf_bytes = args->buf_bytes;
+    }
+
+    // Both mappings must be page aligned
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    buf_bytes = (buf_bytes + page - 1) & ~(page - 1);
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_mirror_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    // Create a new buffer descriptor
+    struct mirror_t *r = pcalloc(p, sizeof(struct mirror_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    // The mapping is charged to the memory budget like any other buffer
+    if (bw_mem_charge(p, buf_bytes) < IO_SUCCESS) {
+        error("Mirror buffer is over the memory budget");
+        goto free_and_return;
+    }
+
+    r->base = map_mirror(buf_bytes);
+    if (!r->base) {
+        goto free_and_return;
+    }
+    r->size = buf_bytes;
+
+    if (machine_desc_init(p, _mirror_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto unmap_and_return;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto unmap_and_return;
+    }
+
+    if (!filter_read_init(p, "mirror_buf_r", buf_read, (IO_DESC *)r)) {
+        error("Failed to initialize read filter");
+        goto unmap_and_return;
+    }
+
+    if (!filter_write_init(p, "mirror_buf_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto unmap_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+unmap_and_return:
+    munmap(r->base, 2 * r->size);
+
+free_and_return:
+    bw_free_pool(p);
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    // Disable writing
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+    }
+
+    // Allow reading until the buffer is empty
+    if (d->io_read) {
+        struct mirror_t *r = (struct mirror_t *)d;
+        __atomic_store_n(&r->flush, 1, __ATOMIC_RELEASE);
+    }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return r->_b.metrics;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_mirror_machine()
+{
+    IOM *machine = _mirror_machine;
+    if (!machine) {
+        machine = machine_register("mirror_ring_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_mirror_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+
+        _mirror_machine = machine;
+        mirror_machine = machine;
+    }
+    return (const IOM *)machine;
+}
+
+IO_HANDLE
+new_mirror_machine(size_t buffer_size)
+{
+    const IOM *m = get_mirror_machine();
+
+    struct mirroriom_args args = {buffer_size};
+    return m->create(&args);
+}
+
+/*
+ * In-place access.  mirror_acquire_read() returns a pointer to every readable
+ * byte as one contiguous span; mirror_release_read() consumes "bytes" of it.
+ * Only the consumer thread may call these.
+ */
+int
+mirror_acquire_read(IO_HANDLE h, const void **ptr, size_t *bytes)
+{
+    struct __block_t *b;
+    int ret = acquire_read_block(h, 0, &b);
+
+    *ptr = (b) ? b->data : NULL;
+    *bytes = (b) ? b->bytes : 0;
+    return ret;
+}
+
+void
+mirror_release_read(IO_HANDLE h, size_t bytes)
+{
+    release_read_block(h, NULL, bytes);
+}
+
+/*
+ * In-place writes: mirror_acquire_write() returns all of the free space as
+ * one contiguous span; mirror_commit_write() publishes "bytes" of it.  Only
+ * the producer thread may call these.
+ */
+int
+mirror_acquire_write(IO_HANDLE h, void **ptr, size_t *bytes)
+{
+    struct __block_t *b;
+    int ret = acquire_write_block(h, 0, &b);
+
+    *ptr = (b) ? b->data : NULL;
+    *bytes = (b) ? b->size : 0;
+    return ret;
+}
+
+void
+mirror_commit_write(IO_HANDLE h, size_t bytes)
+{
+    commit_write_block(h, NULL, bytes);
+}
+
+size_t
+mirror_get_size(IO_HANDLE h)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+    return r->size;
+}
+
+size_t
+mirror_get_bytes(IO_HANDLE h)
+{
+    struct mirror_t *r = (struct mirror_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    return head - tail;
+}
@@ -1,13 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "machine.h"
 #include "filter.h"
 #include "block-list-buffer.h"
 #include "simple-buffers.h"
+#include "ring-buf.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+#include "bw-util.h"
 
 #define LOGEX_TAG "RING-BUF"
 #include "logging.h"
@@ -17,6 +27,7 @@
 #define DEFAULT_BLK_BYTES   10*MB
 #define DEFAULT_ALIGN 1*MB
 #define DEFAULT_REALLOC 16
+#define DEFAULT_SPILL_DIR "/var/tmp"
 
 static size_t default_buf_bytes = DEFAULT_BUF_BYTES;
 static size_t default_blk_bytes = DEFAULT_BLK_BYTES;
@@ -29,6 +40,24 @@ enum rb_state_e {
     RB_STATE_READY,
 };
 
+// Result of making room for the next block
+enum rb_room_e {
+    RB_ROOM_READY=0,        // The next block is empty
+    RB_ROOM_FULL,           // Full: hold the write back
+    RB_ROOM_DROP,           // Full: drop the write
+    RB_ROOM_SPILL,          // Full: append the write to the spill file
+    RB_ROOM_GROW,           // Full under the cap: the ring can expand
+};
+
+// Blocks added by one expansion, released together
+struct rb_extent_t {
+    char *data;             // Block data (one allocation)
+    size_t bytes;           // Bytes of block data
+    size_t n_blocks;        // Blocks in this extent
+    struct __block_t *blocks; // Block descriptors (one segment)
+    struct rb_extent_t *next;
+};
+
 // Ring descriptor
 struct ring_t {
     IO_DESC _b;  // Generic buffer
@@ -51,6 +80,30 @@ struct ring_t {
     size_t high_water_count;// Upper limit for bytes
     size_t low_water_mark;  //
     size_t min_return_size; // If there are fewer bytes, return 0
+    uint32_t alloc_flags;   // Buffer allocation flags (BF_HUGEPAGE, etc.)
+
+    size_t max_bytes;       // Hard cap on the buffer size (0: unbounded)
+    int capped;             // Writes are being held back by the cap
+
+    enum bf_overflow_e overflow; // What to do when full at the cap
+    uint32_t timeout_ms;    // BF_OVERFLOW_BLOCK: longest wait for the reader
+    pthread_cond_t space;   // Signalled when the reader frees blocks
+    int space_waiters;      // Writers waiting on "space"
+    struct __block_t *scratch; // Borrowed in place of a block that will be dropped
+    int scratch_out;        // The scratch block is borrowed
+    int scratch_spill;      // ...and its data goes to the spill file
+
+    struct block_meta_t wmeta; // Metadata for the next write (advanced as it's written)
+    struct block_meta_t rmeta; // Metadata for the last read
+
+    int spill_fd;           // Spill file (-1: none)
+    off_t spill_rd;         // Next spilled byte to page back in
+    off_t spill_wr;         // End of spilled data
+
+    struct rb_extent_t *extents; // Expansions, newest first
+    uint32_t reclaim_ms;    // Idle time before an expansion is released (0: never)
+    uint64_t window_start;  // Start of the current occupancy window (ms)
+    size_t peak_bytes;      // Peak stored bytes in the current window
 
     enum rb_state_e state;  // Buffer state
 };
@@ -78,6 +131,130 @@ low_water_mark_hit(struct ring_t *ring)
     }
 }
 
+/*
+ * Spill tier: once the ring is full at its cap, writes are appended to a file,
+ * and paged back into the ring, in order, as the reader frees blocks.  While
+ * anything is spilled, new writes queue behind it in the file.
+ */
+static inline int
+spill_pending(struct ring_t *ring)
+{
+    return ring->spill_wr > ring->spill_rd;
+}
+
+/*
+ * Append to the spill file.  Data that can't be written is dropped.  Called
+ * with wlock held.
+ */
+static void
+spill_write(struct ring_t *ring, const char *data, size_t bytes)
+{
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = pwrite(ring->spill_fd, data + done, bytes - done, ring->spill_wr + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            error("Spill write failed (%s): dropping %zu bytes", strerror(errno), bytes - done);
+            size_t n_blocks = (bytes - done + ring->block_size - 1) / ring->block_size;
+            machine_metrics_drop(ring->_b.metrics, bytes - done, n_blocks);
+            break;
+        }
+        done += n;
+    }
+
+    pthread_mutex_lock(&ring->_b.lock);
+    ring->spill_wr += done;
+    pthread_mutex_unlock(&ring->_b.lock);
+}
+
+/*
+ * Page spilled data back into free blocks, keeping one block free for the
+ * writer.  Returns bytes paged in.  Called with wlock held.
+ */
+static size_t
+spill_page_in(struct ring_t *ring)
+{
+    pthread_mutex_t *lock = &ring->_b.lock;
+    size_t paged = 0;
+
+    while (spill_pending(ring)) {
+        struct __block_t *b = ring->wp;
+
+        pthread_mutex_lock(lock);
+        struct __block_t *next = b->next;
+        int room = BLOCK_EMPTY(next);
+        pthread_mutex_unlock(lock);
+
+        if (!room) {
+            break;
+        }
+
+        size_t left = (size_t)(ring->spill_wr - ring->spill_rd);
+        size_t bytes = (left < b->size) ? left : b->size;
+        ssize_t n = pread(ring->spill_fd, b->data, bytes, ring->spill_rd);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            error("Spill read failed (%s)", strerror(errno));
+            break;
+        }
+
+        b->meta.flags = 0;
+
+        pthread_mutex_lock(lock);
+        ring->spill_rd += n;
+        b->bytes = n;
+        ring->bytes += n;
+        pthread_mutex_unlock(lock);
+
+        ring->wp = next;
+        paged += n;
+    }
+
+    if (!paged) {
+        return 0;
+    }
+
+    // Give back disk space already paged in
+    if (!spill_pending(ring)) {
+        if (ftruncate(ring->spill_fd, 0) == 0) {
+            pthread_mutex_lock(lock);
+            ring->spill_rd = 0;
+            ring->spill_wr = 0;
+            pthread_mutex_unlock(lock);
+        }
+    } else {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        off_t end = ring->spill_rd & ~((off_t)4096 - 1);
+        if (end > 0) {
+            fallocate(ring->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, end);
+        }
+#endif
+    }
+
+    return paged;
+}
+
+/*
+ * Readers page spilled data in when the ring runs dry, unless a writer is busy
+ * (the writer pages in first, on its next write).  Called with rlock held.
+ */
+static void
+spill_reader_page_in(struct ring_t *ring)
+{
+    if (!spill_pending(ring) || BLOCK_UNREAD(ring->rp) != 0) {
+        return;
+    }
+
+    if (pthread_mutex_trylock(&ring->wlock) == 0) {
+        spill_page_in(ring);
+        pthread_mutex_unlock(&ring->wlock);
+    }
+}
+
 static int
 buf_read(IO_FILTER_ARGS)
 {
@@ -96,8 +273,13 @@ buf_read(IO_FILTER_ARGS)
 
     // Lock reading from this buffer
     pthread_mutex_lock(&ring->rlock);
+    spill_reader_page_in(ring);
     struct __block_t *b = ring->rp;
 
+    // Metadata for the first byte read
+    ring->rmeta = b->meta;
+    block_meta_advance(&ring->rmeta, b->offset);
+
     // Initialize read vars
     pthread_mutex_t *lock = &ring->_b.lock;
     int flush = ring->flush;
@@ -113,7 +295,7 @@ buf_read(IO_FILTER_ARGS)
     }
 
     while (remaining) {
-        size_t _bytes = b->bytes;
+        size_t _bytes = BLOCK_UNREAD(b);
 
         if (0 == _bytes) {
             if (IO_FILTER_ARGS_BLOCK == IO_BLOCK) {
@@ -130,27 +312,28 @@ buf_read(IO_FILTER_ARGS)
             _bytes = remaining;
         }
 
-        memcpy(data, b->data, _bytes);
+        bw_memcpy(data, b->data + b->offset, _bytes);
         remaining -= _bytes;
         data += _bytes;
         bytes_read += _bytes;
 
+        // Partial reads advance the cursor; the block is recycled once drained
         if (partial_read) {
-            memmove(b->data, b->data + _bytes, b->bytes - _bytes);
-        }
-
-        pthread_mutex_lock(lock);
-        if (partial_read) {
-            b->bytes -= _bytes;
+            b->offset += _bytes;
         } else {
-            b->bytes -= _bytes;
+            pthread_mutex_lock(lock);
+            b->offset = 0;
+            b->bytes = 0;
             b = b->next;
+            pthread_mutex_unlock(lock);
         }
-        pthread_mutex_unlock(lock);
     }
 
     pthread_mutex_lock(lock);
     ring->bytes -= bytes_read;
+    if (ring->space_waiters) {
+        pthread_cond_broadcast(&ring->space);
+    }
     pthread_mutex_unlock(lock);
 
     // Unlock reading from this buffer
@@ -159,7 +342,7 @@ buf_read(IO_FILTER_ARGS)
 
     *IO_FILTER_ARGS_BYTES = bytes_read;
 
-    if (flush && bytes_read == 0) {
+    if (flush && bytes_read == 0 && !spill_pending(ring)) {
         io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
         return IO_COMPLETE;
     }
@@ -178,7 +361,8 @@ rb_data_init(struct ring_t *ring, size_t min_bytes)
         
     pthread_mutex_lock(&ring->wlock);
     pthread_mutex_lock(&ring->rlock);
-    size_t bytes = block_data_fastalloc(ring->_b.pool, ring->wp, block_size);
+    size_t bytes = block_data_fastalloc_flags(ring->_b.pool, ring->wp, block_size,
+        ring->alloc_flags);
     ring->block_size = block_size;
     ring->size += bytes;
     pthread_mutex_unlock(&ring->rlock);
@@ -203,8 +387,103 @@ ring_data_init(struct ring_t *ring, size_t bytes)
     return 0;
 }
 
-static int
-get_next_block(struct ring_t *ring, struct __block_t **b)
+static uint64_t
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * The ring is full at its cap: apply the overflow policy to the block after
+ * "_b".  Called with wlock held.
+ */
+static enum rb_room_e
+ring_full(struct ring_t *ring, struct __block_t *_b, struct __block_t **b)
+{
+    pthread_mutex_t *lock = &ring->_b.lock;
+    struct __block_t *next = _b->next;
+
+    switch (ring->overflow) {
+    case BF_OVERFLOW_DROP_NEWEST:
+        return RB_ROOM_DROP;
+
+    case BF_OVERFLOW_DROP_OLDEST: {
+        // The block after the writer is the oldest unread block
+        pthread_mutex_lock(&ring->rlock);
+        pthread_mutex_lock(lock);
+        if (ring->rp != next) {
+            pthread_mutex_unlock(lock);
+            pthread_mutex_unlock(&ring->rlock);
+            return RB_ROOM_FULL;
+        }
+
+        size_t bytes = BLOCK_UNREAD(next);
+        next->offset = 0;
+        next->bytes = 0;
+        ring->bytes -= bytes;
+        ring->rp = next->next;
+        pthread_mutex_unlock(lock);
+        pthread_mutex_unlock(&ring->rlock);
+
+        machine_metrics_drop(ring->_b.metrics, bytes, 1);
+        *b = next;
+        return RB_ROOM_READY;
+    }
+
+    case BF_OVERFLOW_SPILL:
+        if (ring->spill_fd >= 0) {
+            return RB_ROOM_SPILL;
+        }
+        return RB_ROOM_FULL;
+
+    case BF_OVERFLOW_BLOCK: {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ring->timeout_ms / 1000;
+        ts.tv_nsec += (long)(ring->timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(lock);
+        ring->space_waiters++;
+        int rc = 0;
+        while (!BLOCK_EMPTY(next) && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&ring->space, lock, &ts);
+        }
+        ring->space_waiters--;
+        int empty = BLOCK_EMPTY(next);
+        pthread_mutex_unlock(lock);
+
+        if (!empty) {
+            return RB_ROOM_DROP;
+        }
+        *b = next;
+        return RB_ROOM_READY;
+    }
+
+    default:
+        if (!ring->capped) {
+            char bytestr[64];
+            size_t_fmt(bytestr, 64, ring->size);
+            debug("Buffer full at %sB: holding writes", bytestr);
+            ring->capped = 1;
+        }
+        return RB_ROOM_FULL;
+    }
+}
+
+/*
+ * Get the block after "b", expanding the ring if it is full, up to the cap.
+ * Past the cap, the overflow policy decides.  Without "grow", a ring that
+ * could expand returns RB_ROOM_GROW instead.  Called with wlock held, before
+ * "b" is published, so readers can't pass the new blocks.
+ */
+static enum rb_room_e
+get_next_block(struct ring_t *ring, struct __block_t **b, int grow)
 {
     struct __block_t *_b = *b;
 
@@ -214,24 +493,57 @@ get_next_block(struct ring_t *ring, struct __block_t **b)
     pthread_mutex_unlock(lock);
 
     if (BLOCK_EMPTY(next)) {
+        ring->capped = 0;
         *b = next;
-        return 0;
+        return RB_ROOM_READY;
+    }
+
+    // Only growing rings expand without a cap
+    size_t cap = ring->max_bytes;
+    if (!cap && ring->overflow != BF_OVERFLOW_GROW) {
+        cap = ring->size;
+    }
+
+    size_t n_blocks = ring->block_realloc * 2;
+    if (cap) {
+        size_t room = 0;
+        if (cap > ring->size) {
+            room = (cap - ring->size) / ring->block_size;
+        }
+
+        if (room == 0) {
+            return ring_full(ring, _b, b);
+        }
+        n_blocks = (n_blocks < room) ? n_blocks : room;
+    }
+
+    if (!grow) {
+        return RB_ROOM_GROW;
     }
 
     debug("Out of space: allocating more write buffers");
 
-    pthread_mutex_lock(lock);
-    ring->block_realloc *= 2;
-    size_t n_blocks = ring->block_realloc;
-    pthread_mutex_unlock(lock);
+    struct rb_extent_t *e = palloc(ring->_b.pool, sizeof(struct rb_extent_t));
+    if (!e) {
+        return RB_ROOM_FULL;
+    }
 
     struct __block_t *add_head = block_list_alloc(ring->_b.pool, n_blocks);
-    size_t added_bytes = block_data_fastalloc(ring->_b.pool, add_head, ring->block_size);
+    size_t added_bytes = block_data_fastalloc_flags(ring->_b.pool, add_head, ring->block_size,
+        ring->alloc_flags);
     if (added_bytes == 0) {
-        pfree(ring->_b.pool, add_head);
-        return 1;
+        block_list_free(ring->_b.pool, add_head);
+        pfree(ring->_b.pool, e);
+        return RB_ROOM_FULL;
     }
 
+    e->data = add_head->data;
+    e->bytes = added_bytes;
+    e->n_blocks = added_bytes / ring->block_size;
+    e->blocks = add_head;
+    e->next = ring->extents;
+    ring->extents = e;
+
     struct __block_t *add_tail = add_head;
     while (add_tail->next) {
         add_tail = add_tail->next;
@@ -241,10 +553,98 @@ get_next_block(struct ring_t *ring, struct __block_t **b)
     _b->next = add_head;
     add_tail->next = next;
     ring->size += added_bytes;
+    ring->block_realloc = n_blocks;
     *b = _b->next;
     pthread_mutex_unlock(lock);
 
-    return 0;
+    // The cool-down restarts with every expansion
+    ring->window_start = now_ms();
+    ring->peak_bytes = ring->bytes;
+
+    return RB_ROOM_READY;
+}
+
+static inline int
+block_in_extent(struct __block_t *b, struct rb_extent_t *e)
+{
+    return (b->data >= e->data) && (b->data < e->data + e->bytes);
+}
+
+/*
+ * Release the newest expansion once occupancy has stayed low for a full
+ * cool-down.  Its blocks must all be empty (between wp and rp).  Called with
+ * wlock held.
+ */
+static void
+reclaim_extents(struct ring_t *ring)
+{
+    if (!ring->extents || !ring->reclaim_ms) {
+        return;
+    }
+
+    if (ring->bytes > ring->peak_bytes) {
+        ring->peak_bytes = ring->bytes;
+    }
+
+    uint64_t now = now_ms();
+    if (now - ring->window_start < ring->reclaim_ms) {
+        return;
+    }
+
+    size_t peak = ring->peak_bytes;
+    ring->window_start = now;
+    ring->peak_bytes = ring->bytes;
+
+    // Keep at least twice the peak occupancy
+    struct rb_extent_t *e = ring->extents;
+    if (2 * peak > ring->size - e->bytes) {
+        return;
+    }
+
+    // Readers can't move while blocks are unlinked; try again next window
+    if (pthread_mutex_trylock(&ring->rlock) != 0) {
+        return;
+    }
+
+    struct __block_t *rp = ring->rp;
+    struct __block_t *b = ring->wp->next;
+    size_t n_idle = 0;
+    for (; b != rp && b != ring->wp; b = b->next) {
+        n_idle += block_in_extent(b, e);
+    }
+
+    if (n_idle < e->n_blocks) {
+        pthread_mutex_unlock(&ring->rlock);
+        return;
+    }
+
+    pthread_mutex_t *lock = &ring->_b.lock;
+    pthread_mutex_lock(lock);
+
+    struct __block_t *prev = ring->wp;
+    while (prev->next != rp) {
+        b = prev->next;
+        if (block_in_extent(b, e)) {
+            prev->next = b->next;
+        } else {
+            prev = b;
+        }
+    }
+
+    ring->size -= e->bytes;
+    ring->extents = e->next;
+    ring->block_realloc = (ring->block_realloc / 2 > DEFAULT_REALLOC) ?
+        ring->block_realloc / 2 : DEFAULT_REALLOC;
+    pthread_mutex_unlock(lock);
+    pthread_mutex_unlock(&ring->rlock);
+
+    char bytestr[64];
+    size_t_fmt(bytestr, 64, e->bytes);
+    debug("Reclaimed %sB of idle buffer", bytestr);
+
+    bw_mem_free(ring->_b.pool, e->data);
+    block_list_free(ring->_b.pool, e->blocks);
+    pfree(ring->_b.pool, e);
 }
 
 // Write to a buffer
@@ -277,28 +677,57 @@ buf_write(IO_FILTER_ARGS)
 
     // Lock writing to this buffer
     pthread_mutex_lock(&ring->wlock);
+
+    // Spilled data goes back first; new data queues behind what's left
+    size_t paged = 0;
+    int spill = 0;
+    if (spill_pending(ring)) {
+        paged = spill_page_in(ring);
+        spill = spill_pending(ring);
+    }
+
     struct __block_t *b = ring->wp;
 
     // Initialize write vars
     pthread_mutex_t *lock = &ring->_b.lock;
 
     size_t written = 0;
+    size_t dropped = 0;
     size_t remaining = *IO_FILTER_ARGS_BYTES;
 
-    // Write input bytes to buffer
+    // Write input bytes to buffer; when full, the write is cut short, dropped or spilled
     while (remaining) {
+        struct __block_t *next = b;
+        enum rb_room_e room = (spill) ? RB_ROOM_SPILL : get_next_block(ring, &next, 0);
+        if (room == RB_ROOM_FULL) {
+            break;
+        }
+
+        if (room == RB_ROOM_SPILL) {
+            spill_write(ring, data, remaining);
+            dropped = remaining;
+            break;
+        }
+
+        if (room == RB_ROOM_DROP) {
+            size_t n_blocks = (remaining + b->size - 1) / b->size;
+            machine_metrics_drop(ring->_b.metrics, remaining, n_blocks);
+            dropped = remaining;
+            break;
+        }
+
         size_t _bytes = (remaining < b->size) ? remaining : b->size;
 
-        char *tmp_b_data = b->data;
-        char *tmp_f_buf = data;
-        size_t tmp_r = _bytes;
-        while (tmp_r > 0) {
-            *tmp_b_data = *tmp_f_buf;
-            tmp_b_data++;
-            tmp_f_buf++;
-            tmp_r--;
+        bw_memcpy_stream(b->data, data, _bytes);
+
+        // The ring expands only once this block is filled
+        if (room == RB_ROOM_GROW && get_next_block(ring, &next, 1) != RB_ROOM_READY) {
+            break;
         }
 
+        b->meta = ring->wmeta;
+        block_meta_advance(&ring->wmeta, _bytes);
+
         remaining -= _bytes;
         data += _bytes;
         written += _bytes;
@@ -307,7 +736,7 @@ buf_write(IO_FILTER_ARGS)
         b->bytes = _bytes;
         pthread_mutex_unlock(lock);
 
-        get_next_block(ring, &b);
+        b = next;
     }
 
     pthread_mutex_lock(lock);
@@ -319,11 +748,18 @@ buf_write(IO_FILTER_ARGS)
     }
 
     ring->wp = b;
+    reclaim_extents(ring);
 
     // Unlock writing to this buffer
     pthread_mutex_unlock(&ring->wlock);
 
-    *IO_FILTER_ARGS_BYTES = written;
+    // Dropped and spilled bytes count as written
+    *IO_FILTER_ARGS_BYTES = written + dropped;
+    if (written + paged == 0) {
+        return (dropped) ? IO_SUCCESS : IO_NODATA;
+    }
+
+    machine_desc_notify(&ring->_b);
     return IO_SUCCESS;
 }
 
@@ -333,7 +769,14 @@ buf_write(IO_FILTER_ARGS)
 static void
 destroy_rb_machine(IO_HANDLE h)
 {
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    int spill_fd = (ring) ? ring->spill_fd : -1;
+
     machine_destroy_desc(h);
+
+    if (spill_fd >= 0) {
+        close(spill_fd);
+    }
 }
 
 static IO_HANDLE
@@ -341,8 +784,26 @@ create_buffer(void *arg)
 {
     IO_HANDLE h = 0;
 
+    // Without a buffer size, memory is allocated on the first write
+    struct rbiom_args *args = (struct rbiom_args *)arg;
+    size_t buf_bytes = (args) ? args->buf_bytes : 0;
+    size_t block_bytes = (args && args->block_bytes) ? args->block_bytes : default_blk_bytes;
+
+    // Pre-faulted buffers are allocated up front, so the first write is fast
+    if (args && (args->flags & BF_PREFAULT) && !buf_bytes) {
+        buf_bytes = default_buf_bytes;
+    }
+
+    size_t block_count = DEFAULT_REALLOC;
+    if (buf_bytes) {
+        block_count = buf_bytes / block_bytes;
+        if ((block_count * block_bytes) < buf_bytes) {
+            block_count++;
+        }
+    }
+
     // Create a new pool for this buffer
-    POOL *p = create_subpool(_ring_buffer_machine->alloc);
+    POOL *p = bw_create_subpool(_ring_buffer_machine->alloc);
     if (!p) {
         error("Failed to create memory pool");
         return 0;
@@ -356,7 +817,7 @@ create_buffer(void *arg)
     }
 
     // Create block descriptors
-    struct __block_t *blocks = block_list_alloc(p, DEFAULT_REALLOC);
+    struct __block_t *blocks = block_list_alloc(p, block_count);
     if (!blocks) {
         error("Failed to create descriptor");
         goto free_and_return;
@@ -367,15 +828,34 @@ create_buffer(void *arg)
     ring->rp = blocks;
     ring->block_align = DEFAULT_ALIGN;
     ring->block_realloc = DEFAULT_REALLOC;
+    ring->alloc_flags = (args) ? (args->flags & BF_ALLOC_MASK) : 0;
+    ring->max_bytes = (args) ? args->max_bytes : 0;
+    ring->reclaim_ms = (args) ? args->reclaim_ms : 0;
+    ring->spill_fd = -1;
 
     pthread_mutex_init(&ring->wlock, NULL);
     pthread_mutex_init(&ring->rlock, NULL);
+    pthread_cond_init(&ring->space, NULL);
 
     if (machine_desc_init(p, _ring_buffer_machine, (IO_DESC *)ring) < IO_SUCCESS) {
         error("Failed to initialize mechine descriptor");
         goto free_and_return;
     }
 
+    // Allocated from the descriptor's pool
+    if (buf_bytes) {
+        if (rb_data_init(ring, block_bytes) < IO_SUCCESS) {
+            error("Failed to allocate buffer");
+            goto free_and_return;
+        }
+        ring->state = RB_STATE_READY;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)ring) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
     if (!filter_read_init(p, "ring_buf_r", buf_read, (IO_DESC *)ring)) {
         error("Failed to initialize read filter");
         goto free_and_return;
@@ -390,7 +870,7 @@ create_buffer(void *arg)
     return h;
 
 free_and_return:
-    free_pool(p);
+    bw_free_pool(p);
     return h;
 }
 
@@ -413,6 +893,9 @@ stop_buffer(IO_HANDLE h)
         struct ring_t *r = (struct ring_t *)d;
         r->flush = 1;
     }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
 }
 
 static void *
@@ -427,6 +910,114 @@ get_metrics(IO_HANDLE h)
     return ring->_b.metrics;
 }
 
+static int
+get_read_meta(IO_HANDLE h, struct block_meta_t *meta)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&ring->rlock);
+    *meta = ring->rmeta;
+    pthread_mutex_unlock(&ring->rlock);
+    return IO_SUCCESS;
+}
+
+/*
+ * Writes are tagged with "meta", advanced by the bytes written, until it is
+ * set again
+ */
+static int
+set_write_meta(IO_HANDLE h, const struct block_meta_t *meta)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->wmeta = *meta;
+    pthread_mutex_unlock(&ring->wlock);
+    return IO_SUCCESS;
+}
+
+/*
+ * Block borrowing
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct ring_t *ring = (struct ring_t *)d;
+    if (!ring) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    // Lock reading from this buffer until the block is released
+    pthread_mutex_lock(&ring->rlock);
+    spill_reader_page_in(ring);
+    struct __block_t *rp = ring->rp;
+    int flush = ring->flush;
+
+    int empty = (BLOCK_UNREAD(rp) == 0);
+    if (empty || (!flush && ring->min_return_size > ring->bytes)) {
+        pthread_mutex_unlock(&ring->rlock);
+        *b = NULL;
+
+        if (flush && empty && !spill_pending(ring)) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    *b = rp;
+    return IO_SUCCESS;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return IO_ERROR;
+    }
+
+    pthread_mutex_t *lock = &ring->_b.lock;
+    b->offset += bytes;
+
+    pthread_mutex_lock(lock);
+    ring->bytes -= bytes;
+    if (BLOCK_UNREAD(b) == 0) {
+        b->offset = 0;
+        b->bytes = 0;
+        ring->rp = b->next;
+        if (ring->space_waiters) {
+            pthread_cond_broadcast(&ring->space);
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    // Unlock reading from this buffer
+    pthread_mutex_unlock(&ring->rlock);
+    return IO_SUCCESS;
+}
+
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    return rb_acquire_write_block(h, bytes, (const struct __block_t **)b);
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    rb_release_write_block(h, bytes);
+    return IO_SUCCESS;
+}
+
 /*
  * Mechanism for registering and accessing this io machine
  */
@@ -442,6 +1033,12 @@ get_rb_machine()
         machine->stop = stop_buffer;
         machine->destroy = destroy_rb_machine;
         machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+        machine->get_read_meta = get_read_meta;
+        machine->set_write_meta = set_write_meta;
 
         _ring_buffer_machine = machine;
         rb_machine = machine;
@@ -456,6 +1053,23 @@ new_rb_machine()
     return rb_machine->create(NULL);
 }
 
+/*
+ * Ring buffer allocated up front, with allocation flags (BF_HUGEPAGE,
+ * BF_PREFAULT, BF_MLOCK).  Zero sizes use the defaults.
+ */
+IO_HANDLE
+new_rb_machine_flags(size_t buffer_size, size_t block_size, uint32_t flags)
+{
+    const IOM *rb_machine = get_rb_machine();
+
+    struct rbiom_args args = {
+        (buffer_size) ? buffer_size : default_buf_bytes,
+        block_size,
+        flags,
+    };
+    return rb_machine->create(&args);
+}
+
 int
 rb_acquire_write_block(IO_HANDLE h, size_t init_bytes, const struct __block_t **b)
 {
@@ -478,6 +1092,48 @@ rb_acquire_write_block(IO_HANDLE h, size_t init_bytes, const struct __block_t **
     }
 
     pthread_mutex_lock(&ring->wlock);
+
+    // Spilled data goes back first; new data queues behind what's left
+    enum rb_room_e room = RB_ROOM_SPILL;
+    if (spill_pending(ring)) {
+        spill_page_in(ring);
+    }
+
+    // Make room for the next write now, while the block is unpublished
+    if (!spill_pending(ring)) {
+        struct __block_t *next = ring->wp;
+        room = get_next_block(ring, &next, 1);
+    }
+
+    if (room == RB_ROOM_FULL) {
+        pthread_mutex_unlock(&ring->wlock);
+        *b = NULL;
+        return IO_NODATA;
+    }
+
+    // Data written to the scratch block is dropped (or spilled) on release
+    if (room == RB_ROOM_DROP || room == RB_ROOM_SPILL) {
+        if (!ring->scratch) {
+            struct __block_t *s = pcalloc(ring->_b.pool, sizeof(struct __block_t));
+            char *data = (s) ? palloc(ring->_b.pool, ring->block_size) : NULL;
+            if (!data) {
+                pthread_mutex_unlock(&ring->wlock);
+                goto error_return;
+            }
+            s->data = data;
+            s->size = ring->block_size;
+            ring->scratch = s;
+        }
+
+        ring->scratch_out = 1;
+        ring->scratch_spill = (room == RB_ROOM_SPILL);
+        *b = (const struct __block_t *)ring->scratch;
+        return IO_SUCCESS;
+    }
+
+    // Pending metadata, unless the caller sets its own
+    ring->wp->meta = ring->wmeta;
+
     *b = (const struct __block_t *)ring->wp;
     return IO_SUCCESS;
 
@@ -494,12 +1150,35 @@ rb_release_write_block(IO_HANDLE h, size_t bytes)
         return;
     }
 
+    if (ring->scratch_out) {
+        ring->scratch_out = 0;
+        if (bytes && ring->scratch_spill) {
+            spill_write(ring, ring->scratch->data, bytes);
+        } else if (bytes) {
+            machine_metrics_drop(ring->_b.metrics, bytes, 1);
+        }
+        pthread_mutex_unlock(&ring->wlock);
+        return;
+    }
+
+    // Nothing written: keep the block, so readers never stall on an empty one
+    if (bytes == 0) {
+        pthread_mutex_unlock(&ring->wlock);
+        return;
+    }
+
+    // Room was made when the block was acquired
     struct __block_t *b = ring->wp;
-    b->bytes = bytes;
+    struct __block_t *next = b->next;
 
-    get_next_block(ring, &b);
+    // Later writes follow on from the block's metadata
+    if (b->meta.flags & BLOCK_META_VALID) {
+        ring->wmeta = b->meta;
+        block_meta_advance(&ring->wmeta, bytes);
+    }
 
     pthread_mutex_lock(&ring->_b.lock);
+    b->bytes = bytes;
     ring->bytes += bytes;
     pthread_mutex_unlock(&ring->_b.lock);
 
@@ -507,10 +1186,13 @@ rb_release_write_block(IO_HANDLE h, size_t bytes)
         high_water_mark_hit(ring);
     }
 
-    ring->wp = b;
+    ring->wp = next;
+    reclaim_extents(ring);
 
     // Unlock writing to this buffer
     pthread_mutex_unlock(&ring->wlock);
+
+    machine_desc_notify(&ring->_b);
 }
 
 void
@@ -571,6 +1253,123 @@ rb_set_high_water_mark(IO_HANDLE h, size_t bytes)
     ring->high_water_mark = bytes;
 }
 
+/*
+ * Hard cap on the buffer size.  At the cap, the ring stops growing and writes
+ * are cut short (0 bytes, IO_NODATA) until the reader frees blocks.
+ */
+void
+rb_set_max_size(IO_HANDLE h, size_t bytes)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->max_bytes = bytes;
+    pthread_mutex_unlock(&ring->wlock);
+}
+
+/*
+ * Expansions are released once occupancy has stayed under half the remaining
+ * size for "ms" milliseconds.  0, the default, keeps every expansion.
+ */
+void
+rb_set_reclaim_ms(IO_HANDLE h, uint32_t ms)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->reclaim_ms = ms;
+    ring->window_start = now_ms();
+    pthread_mutex_unlock(&ring->wlock);
+}
+
+/*
+ * What to do when the ring is full at its cap.  Without a cap, only
+ * BF_OVERFLOW_GROW expands the ring.  timeout_ms is the longest
+ * BF_OVERFLOW_BLOCK waits for the reader.  Dropped data is counted in the
+ * machine's metrics, which this enables.
+ */
+void
+rb_set_overflow(IO_HANDLE h, enum bf_overflow_e policy, uint32_t timeout_ms)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    machine_metrics_enable(h);
+
+    pthread_mutex_lock(&ring->wlock);
+    ring->overflow = policy;
+    ring->timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&ring->wlock);
+}
+
+/*
+ * Spill writes past the cap (see rb_set_max_size; without one, past the
+ * current size) to a file in "dir" (NULL: /var/tmp), and page them back in
+ * order as the reader catches up.  The file is unlinked on creation and
+ * closed when the ring is destroyed.
+ */
+int
+rb_set_spill(IO_HANDLE h, const char *dir)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        error("Machine %d not found", h);
+        return IO_ERROR;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bw-spill-XXXXXX", (dir) ? dir : DEFAULT_SPILL_DIR);
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        error("Failed to create spill file %s (%s)", path, strerror(errno));
+        return IO_ERROR;
+    }
+    unlink(path);
+
+    machine_metrics_enable(h);
+
+    pthread_mutex_lock(&ring->wlock);
+    if (ring->spill_fd >= 0) {
+        pthread_mutex_unlock(&ring->wlock);
+        close(fd);
+        error("Machine %d already spills", h);
+        return IO_ERROR;
+    }
+    ring->spill_fd = fd;
+    ring->overflow = BF_OVERFLOW_SPILL;
+    pthread_mutex_unlock(&ring->wlock);
+
+    trace("Spilling to %s", path);
+    return IO_SUCCESS;
+}
+
+size_t
+rb_get_spilled(IO_HANDLE h)
+{
+    struct ring_t *ring = (struct ring_t *)machine_get_desc(h);
+    if (!ring) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ring->_b.lock);
+    size_t bytes = (size_t)(ring->spill_wr - ring->spill_rd);
+    pthread_mutex_unlock(&ring->_b.lock);
+
+    return bytes;
+}
+
 void
 rb_set_log_level(char *level)
 {
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "ring-buf.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+
+#define LOGEX_TAG "SHM-BUF"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_BUF_BYTES 64*MB
+#define CACHELINE 64
+
+#define SHM_MAGIC 0x42575348    // "BWSH"
+#define SHM_VERSION 1
+#define SHM_ATTACH_MS 1000      // How long to wait for a creator to finish
+
+static size_t default_buf_bytes = DEFAULT_BUF_BYTES;
+
+const IOM *shm_machine;
+static IOM *_shm_machine = NULL;
+
+/*
+ * Shared-memory ring header (first page of the shared object)
+ *
+ * The layout is fixed: every process that attaches reads it.  "head" and
+ * "tail" are free-running byte counters, owned by the writer and reader
+ * processes respectively, like the mirror ring.  "data_event" is the event
+ * count and waiter count behind the futex the reader parks on.
+ */
+struct shm_header_t {
+    uint32_t magic;             // SHM_MAGIC once the creator has initialized it
+    uint32_t version;
+    uint64_t size;              // Data bytes (page multiple)
+    uint32_t closed;            // Writer stopped: drain, then complete
+
+    char _pad0[CACHELINE];
+
+    uint64_t head;              // Total bytes written
+    uint32_t data_event[2];     // Event count, waiters
+
+    char _pad1[CACHELINE];
+
+    uint64_t tail;              // Total bytes consumed
+
+    char _pad2[CACHELINE];
+};
+
+/*
+ * Shared-memory single-producer/single-consumer byte ring
+ *
+ * The ring is a named POSIX shared memory object: a header page followed by
+ * the data, which is mapped twice back to back (like the mirror ring) so any
+ * span of the ring is contiguous.  One process writes and one process reads;
+ * each opens the ring by name.  Data crosses between processes with no
+ * kernel copies, and the reader is woken by a futex in the header.
+ */
+struct shm_t {
+    IO_DESC _b;  // Generic buffer
+
+    char *name;                 // Shared memory object name
+    int owner;                  // Created the object: unlink it on destroy
+    struct shm_header_t *hdr;   // Shared header (start of the mapping)
+    char *base;                 // First data mapping (the second follows it)
+    size_t size;                // Capacity in bytes
+    size_t map_bytes;           // Whole reserved mapping
+    int flush;                  // Local stop: keep reading until empty
+    int writer;                 // Has written: stopping closes the ring
+
+    struct __block_t wview;     // Borrowed write region
+    struct __block_t rview;     // Borrowed read region
+};
+
+static inline size_t
+readable(struct shm_t *r)
+{
+    struct shm_header_t *hdr = r->hdr;
+    return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) - hdr->tail;
+}
+
+static inline size_t
+writable(struct shm_t *r)
+{
+    struct shm_header_t *hdr = r->hdr;
+    return r->size - (hdr->head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline void
+consume(struct shm_t *r, size_t bytes)
+{
+    struct shm_header_t *hdr = r->hdr;
+    __atomic_store_n(&hdr->tail, hdr->tail + bytes, __ATOMIC_RELEASE);
+}
+
+static inline void
+publish(struct shm_t *r, size_t bytes)
+{
+    struct shm_header_t *hdr = r->hdr;
+    __atomic_store_n(&hdr->head, hdr->head + bytes, __ATOMIC_RELEASE);
+    machine_desc_notify(&r->_b);
+}
+
+static inline int
+is_flushing(struct shm_t *r)
+{
+    return __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE);
+}
+
+// Read from a buffer
+static int
+buf_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct shm_t *r = (struct shm_t *)d;
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    // Read flush before the data, so no bytes are missed
+    int flush = is_flushing(r);
+
+    size_t avail = readable(r);
+    size_t n = *IO_FILTER_ARGS_BYTES;
+    n = (n < avail) ? n : avail;
+    n -= n % IO_FILTER_ARGS_ALIGN;
+
+    if (n) {
+        bw_memcpy(IO_FILTER_ARGS_BUF, r->base + (r->hdr->tail % r->size), n);
+        consume(r, n);
+    }
+
+    *IO_FILTER_ARGS_BYTES = n;
+
+    if (flush && avail == 0) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+        return IO_COMPLETE;
+    }
+
+    return IO_SUCCESS;
+}
+
+// Write to a buffer
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct shm_t *r = (struct shm_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    __atomic_store_n(&r->writer, 1, __ATOMIC_RELAXED);
+
+    // Write what fits (a partial write when the ring is full)
+    size_t n = *IO_FILTER_ARGS_BYTES;
+    size_t space = writable(r);
+    n = (n < space) ? n : space;
+
+    if (n) {
+        bw_memcpy_stream(r->base + (r->hdr->head % r->size), IO_FILTER_ARGS_BUF, n);
+        publish(r, n);
+    }
+
+    *IO_FILTER_ARGS_BYTES = n;
+    return IO_SUCCESS;
+}
+
+/*
+ * Block borrowing: the borrowed "block" is the whole readable (or writable)
+ * region, viewed through the mirror.  Only the reader may borrow read blocks,
+ * and only the writer may borrow write blocks.
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct shm_t *r = (struct shm_t *)d;
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    int flush = is_flushing(r);
+
+    size_t avail = readable(r);
+    if (avail == 0) {
+        *b = NULL;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->rview;
+    v->data = r->base + (r->hdr->tail % r->size);
+    v->size = avail;
+    v->bytes = avail;
+    v->offset = 0;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    consume(r, bytes);
+    return IO_SUCCESS;
+}
+
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    __atomic_store_n(&r->writer, 1, __ATOMIC_RELAXED);
+
+    size_t space = writable(r);
+    if (space == 0) {
+        *b = NULL;
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->wview;
+    v->data = r->base + (r->hdr->head % r->size);
+    v->size = space;
+    v->bytes = 0;
+    v->offset = 0;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    if (bytes) {
+        publish(r, bytes);
+    }
+    return IO_SUCCESS;
+}
+
+/*
+ * Open the shared memory object, creating it if it doesn't exist.  "size" is
+ * set to the data bytes of an existing object.  Returns the fd, or -1.
+ */
+static int
+open_shm(const char *name, size_t *size, int *owner)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        if (*size == 0) {
+            *size = default_buf_bytes;
+        }
+        *size = (*size + page - 1) & ~(page - 1);
+
+        if (ftruncate(fd, page + *size) != 0) {
+            error("Failed to size shared memory \"%s\" (%s)", name, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+
+        *owner = 1;
+        return fd;
+    }
+
+    if (errno != EEXIST) {
+        error("Failed to create shared memory \"%s\" (%s)", name, strerror(errno));
+        return -1;
+    }
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        error("Failed to open shared memory \"%s\" (%s)", name, strerror(errno));
+        return -1;
+    }
+
+    // The creator sizes the object before anything else
+    int ms = 0;
+    struct stat st;
+    while (fstat(fd, &st) == 0 && (size_t)st.st_size <= page && ms < SHM_ATTACH_MS) {
+        usleep(1000);
+        ms++;
+    }
+
+    if ((size_t)st.st_size <= page || ((size_t)st.st_size - page) % page != 0) {
+        error("Shared memory \"%s\" is not a ring buffer", name);
+        close(fd);
+        return -1;
+    }
+
+    *size = (size_t)st.st_size - page;
+    *owner = 0;
+    return fd;
+}
+
+/*
+ * Map the header page, then the data twice, back to back.  Returns the start
+ * of the mapping, or NULL on failure.
+ */
+static char *
+map_shm(int fd, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    void *addr = mmap(NULL, page + 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        error("Failed to reserve shared ring (%s)", strerror(errno));
+        return NULL;
+    }
+
+    char *hdr = (char *)addr;
+    char *hi = hdr + page + size;
+    if (mmap(hdr, page + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(hi, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED) {
+        error("Failed to map shared ring (%s)", strerror(errno));
+        munmap(addr, page + 2 * size);
+        return NULL;
+    }
+
+    return hdr;
+}
+
+/*
+ * Initialize a new header, or wait for the creator to finish initializing it
+ */
+static int
+init_header(struct shm_header_t *hdr, size_t size, int owner)
+{
+    if (owner) {
+        hdr->version = SHM_VERSION;
+        hdr->size = size;
+        __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+        return IO_SUCCESS;
+    }
+
+    int ms = 0;
+    while (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        if (ms++ >= SHM_ATTACH_MS) {
+            error("Shared ring was never initialized");
+            return IO_ERROR;
+        }
+        usleep(1000);
+    }
+
+    if (hdr->version != SHM_VERSION || hdr->size != size) {
+        error("Shared ring version %u (%" PRIu64 " bytes) doesn't match", hdr->version, hdr->size);
+        return IO_ERROR;
+    }
+
+    return IO_SUCCESS;
+}
+
+/*
+ * Create/destroy shared memory buffers
+ */
+static void
+destroy_shm_machine(IO_HANDLE h)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        return;
+    }
+
+    // Neither the mapping nor the name is pool memory
+    char *addr = (char *)r->hdr;
+    size_t map_bytes = r->map_bytes;
+    char name[NAME_MAX];
+    snprintf(name, sizeof(name), "%s", r->name);
+    int owner = r->owner;
+
+    machine_destroy_desc(h);
+    munmap(addr, map_bytes);
+
+    // Processes still attached keep their mappings
+    if (owner) {
+        shm_unlink(name);
+    }
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    struct shmiom_args *args = (struct shmiom_args *)arg;
+    if (!args || !args->name || args->name[0] != '/') {
+        error("Shared memory name must start with '/'");
+        return 0;
+    }
+
+    size_t buf_bytes = args->buf_bytes;
+    int owner = 0;
+    int fd = open_shm(args->name, &buf_bytes, &owner);
+    if (fd < 0) {
+        return 0;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *addr = map_shm(fd, buf_bytes);
+
+    // The mappings keep the memory alive
+    close(fd);
+
+    if (!addr) {
+        goto unlink_and_return;
+    }
+
+    if (init_header((struct shm_header_t *)addr, buf_bytes, owner) < IO_SUCCESS) {
+        goto unmap_and_return;
+    }
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_shm_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        goto unmap_and_return;
+    }
+
+    // Create a new buffer descriptor
+    struct shm_t *r = pcalloc(p, sizeof(struct shm_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    // The mapping is charged to the memory budget like any other buffer
+    if (bw_mem_charge(p, buf_bytes) < IO_SUCCESS) {
+        error("Shared memory buffer is over the memory budget");
+        goto free_and_return;
+    }
+
+    r->name = pcalloc(p, strlen(args->name) + 1);
+    if (!r->name) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+    strcpy(r->name, args->name);
+
+    r->owner = owner;
+    r->hdr = (struct shm_header_t *)addr;
+    r->base = addr + page;
+    r->size = buf_bytes;
+    r->map_bytes = page + 2 * buf_bytes;
+
+    if (machine_desc_init(p, _shm_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    if (machine_desc_event_init_shared((IO_DESC *)r, r->hdr->data_event) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
+    if (!filter_read_init(p, "shm_buf_r", buf_read, (IO_DESC *)r)) {
+        error("Failed to initialize read filter");
+        goto free_and_return;
+    }
+
+    if (!filter_write_init(p, "shm_buf_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+free_and_return:
+    bw_free_pool(p);
+
+unmap_and_return:
+    munmap(addr, page + 2 * buf_bytes);
+
+unlink_and_return:
+    if (owner) {
+        shm_unlink(args->name);
+    }
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    struct shm_t *r = (struct shm_t *)d;
+
+    // Disable writing.  Every attachment can write, so only the one that
+    // did tells the reader process no more data is coming.
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+        if (__atomic_load_n(&r->writer, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Allow reading until the buffer is empty
+    if (d->io_read) {
+        __atomic_store_n(&r->flush, 1, __ATOMIC_RELEASE);
+    }
+
+    // Wake readers (in any process) so they see the flush
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return r->_b.metrics;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_shm_machine()
+{
+    IOM *machine = _shm_machine;
+    if (!machine) {
+        machine = machine_register("shm_ring_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_shm_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+
+        _shm_machine = machine;
+        shm_machine = machine;
+    }
+    return (const IOM *)machine;
+}
+
+/*
+ * Create the shared ring "name" (e.g. "/capture"), or attach to it if another
+ * process already created it.  "buffer_size" is only used by the creator; 0
+ * uses the default.
+ */
+IO_HANDLE
+new_shm_machine(const char *name, size_t buffer_size)
+{
+    const IOM *m = get_shm_machine();
+
+    struct shmiom_args args = {name, buffer_size};
+    return m->create(&args);
+}
+
+size_t
+shm_get_size(IO_HANDLE h)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+    return r->size;
+}
+
+size_t
+shm_get_bytes(IO_HANDLE h)
+{
+    struct shm_t *r = (struct shm_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+
+    size_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    return head - tail;
+}
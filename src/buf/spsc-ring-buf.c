@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+
+#define LOGEX_TAG "SPSC-BUF"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_BUF_BYTES 64*MB
+#define DEFAULT_BLK_BYTES  1*MB
+#define CACHELINE 64
+
+static size_t default_buf_bytes = DEFAULT_BUF_BYTES;
+static size_t default_blk_bytes = DEFAULT_BLK_BYTES;
+
+const IOM *spsc_machine;
+static IOM *_spsc_machine = NULL;
+
+/*
+ * Single-producer/single-consumer block ring
+ *
+ * "head" and "tail" are free-running block counters.  The producer owns head,
+ * the consumer owns tail, and each side keeps a cached copy of the other's
+ * counter so the shared cache line is only touched when the ring looks full
+ * (or empty).  Block contents are published with release stores and observed
+ * with acquire loads, so no locks are taken on the data path.  Partial reads
+ * advance the block's read offset.
+ */
+struct spsc_t {
+    IO_DESC _b;  // Generic buffer
+
+    struct __block_t *blocks;   // Contiguous block descriptors
+    size_t n_blocks;            // Number of blocks in the ring
+    size_t block_size;          // Bytes per block
+    size_t size;                // Total buffer capacity in bytes
+    int flush;                  // Keep reading available until the buffer is empty
+
+    char _pad0[CACHELINE];
+
+    // Producer
+    size_t head;                // Next block to write
+    size_t tail_cache;          // Last observed consumer position
+    size_t written;             // Total bytes published
+
+    char _pad1[CACHELINE];
+
+    // Consumer
+    size_t tail;                // Next block to read
+    size_t head_cache;          // Last observed producer position
+    size_t consumed;            // Total bytes consumed
+
+    char _pad2[CACHELINE];
+};
+
+static inline struct __block_t *
+spsc_block(struct spsc_t *r, size_t n)
+{
+    return r->blocks + (n % r->n_blocks);
+}
+
+/*
+ * Producer: return the next free block, or NULL if the ring is full
+ */
+static struct __block_t *
+producer_block(struct spsc_t *r)
+{
+    if (r->head - r->tail_cache >= r->n_blocks) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (r->head - r->tail_cache >= r->n_blocks) {
+            return NULL;
+        }
+    }
+    return spsc_block(r, r->head);
+}
+
+static void
+producer_publish(struct spsc_t *r, struct __block_t *b, size_t bytes)
+{
+    b->bytes = bytes;
+    __atomic_store_n(&r->written, r->written + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer: return the next full block, or NULL if the ring is empty
+ */
+static struct __block_t *
+consumer_block(struct spsc_t *r)
+{
+    if (r->tail == r->head_cache) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (r->tail == r->head_cache) {
+            return NULL;
+        }
+    }
+    return spsc_block(r, r->tail);
+}
+
+static void
+consumer_release(struct spsc_t *r, struct __block_t *b)
+{
+    b->offset = 0;
+    b->bytes = 0;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+buf_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct spsc_t *r = (struct spsc_t *)d;
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    // Read flush before the data, so no bytes are missed
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    char *data = IO_FILTER_ARGS_BUF;
+    size_t bytes_read = 0;
+    size_t remaining = *IO_FILTER_ARGS_BYTES;
+    remaining -= remaining % IO_FILTER_ARGS_ALIGN;
+
+    while (remaining) {
+        struct __block_t *b = consumer_block(r);
+        if (!b) {
+            if (IO_FILTER_ARGS_BLOCK == IO_BLOCK) {
+                continue;
+            }
+            if (bytes_read % IO_FILTER_ARGS_ALIGN != 0) {
+                continue;
+            }
+            break;
+        }
+
+        size_t avail = BLOCK_UNREAD(b);
+        size_t n = (remaining < avail) ? remaining : avail;
+
+        bw_memcpy(data, b->data + b->offset, n);
+        data += n;
+        remaining -= n;
+        bytes_read += n;
+
+        // Partial reads advance the cursor; the block is recycled once drained
+        if (n < avail) {
+            b->offset += n;
+        } else {
+            consumer_release(r, b);
+        }
+    }
+
+    __atomic_store_n(&r->consumed, r->consumed + bytes_read, __ATOMIC_RELAXED);
+    *IO_FILTER_ARGS_BYTES = bytes_read;
+
+    if (flush && bytes_read == 0) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+        return IO_COMPLETE;
+    }
+
+    return IO_SUCCESS;
+}
+
+// Write to a buffer
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get ring from handle
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    char *data = IO_FILTER_ARGS_BUF;
+    size_t written = 0;
+    size_t remaining = *IO_FILTER_ARGS_BYTES;
+
+    // Write until the input is consumed, or the ring is full
+    while (remaining) {
+        struct __block_t *b = producer_block(r);
+        if (!b) {
+            break;
+        }
+
+        size_t n = (remaining < b->size) ? remaining : b->size;
+        bw_memcpy_stream(b->data, data, n);
+        producer_publish(r, b, n);
+
+        data += n;
+        remaining -= n;
+        written += n;
+    }
+
+    if (written) {
+        machine_desc_notify(&r->_b);
+    }
+
+    *IO_FILTER_ARGS_BYTES = written;
+    return IO_SUCCESS;
+}
+
+/*
+ * Create/destroy spsc buffers
+ */
+static void
+destroy_spsc_machine(IO_HANDLE h)
+{
+    machine_destroy_desc(h);
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    size_t buf_bytes = default_buf_bytes;
+    size_t block_bytes = default_blk_bytes;
+
+    struct spsciom_args *args = (struct spsciom_args *)arg;
+    if (args && args->buf_bytes) {
+        buf_bytes = args->buf_bytes;
+    }
+    if (args && args->block_bytes) {
+        block_bytes = args->block_bytes;
+    }
+
+    size_t block_count = buf_bytes / block_bytes;
+    if ((block_count * block_bytes) < buf_bytes) {
+        block_count++;
+    }
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_spsc_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    // Create a new buffer descriptor
+    struct spsc_t *r = pcalloc(p, sizeof(struct spsc_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    // Block descriptors are a single array, linked for the block allocator
+    struct __block_t *blocks = pcalloc(p, block_count * sizeof(struct __block_t));
+    if (!blocks) {
+        error("Failed to create block descriptors");
+        goto free_and_return;
+    }
+
+    for (size_t i = 0; i < block_count; i++) {
+        blocks[i].next = &blocks[(i + 1) % block_count];
+    }
+
+    size_t bytes = block_data_fastalloc(p, blocks, block_bytes);
+    if (bytes == 0) {
+        error("Failed to allocate block data");
+        goto free_and_return;
+    }
+
+    r->blocks = blocks;
+    r->n_blocks = bytes / block_bytes;
+    r->block_size = block_bytes;
+    r->size = bytes;
+
+    if (machine_desc_init(p, _spsc_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
+    if (!filter_read_init(p, "spsc_buf_r", buf_read, (IO_DESC *)r)) {
+        error("Failed to initialize read filter");
+        goto free_and_return;
+    }
+
+    if (!filter_write_init(p, "spsc_buf_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+free_and_return:
+    bw_free_pool(p);
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    // Disable writing
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+    }
+
+    // Allow reading until the buffer is empty
+    if (d->io_read) {
+        struct spsc_t *r = (struct spsc_t *)d;
+        __atomic_store_n(&r->flush, 1, __ATOMIC_RELEASE);
+    }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return r->_b.metrics;
+}
+
+/*
+ * Block borrowing: only the consumer thread may borrow read blocks, and only
+ * the producer thread may borrow write blocks.
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct spsc_t *r = (struct spsc_t *)d;
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    *b = consumer_block(r);
+    if (*b) {
+        return IO_SUCCESS;
+    }
+
+    if (flush) {
+        io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+        return IO_COMPLETE;
+    }
+    return IO_NODATA;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    b->offset += bytes;
+    __atomic_store_n(&r->consumed, r->consumed + bytes, __ATOMIC_RELAXED);
+
+    if (BLOCK_UNREAD(b) == 0) {
+        consumer_release(r, b);
+    }
+    return IO_SUCCESS;
+}
+
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    *b = producer_block(r);
+    return (*b) ? IO_SUCCESS : IO_NODATA;
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    if (bytes) {
+        producer_publish(r, b, bytes);
+        machine_desc_notify(&r->_b);
+    }
+    return IO_SUCCESS;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_spsc_machine()
+{
+    IOM *machine = _spsc_machine;
+    if (!machine) {
+        machine = machine_register("spsc_ring_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_spsc_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+
+        _spsc_machine = machine;
+        spsc_machine = machine;
+    }
+    return (const IOM *)machine;
+}
+
+IO_HANDLE
+new_spsc_machine(size_t buffer_size, size_t block_size)
+{
+    const IOM *m = get_spsc_machine();
+
+    struct spsciom_args args = {buffer_size, block_size};
+    return m->create(&args);
+}
+
+/*
+ * Zero-copy write: borrow the next free block.  Only the producer thread may
+ * call this.  Returns IO_NODATA (and a NULL block) when the ring is full.
+ */
+int
+spsc_acquire_write_block(IO_HANDLE h, const struct __block_t **b)
+{
+    return acquire_write_block(h, 0, (struct __block_t **)b);
+}
+
+/*
+ * Publish "bytes" written into the block from spsc_acquire_write_block()
+ */
+void
+spsc_release_write_block(IO_HANDLE h, size_t bytes)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        return;
+    }
+
+    commit_write_block(h, spsc_block(r, r->head), bytes);
+}
+
+size_t
+spsc_get_size(IO_HANDLE h)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+    return r->size;
+}
+
+size_t
+spsc_get_bytes(IO_HANDLE h)
+{
+    struct spsc_t *r = (struct spsc_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+
+    size_t consumed = __atomic_load_n(&r->consumed, __ATOMIC_RELAXED);
+    size_t written = __atomic_load_n(&r->written, __ATOMIC_RELAXED);
+    return written - consumed;
+}
+
+void
+spsc_set_log_level(char *level)
+{
+    blb_set_log_level(level);
+    bw_set_log_level_str(level);
+}
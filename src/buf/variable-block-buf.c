@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "machine.h"
+#include "filter.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
+#include "bw-util.h"
+
+#define LOGEX_TAG "AVBB"
+#include "logging.h"
+#include "bw-log.h"
+
+#define DEFAULT_BLOCK_BYTES 1*MB
+#define DEFAULT_BLOCK_COUNT 64
+#define CACHELINE 64
+
+// Records start on 8-byte boundaries
+#define RECORD_ALIGN 8
+#define RECORD_ALIGNED(x) (((x) + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1))
+
+// The rest of the arena is unused: the next record is at the start
+#define RECORD_WRAP 0x1
+
+static size_t default_block_bytes = DEFAULT_BLOCK_BYTES;
+static size_t default_block_count = DEFAULT_BLOCK_COUNT;
+
+const IOM *avbb_machine;
+static IOM *_avbb_machine = NULL;
+
+struct avbb_record_t {
+    uint32_t bytes;             // Record length (not counting this header)
+    uint32_t flags;
+    char data[];
+};
+
+/*
+ * Asynchronous variable-block buffer
+ *
+ * A single-producer/single-consumer arena of length-prefixed records.  Each
+ * write is one record, stored at its own length (rounded up to 8 bytes), and
+ * each read returns one whole record.  A record that doesn't fit before the
+ * end of the arena is preceded by a wrap marker and stored at the start.
+ *
+ * "head" and "tail" are free-running byte counters, owned by the producer and
+ * consumer respectively, like the spsc ring.  Each side caches the other's
+ * counter and only reloads it when the arena looks full (or empty).
+ */
+struct avbb_t {
+    IO_DESC _b;  // Generic buffer
+
+    char *arena;
+    size_t size;                // Arena bytes
+    size_t max_record;          // Largest record
+    int flush;                  // Keep reading available until the buffer is empty
+
+    char _pad0[CACHELINE];
+
+    // Producer
+    size_t head;                // Arena bytes used (free-running)
+    size_t tail_cache;          // Last observed consumer position
+    size_t written;             // Record bytes published
+    struct __block_t wview;     // Borrowed write region
+
+    char _pad1[CACHELINE];
+
+    // Consumer
+    size_t tail;                // Arena bytes released (free-running)
+    size_t head_cache;          // Last observed producer position
+    size_t consumed;            // Record bytes consumed
+    size_t roffset;             // Bytes of the current record already consumed
+    struct __block_t rview;     // Borrowed read region
+
+    char _pad2[CACHELINE];
+};
+
+static inline struct avbb_record_t *
+record_at(struct avbb_t *r, size_t pos)
+{
+    return (struct avbb_record_t *)(r->arena + (pos % r->size));
+}
+
+/*
+ * Producer: find room for a record of up to "bytes" bytes.  Returns the arena
+ * bytes to skip (a wrap) before the record, or -1 if there isn't room.
+ */
+static ssize_t
+producer_room(struct avbb_t *r, size_t bytes)
+{
+    size_t need = sizeof(struct avbb_record_t) + RECORD_ALIGNED(bytes);
+    size_t to_end = r->size - (r->head % r->size);
+    size_t skip = (need > to_end) ? to_end : 0;
+
+    if (r->size - (r->head - r->tail_cache) < skip + need) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (r->size - (r->head - r->tail_cache) < skip + need) {
+            return -1;
+        }
+    }
+    return (ssize_t)skip;
+}
+
+/*
+ * Producer: write the record header (and any wrap marker), then publish
+ */
+static void
+producer_publish(struct avbb_t *r, size_t skip, size_t bytes)
+{
+    size_t head = r->head;
+    if (skip) {
+        struct avbb_record_t *wrap = record_at(r, head);
+        wrap->bytes = 0;
+        wrap->flags = RECORD_WRAP;
+        head += skip;
+    }
+
+    struct avbb_record_t *rec = record_at(r, head);
+    rec->bytes = (uint32_t)bytes;
+    rec->flags = 0;
+    head += sizeof(struct avbb_record_t) + RECORD_ALIGNED(bytes);
+
+    __atomic_store_n(&r->written, r->written + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    machine_desc_notify(&r->_b);
+}
+
+/*
+ * Consumer: return the next record, or NULL if the buffer is empty
+ */
+static struct avbb_record_t *
+consumer_record(struct avbb_t *r)
+{
+    while (1) {
+        if (r->tail == r->head_cache) {
+            r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            if (r->tail == r->head_cache) {
+                return NULL;
+            }
+        }
+
+        struct avbb_record_t *rec = record_at(r, r->tail);
+        if (!(rec->flags & RECORD_WRAP)) {
+            return rec;
+        }
+
+        // Skip to the start of the arena
+        size_t tail = r->tail + r->size - (r->tail % r->size);
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+consumer_release(struct avbb_t *r, struct avbb_record_t *rec, size_t bytes)
+{
+    r->roffset += bytes;
+    __atomic_store_n(&r->consumed, r->consumed + bytes, __ATOMIC_RELAXED);
+
+    if (r->roffset < rec->bytes) {
+        return;
+    }
+
+    r->roffset = 0;
+    size_t tail = r->tail + sizeof(struct avbb_record_t) + RECORD_ALIGNED(rec->bytes);
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Read one record from a buffer
+static int
+buf_read(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get buffer from handle
+    struct machine_desc_t *d = machine_get_desc(*handle);
+    struct avbb_t *r = (struct avbb_t *)d;
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    // Read flush before the data, so no records are missed
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    struct avbb_record_t *rec = consumer_record(r);
+    if (!rec) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_SUCCESS;
+    }
+
+    // A record that doesn't fit stays put, for a retry with a bigger buffer
+    size_t bytes = rec->bytes - r->roffset;
+    if (*IO_FILTER_ARGS_BYTES < bytes) {
+        warn("Record length (%zu) exceeds return buffer (%zu)",
+            bytes, *IO_FILTER_ARGS_BYTES);
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    bw_memcpy(IO_FILTER_ARGS_BUF, rec->data + r->roffset, bytes);
+    *IO_FILTER_ARGS_BYTES = bytes;
+
+    consumer_release(r, rec, bytes);
+    return IO_SUCCESS;
+}
+
+// Write one record to a buffer
+static int
+buf_write(IO_FILTER_ARGS)
+{
+    // Get filter data from filter
+    IO_HANDLE *handle = (IO_HANDLE *)IO_FILTER_ARGS_FILTER->obj;
+
+    // Get buffer from handle
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(*handle);
+    if (!r) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_ERROR;
+    }
+
+    // Anything past one record is left for the next write
+    size_t bytes = *IO_FILTER_ARGS_BYTES;
+    bytes = (bytes < r->max_record) ? bytes : r->max_record;
+    if (bytes == 0) {
+        return IO_SUCCESS;
+    }
+
+    ssize_t skip = producer_room(r, bytes);
+    if (skip < 0) {
+        *IO_FILTER_ARGS_BYTES = 0;
+        return IO_NODATA;
+    }
+
+    struct avbb_record_t *rec = record_at(r, r->head + skip);
+    bw_memcpy_stream(rec->data, IO_FILTER_ARGS_BUF, bytes);
+    producer_publish(r, (size_t)skip, bytes);
+
+    *IO_FILTER_ARGS_BYTES = bytes;
+    return IO_SUCCESS;
+}
+
+/*
+ * Block borrowing: a borrowed read block is the rest of the current record,
+ * and a borrowed write block is room for one record of up to max_record
+ * bytes.  Only the consumer thread may borrow read blocks, and only the
+ * producer thread may borrow write blocks.
+ */
+static int
+acquire_read_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    struct avbb_t *r = (struct avbb_t *)d;
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    int flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+
+    struct avbb_record_t *rec = consumer_record(r);
+    if (!rec) {
+        *b = NULL;
+        if (flush) {
+            io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
+            return IO_COMPLETE;
+        }
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->rview;
+    v->data = rec->data;
+    v->size = rec->bytes;
+    v->bytes = rec->bytes;
+    v->offset = r->roffset;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+release_read_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    struct avbb_record_t *rec = record_at(r, r->tail);
+    consumer_release(r, rec, bytes);
+    return IO_SUCCESS;
+}
+
+static int
+acquire_write_block(IO_HANDLE h, size_t bytes, struct __block_t **b)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        *b = NULL;
+        return IO_ERROR;
+    }
+
+    ssize_t skip = producer_room(r, r->max_record);
+    if (skip < 0) {
+        *b = NULL;
+        return IO_NODATA;
+    }
+
+    struct __block_t *v = &r->wview;
+    v->data = record_at(r, r->head + skip)->data;
+    v->size = r->max_record;
+    v->bytes = 0;
+    v->offset = 0;
+
+    *b = v;
+    return IO_SUCCESS;
+}
+
+static int
+commit_write_block(IO_HANDLE h, struct __block_t *b, size_t bytes)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        return IO_ERROR;
+    }
+
+    if (bytes == 0) {
+        return IO_SUCCESS;
+    }
+
+    // The block was placed after a wrap if it isn't at the head
+    size_t skip = (b->data == record_at(r, r->head)->data) ? 0 : r->size - (r->head % r->size);
+    producer_publish(r, skip, bytes);
+    return IO_SUCCESS;
+}
+
+/*
+ * Create/destroy variable-block buffers
+ */
+static void
+destroy_avbb_machine(IO_HANDLE h)
+{
+    machine_destroy_desc(h);
+}
+
+static IO_HANDLE
+create_buffer(void *arg)
+{
+    IO_HANDLE h = 0;
+
+    size_t block_bytes = default_block_bytes;
+    size_t block_count = default_block_count;
+
+    struct avbb_args *args = (struct avbb_args *)arg;
+    if (args && args->block_bytes) {
+        block_bytes = args->block_bytes;
+    }
+    if (args && args->block_count) {
+        block_count = args->block_count;
+    }
+
+    // Any record fits an empty arena, wherever the cursors are
+    if (block_count < 2) {
+        block_count = 2;
+    }
+
+    if (block_bytes > UINT32_MAX) {
+        error("Records are limited to %" PRIu32 " bytes", UINT32_MAX);
+        return 0;
+    }
+
+    // Room for "block_count" of the largest records
+    size_t size = block_count * (sizeof(struct avbb_record_t) + RECORD_ALIGNED(block_bytes));
+
+    // Create a new pool for this buffer
+    POOL *p = bw_create_subpool(_avbb_machine->alloc);
+    if (!p) {
+        error("Failed to create memory pool");
+        return 0;
+    }
+
+    // Create a new buffer descriptor
+    struct avbb_t *r = pcalloc(p, sizeof(struct avbb_t));
+    if (!r) {
+        error("Failed to allocate memory");
+        goto free_and_return;
+    }
+
+    r->arena = bw_mem_alloc(p, size, bw_mem_default_flags());
+    if (!r->arena) {
+        char bytestr[64];
+        size_t_fmt(bytestr, 64, size);
+        error("Failed to allocate %sB arena", bytestr);
+        goto free_and_return;
+    }
+
+    r->size = size;
+    r->max_record = block_bytes;
+
+    if (machine_desc_init(p, _avbb_machine, (IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize mechine descriptor");
+        goto free_and_return;
+    }
+
+    if (machine_desc_event_init((IO_DESC *)r) < IO_SUCCESS) {
+        error("Failed to initialize read event");
+        goto free_and_return;
+    }
+
+    if (!filter_read_init(p, "avbb_r", buf_read, (IO_DESC *)r)) {
+        error("Failed to initialize read filter");
+        goto free_and_return;
+    }
+
+    if (!filter_write_init(p, "avbb_w", buf_write, (IO_DESC *)r)) {
+        error("Failed to initialize write filter");
+        goto free_and_return;
+    }
+
+    machine_register_desc((IO_DESC *)r, &h);
+    return h;
+
+free_and_return:
+    bw_free_pool(p);
+    return h;
+}
+
+static void
+stop_buffer(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        error("Machine %d not found", h);
+        return;
+    }
+
+    // Disable writing
+    if (d->io_write) {
+        io_desc_set_state(d, d->io_write, IO_DESC_DISABLING);
+    }
+
+    // Allow reading until the buffer is empty
+    if (d->io_read) {
+        struct avbb_t *r = (struct avbb_t *)d;
+        __atomic_store_n(&r->flush, 1, __ATOMIC_RELEASE);
+    }
+
+    // Wake readers so they see the flush
+    machine_desc_notify(d);
+}
+
+static void *
+get_metrics(IO_HANDLE h)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        error("Machine %d not found", h);
+        return NULL;
+    }
+
+    return r->_b.metrics;
+}
+
+/*
+ * Mechanism for registering and accessing this io machine
+ */
+const IOM *
+get_avbb_machine()
+{
+    IOM *machine = _avbb_machine;
+    if (!machine) {
+        machine = machine_register("async_variable_block_buffer");
+
+        // Local Functions
+        machine->create = create_buffer;
+        machine->stop = stop_buffer;
+        machine->destroy = destroy_avbb_machine;
+        machine->metrics = get_metrics;
+        machine->acquire_read_block = acquire_read_block;
+        machine->release_read_block = release_read_block;
+        machine->acquire_write_block = acquire_write_block;
+        machine->commit_write_block = commit_write_block;
+
+        _avbb_machine = machine;
+        avbb_machine = machine;
+    }
+    return (const IOM *)machine;
+}
+
+/*
+ * Set the defaults used when create args are zero (zero fields are ignored)
+ */
+void
+avbbiom_update_defaults(struct avbb_args *rb)
+{
+    if (rb->block_bytes) {
+        default_block_bytes = rb->block_bytes;
+    }
+    if (rb->block_count) {
+        default_block_count = rb->block_count;
+    }
+}
+
+/*
+ * Records are at most "record_bytes" long, and the arena holds at least
+ * "record_count" of them (many more if they're short)
+ */
+IO_HANDLE
+new_avbb_machine(size_t record_bytes, size_t record_count)
+{
+    const IOM *m = get_avbb_machine();
+
+    struct avbb_args args = {record_bytes, record_count};
+    return m->create(&args);
+}
+
+size_t
+avbb_get_size(IO_HANDLE h)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+    return r->size;
+}
+
+size_t
+avbb_get_bytes(IO_HANDLE h)
+{
+    struct avbb_t *r = (struct avbb_t *)machine_get_desc(h);
+    if (!r) {
+        return 0;
+    }
+
+    size_t consumed = __atomic_load_n(&r->consumed, __ATOMIC_RELAXED);
+    size_t written = __atomic_load_n(&r->written, __ATOMIC_RELAXED);
+    return written - consumed;
+}
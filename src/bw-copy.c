@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "machine.h"
+#include "bw-copy.h"
+
+#define LOGEX_TAG "BW-COPY"
+#include "bw-log.h"
+
+#define DEFAULT_NT_BYTES 256*1024
+#define SMALL_COPY 256
+
+typedef void *(*copy_fn)(void *, const void *, size_t);
+
+static void *stream_init(void *dst, const void *src, size_t n);
+
+static copy_fn stream_kernel = stream_init;
+static const char *kernel_name = "libc";
+static size_t nt_threshold = DEFAULT_NT_BYTES;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#include <emmintrin.h>
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+#pragma GCC pop_options
+
+/*
+ * Non-temporal kernels
+ *
+ * The unaligned head is copied with libc so the streaming stores are always
+ * aligned, then the tail with libc.  The sfence orders the streaming stores
+ * before whatever publishes the block to a reader.
+ */
+__attribute__((target("avx2")))
+static void *
+stream_avx2(void *dst, const void *src, size_t n)
+{
+    if (n < SMALL_COPY) {
+        return memcpy(dst, src, n);
+    }
+
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 128;
+    for (size_t i = 0; i < blocks; i++) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(s + 0));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)(d + 0), a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+        d += 128;
+        s += 128;
+    }
+    _mm_sfence();
+
+    memcpy(d, s, n % 128);
+    return dst;
+}
+
+__attribute__((target("sse2")))
+static void *
+stream_sse2(void *dst, const void *src, size_t n)
+{
+    if (n < SMALL_COPY) {
+        return memcpy(dst, src, n);
+    }
+
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+    for (size_t i = 0; i < blocks; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + 0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)(d + 0), a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+        d += 64;
+        s += 64;
+    }
+    _mm_sfence();
+
+    memcpy(d, s, n % 64);
+    return dst;
+}
+
+#endif
+
+static void *
+copy_libc(void *dst, const void *src, size_t n)
+{
+    return memcpy(dst, src, n);
+}
+
+// Streaming kernels, fastest first
+static const char *kernel_names[] = {"avx2", "sse2", "libc"};
+#define N_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+// Kernel "k" from kernel_names[], if this CPU can run it
+static copy_fn
+get_kernel(size_t k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (k == 0 && __builtin_cpu_supports("avx2")) {
+        return stream_avx2;
+    }
+    if (k == 1 && __builtin_cpu_supports("sse2")) {
+        return stream_sse2;
+    }
+#endif
+    return (k == 2) ? copy_libc : NULL;
+}
+
+// Index of kernel "name", or N_KERNELS
+static size_t
+find_kernel(const char *name)
+{
+    size_t k = 0;
+    for (; k < N_KERNELS; k++) {
+        if (strcmp(name, kernel_names[k]) == 0) {
+            break;
+        }
+    }
+    return k;
+}
+
+static void
+set_kernel(size_t k, copy_fn stream)
+{
+    trace("Copy kernel: %s (non-temporal >= %zu bytes)", kernel_names[k], nt_threshold);
+
+    kernel_name = kernel_names[k];
+    __atomic_store_n(&stream_kernel, stream, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pick the streaming kernel on first use.  Racing callers all store the same
+ * values.  BW_COPY_KERNEL=avx2|sse2|libc picks a kernel; if the CPU can't run
+ * it, the best one it can run is used instead.
+ */
+static void
+select_kernel()
+{
+    char kernel[32];
+    ENVEX_COPY(kernel, sizeof(kernel), "BW_COPY_KERNEL", "");
+
+    double v;
+    ENVEX_DOUBLE(v, "BW_COPY_NT_BYTES", (double)DEFAULT_NT_BYTES);
+    nt_threshold = (size_t)v;
+
+    size_t k = find_kernel(kernel);
+    copy_fn stream = (k < N_KERNELS) ? get_kernel(k) : NULL;
+    if (kernel[0] && !stream) {
+        warn("BW_COPY_KERNEL: \"%s\" is not available on this CPU", kernel);
+    }
+
+    // Otherwise the first the CPU supports (libc always is)
+    if (!stream) {
+        k = 0;
+        while (!(stream = get_kernel(k))) {
+            k++;
+        }
+    }
+
+    set_kernel(k, stream);
+}
+
+static void *
+stream_init(void *dst, const void *src, size_t n)
+{
+    select_kernel();
+    return bw_memcpy_stream(dst, src, n);
+}
+
+/*
+ * libc memcpy is already vectorized (and dispatched) for cached copies, and
+ * measures faster than a hand-rolled loop, so cached copies go straight to it.
+ */
+void *
+bw_memcpy(void *dst, const void *src, size_t n)
+{
+    return memcpy(dst, src, n);
+}
+
+void *
+bw_memcpy_stream(void *dst, const void *src, size_t n)
+{
+    copy_fn stream = __atomic_load_n(&stream_kernel, __ATOMIC_ACQUIRE);
+    if (stream == stream_init) {
+        return stream_init(dst, src, n);
+    }
+
+    if (nt_threshold && n >= nt_threshold) {
+        return stream(dst, src, n);
+    }
+    return memcpy(dst, src, n);
+}
+
+void
+bw_copy_set_nt_threshold(size_t bytes)
+{
+    if (stream_kernel == stream_init) {
+        select_kernel();
+    }
+    nt_threshold = bytes;
+}
+
+/*
+ * Use streaming kernel "name" (avx2, sse2 or libc).  IO_ERROR if this CPU
+ * can't run it.
+ */
+int
+bw_copy_set_kernel(const char *name)
+{
+    if (stream_kernel == stream_init) {
+        select_kernel();
+    }
+
+    size_t k = find_kernel(name);
+    copy_fn stream = (k < N_KERNELS) ? get_kernel(k) : NULL;
+    if (!stream) {
+        return IO_ERROR;
+    }
+
+    set_kernel(k, stream);
+    return IO_SUCCESS;
+}
+
+const char *
+bw_copy_kernel_name()
+{
+    if (stream_kernel == stream_init) {
+        select_kernel();
+    }
+    return kernel_name;
+}
@@ -0,0 +1,767 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bw-mem.h"
+#include "bw-util.h"
+
+#define LOGEX_TAG "BW-MEM"
+#include "bw-log.h"
+
+#define DEFAULT_HUGEPAGE_BYTES 2*MB
+
+#define POOL_TABLE_MIN 64
+
+// Buffer mapped or allocated for a pool
+struct mapping_t {
+    void *addr;
+    size_t bytes;           // Bytes charged to the budget
+    size_t mapped;          // Length mapped with mmap() (0: from palloc())
+    struct mapping_t *next;
+};
+
+// Memory budget account
+struct account_t {
+    struct account_t *parent;   // Account this one is charged to as well
+    struct account_t *linked;   // Accounts charged to this one
+    struct account_t *link_prev;
+    struct account_t *link_next;
+    size_t current;             // Bytes allocated, including linked accounts
+    size_t peak;
+    size_t reserved;            // Bytes held for later allocations
+    size_t limit;               // Cap on current + reserved (0: none)
+    size_t own_current;         // Charged to this pool directly
+    size_t own_reserved;
+};
+
+// Memory held by one pool, released when the pool is freed
+struct pool_mem_t {
+    POOL *pool;
+    struct pool_mem_t *hnext;       // Hash chain
+    struct pool_mem_t *owner;       // Pool this is a subpool of
+    struct pool_mem_t *subpools;
+    struct pool_mem_t *sub_prev;
+    struct pool_mem_t *sub_next;
+    struct mapping_t *mappings;
+    struct account_t acct;
+};
+
+// Pool records, hashed by address
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_mem_t **pool_table = NULL;
+static size_t pool_table_len = 0;
+static size_t pool_count = 0;
+
+static struct account_t global_account;     // Process-wide
+static int global_limit_init = 0;
+
+static int default_flags_init = 0;
+static uint32_t default_flags = 0;
+static size_t hugepage_bytes = 0;
+
+/*
+ * BW_BUF_ALLOC: comma-separated list of "hugepage", "prefault" and "mlock"
+ */
+uint32_t
+bw_mem_default_flags()
+{
+    if (default_flags_init) {
+        return default_flags;
+    }
+
+    char str[128];
+    ENVEX_COPY(str, sizeof(str), "BW_BUF_ALLOC", "");
+
+    uint32_t flags = 0;
+    char *save = NULL;
+    char *tok = strtok_r(str, ",", &save);
+    for (; tok; tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, "hugepage") == 0) {
+            flags |= BF_HUGEPAGE;
+        } else if (strcmp(tok, "prefault") == 0) {
+            flags |= BF_PREFAULT;
+        } else if (strcmp(tok, "mlock") == 0) {
+            flags |= BF_MLOCK;
+        } else {
+            warn("BW_BUF_ALLOC: Unknown option \"%s\"", tok);
+        }
+    }
+
+    default_flags = flags;
+    default_flags_init = 1;
+    return flags;
+}
+
+/*
+ * BW_MEM_LIMIT: process-wide budget, in bytes, with an optional K, M or G
+ * suffix (e.g. "8G").  Called with mem_lock held.
+ */
+static void
+init_global_limit()
+{
+    if (global_limit_init) {
+        return;
+    }
+    global_limit_init = 1;
+
+    char str[64];
+    ENVEX_COPY(str, sizeof(str), "BW_MEM_LIMIT", "");
+    if (str[0] == '\0') {
+        return;
+    }
+
+    char *end = NULL;
+    double v = strtod(str, &end);
+    switch (*end) {
+    case 'k': case 'K': v *= KB; break;
+    case 'm': case 'M': v *= MB; break;
+    case 'g': case 'G': v *= GB; break;
+    case '\0': break;
+    default:
+        warn("BW_MEM_LIMIT: Invalid size \"%s\"", str);
+        return;
+    }
+
+    if (global_account.limit == 0) {
+        global_account.limit = (size_t)v;
+    }
+}
+
+static inline size_t
+pool_hash(POOL *p, size_t len)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p >> 4;
+    x *= 0x9e3779b97f4a7c15ull;
+    return (size_t)(x >> 32) & (len - 1);
+}
+
+// Called with mem_lock held
+static void
+pool_table_grow()
+{
+    size_t len = (pool_table_len) ? 2 * pool_table_len : POOL_TABLE_MIN;
+    struct pool_mem_t **table = calloc(len, sizeof(struct pool_mem_t *));
+    if (!table) {
+        return;
+    }
+
+    size_t i = 0;
+    for (; i < pool_table_len; i++) {
+        struct pool_mem_t *m = pool_table[i];
+        while (m) {
+            struct pool_mem_t *next = m->hnext;
+            size_t h = pool_hash(m->pool, len);
+            m->hnext = table[h];
+            table[h] = m;
+            m = next;
+        }
+    }
+
+    free(pool_table);
+    pool_table = table;
+    pool_table_len = len;
+}
+
+// Called with mem_lock held
+static struct pool_mem_t *
+get_pool_mem(POOL *p, int create)
+{
+    if (!p) {
+        return NULL;
+    }
+
+    if (pool_table_len) {
+        struct pool_mem_t *m = pool_table[pool_hash(p, pool_table_len)];
+        for (; m; m = m->hnext) {
+            if (m->pool == p) {
+                return m;
+            }
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    if (pool_count >= pool_table_len) {
+        pool_table_grow();
+        if (!pool_table_len) {
+            return NULL;
+        }
+    }
+
+    struct pool_mem_t *m = calloc(1, sizeof(struct pool_mem_t));
+    if (!m) {
+        return NULL;
+    }
+    m->pool = p;
+
+    size_t h = pool_hash(p, pool_table_len);
+    m->hnext = pool_table[h];
+    pool_table[h] = m;
+    pool_count++;
+    return m;
+}
+
+// Called with mem_lock held
+static struct account_t *
+get_account(POOL *p, int create)
+{
+    struct pool_mem_t *m = get_pool_mem(p, create);
+    return (m) ? &m->acct : NULL;
+}
+
+static inline int
+account_over(struct account_t *a, size_t bytes)
+{
+    return a->limit && (a->current + a->reserved + bytes > a->limit);
+}
+
+static inline void
+account_add(struct account_t *a, size_t bytes, int reserve)
+{
+    if (reserve) {
+        a->reserved += bytes;
+        return;
+    }
+
+    a->current += bytes;
+    if (a->current > a->peak) {
+        a->peak = a->current;
+    }
+}
+
+static inline void
+account_sub(struct account_t *a, size_t bytes, int reserve)
+{
+    size_t *v = (reserve) ? &a->reserved : &a->current;
+    *v = (*v > bytes) ? *v - bytes : 0;
+}
+
+/*
+ * Charge "bytes" to the pool's account, the accounts it's linked to, and the
+ * process-wide account.  Refused (IO_ERROR) if that would take any of them
+ * past its limit.
+ */
+static int
+charge(POOL *p, size_t bytes, int reserve)
+{
+    pthread_mutex_lock(&mem_lock);
+    init_global_limit();
+
+    struct account_t *a = get_account(p, 1);
+    struct account_t *c = a;
+    for (; c; c = c->parent) {
+        if (account_over(c, bytes)) {
+            break;
+        }
+    }
+
+    if (c || account_over(&global_account, bytes)) {
+        struct account_t *over = (c) ? c : &global_account;
+        char bytestr[64];
+        char limitstr[64];
+        size_t_fmt(bytestr, 64, bytes);
+        size_t_fmt(limitstr, 64, over->limit);
+        debug("Memory budget: %sB refused (%s limit %sB)", bytestr,
+            (c) ? "pool" : "process", limitstr);
+        pthread_mutex_unlock(&mem_lock);
+        return IO_ERROR;
+    }
+
+    for (c = a; c; c = c->parent) {
+        account_add(c, bytes, reserve);
+    }
+    account_add(&global_account, bytes, reserve);
+
+    if (a) {
+        if (reserve) {
+            a->own_reserved += bytes;
+        } else {
+            a->own_current += bytes;
+        }
+    }
+
+    pthread_mutex_unlock(&mem_lock);
+    return IO_SUCCESS;
+}
+
+// Called with mem_lock held
+static void
+uncharge_locked(struct account_t *a, size_t bytes, int reserve)
+{
+    if (a) {
+        size_t *own = (reserve) ? &a->own_reserved : &a->own_current;
+        bytes = (*own < bytes) ? *own : bytes;
+        *own -= bytes;
+    }
+
+    struct account_t *c = a;
+    for (; c; c = c->parent) {
+        account_sub(c, bytes, reserve);
+    }
+    account_sub(&global_account, bytes, reserve);
+}
+
+static void
+uncharge(POOL *p, size_t bytes, int reserve)
+{
+    pthread_mutex_lock(&mem_lock);
+    uncharge_locked(get_account(p, 0), bytes, reserve);
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * Close an account: return what it still holds, and detach the accounts
+ * linked to it.  Called with mem_lock held.
+ */
+static void
+release_account(struct account_t *a)
+{
+    uncharge_locked(a, a->own_current, 0);
+    uncharge_locked(a, a->own_reserved, 1);
+
+    // Whatever is left belongs to linked accounts, which outlive this one
+    struct account_t *c = a->parent;
+    for (; c; c = c->parent) {
+        account_sub(c, a->current, 0);
+        account_sub(c, a->reserved, 1);
+    }
+
+    while (a->linked) {
+        c = a->linked;
+        a->linked = c->link_next;
+        c->parent = NULL;
+        c->link_prev = NULL;
+        c->link_next = NULL;
+    }
+
+    if (a->link_prev) {
+        a->link_prev->link_next = a->link_next;
+    } else if (a->parent) {
+        a->parent->linked = a->link_next;
+    }
+    if (a->link_next) {
+        a->link_next->link_prev = a->link_prev;
+    }
+}
+
+/*
+ * Drop a pool's record, and its subpools': unmap its buffers and close its
+ * account.  Memory from palloc() goes with the pool.  Called with mem_lock
+ * held.
+ */
+static void
+release_pool_mem(struct pool_mem_t *m)
+{
+    while (m->subpools) {
+        release_pool_mem(m->subpools);
+    }
+
+    if (m->sub_prev) {
+        m->sub_prev->sub_next = m->sub_next;
+    } else if (m->owner) {
+        m->owner->subpools = m->sub_next;
+    }
+    if (m->sub_next) {
+        m->sub_next->sub_prev = m->sub_prev;
+    }
+
+    struct mapping_t *map = m->mappings;
+    while (map) {
+        struct mapping_t *next = map->next;
+        if (map->mapped) {
+            munmap(map->addr, map->mapped);
+        }
+        free(map);
+        map = next;
+    }
+
+    release_account(&m->acct);
+
+    struct pool_mem_t **mp = &pool_table[pool_hash(m->pool, pool_table_len)];
+    for (; *mp; mp = &(*mp)->hnext) {
+        if (*mp == m) {
+            *mp = m->hnext;
+            break;
+        }
+    }
+    pool_count--;
+    free(m);
+}
+
+/*
+ * Pool wrappers (see machine.h).  A new pool never inherits a record left at
+ * its address by a pool freed with plain free_pool().
+ */
+POOL *
+bw_create_pool()
+{
+    POOL *p = create_pool();
+
+    pthread_mutex_lock(&mem_lock);
+    struct pool_mem_t *m = get_pool_mem(p, 0);
+    if (m) {
+        release_pool_mem(m);
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    return p;
+}
+
+POOL *
+bw_create_subpool(POOL *owner)
+{
+    POOL *p = create_subpool(owner);
+    if (!p) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    struct pool_mem_t *m = get_pool_mem(p, 0);
+    if (m) {
+        release_pool_mem(m);
+    }
+
+    // Subpools are freed with their owner, so their records are too
+    struct pool_mem_t *o = get_pool_mem(owner, 1);
+    m = (o) ? get_pool_mem(p, 1) : NULL;
+    if (m) {
+        m->owner = o;
+        m->sub_next = o->subpools;
+        if (o->subpools) {
+            o->subpools->sub_prev = m;
+        }
+        o->subpools = m;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    return p;
+}
+
+void
+bw_free_pool(POOL *p)
+{
+    pthread_mutex_lock(&mem_lock);
+    struct pool_mem_t *m = get_pool_mem(p, 0);
+    if (m) {
+        release_pool_mem(m);
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    free_pool(p);
+}
+
+static size_t
+get_hugepage_bytes()
+{
+    if (hugepage_bytes) {
+        return hugepage_bytes;
+    }
+
+    size_t bytes = DEFAULT_HUGEPAGE_BYTES;
+
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[256];
+        size_t kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) {
+                bytes = kb * KB;
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    hugepage_bytes = bytes;
+    return bytes;
+}
+
+static void *
+map_buffer(size_t *bytes, uint32_t flags)
+{
+    void *addr = MAP_FAILED;
+    size_t len = *bytes;
+
+#ifdef MAP_HUGETLB
+    // Reserved huge pages, if there are enough
+    if (flags & BF_HUGEPAGE) {
+        size_t huge = get_hugepage_bytes();
+        size_t huge_len = (len + huge - 1) & ~(huge - 1);
+
+        int mflags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+        if (flags & BF_PREFAULT) {
+            mflags |= MAP_POPULATE;
+        }
+
+        addr = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (addr != MAP_FAILED) {
+            *bytes = huge_len;
+            return addr;
+        }
+        trace("MAP_HUGETLB failed (%s): using transparent huge pages", strerror(errno));
+    }
+#endif
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if ((flags & BF_HUGEPAGE) && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+        trace("MADV_HUGEPAGE failed (%s)", strerror(errno));
+    }
+#endif
+
+    // Touch every page after the madvise, so faults can use huge pages
+    if (flags & BF_PREFAULT) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        volatile char *c = (volatile char *)addr;
+        size_t i = 0;
+        for (; i < len; i += page) {
+            c[i] = 0;
+        }
+    }
+
+    return addr;
+}
+
+/*
+ * Allocate buffer memory for pool "p"
+ */
+void *
+bw_mem_alloc(POOL *p, size_t bytes, uint32_t flags)
+{
+    flags &= BF_ALLOC_MASK;
+
+    // Over budget: EDQUOT, so callers can tell it from running out of memory
+    if (charge(p, bytes, 0) < IO_SUCCESS) {
+        errno = EDQUOT;
+        return NULL;
+    }
+
+    struct mapping_t *map = malloc(sizeof(struct mapping_t));
+    if (!map) {
+        uncharge(p, bytes, 0);
+        return NULL;
+    }
+
+    size_t len = bytes;
+    void *addr = NULL;
+    if (!flags) {
+        addr = palloc(p, bytes);
+        if (!addr) {
+            uncharge(p, bytes, 0);
+            free(map);
+            return NULL;
+        }
+    } else {
+        addr = map_buffer(&len, flags);
+        if (!addr) {
+            error("Failed to map %zu bytes (%s)", bytes, strerror(errno));
+            uncharge(p, bytes, 0);
+            free(map);
+            return NULL;
+        }
+
+        if ((flags & BF_MLOCK) && mlock(addr, len) != 0) {
+            warn("Failed to lock %zu bytes in RAM (%s)", len, strerror(errno));
+        }
+
+        char bytestr[64];
+        size_t_fmt(bytestr, 64, len);
+        trace("Mapped %sB%s%s%s", bytestr,
+            (flags & BF_HUGEPAGE) ? " hugepage" : "",
+            (flags & BF_PREFAULT) ? " prefault" : "",
+            (flags & BF_MLOCK) ? " mlock" : "");
+    }
+
+    map->addr = addr;
+    map->bytes = bytes;
+    map->mapped = (flags) ? len : 0;
+
+    // The pool's record was made by the charge
+    pthread_mutex_lock(&mem_lock);
+    struct pool_mem_t *m = get_pool_mem(p, 1);
+    if (m) {
+        map->next = m->mappings;
+        m->mappings = map;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    if (!m) {
+        uncharge(p, bytes, 0);
+        if (map->mapped) {
+            munmap(addr, map->mapped);
+        } else {
+            pfree(p, addr);
+        }
+        free(map);
+        return NULL;
+    }
+
+    return addr;
+}
+
+/*
+ * Free one buffer from bw_mem_alloc().  Buffers that are left are released
+ * when the pool is freed.
+ */
+void
+bw_mem_free(POOL *p, void *addr)
+{
+    pthread_mutex_lock(&mem_lock);
+    struct pool_mem_t *m = get_pool_mem(p, 0);
+    struct mapping_t **mp = (m) ? &m->mappings : NULL;
+    for (; mp && *mp; mp = &(*mp)->next) {
+        struct mapping_t *map = *mp;
+        if (map->addr != addr) {
+            continue;
+        }
+
+        *mp = map->next;
+        uncharge_locked(&m->acct, map->bytes, 0);
+        pthread_mutex_unlock(&mem_lock);
+
+        if (map->mapped) {
+            munmap(map->addr, map->mapped);
+        } else {
+            pfree(p, map->addr);
+        }
+        free(map);
+        return;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    // Not ours: it came from the pool
+    pfree(p, addr);
+}
+
+/*
+ * Memory budget
+ */
+void
+bw_mem_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&mem_lock);
+    init_global_limit();
+    global_account.limit = bytes;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+void
+bw_mem_set_pool_limit(POOL *p, size_t bytes)
+{
+    pthread_mutex_lock(&mem_lock);
+    struct account_t *a = get_account(p, 1);
+    if (a) {
+        a->limit = bytes;
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * Charge pool "p" to "parent" as well, from now on (what "p" holds moves over
+ * with it).  A pool that is already linked stays with its first parent.
+ */
+void
+bw_mem_link(POOL *p, POOL *parent)
+{
+    if (!p || !parent || p == parent) {
+        return;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+    struct account_t *a = get_account(p, 1);
+    struct account_t *pa = get_account(parent, 1);
+    if (!a || !pa || a->parent) {
+        pthread_mutex_unlock(&mem_lock);
+        return;
+    }
+
+    // No cycles
+    struct account_t *c = pa;
+    for (; c; c = c->parent) {
+        if (c == a) {
+            pthread_mutex_unlock(&mem_lock);
+            return;
+        }
+    }
+
+    a->parent = pa;
+    a->link_prev = NULL;
+    a->link_next = pa->linked;
+    if (pa->linked) {
+        pa->linked->link_prev = a;
+    }
+    pa->linked = a;
+
+    for (c = pa; c; c = c->parent) {
+        account_add(c, a->current, 0);
+        account_add(c, a->reserved, 1);
+    }
+
+    if (account_over(pa, 0)) {
+        char limitstr[64];
+        size_t_fmt(limitstr, 64, pa->limit);
+        warn("Memory budget: over the %sB limit after linking", limitstr);
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * Charge memory the caller maps itself (e.g. shared or mirrored mappings).
+ * Charges are returned by bw_mem_uncharge(), or when the pool is freed.
+ */
+int
+bw_mem_charge(POOL *p, size_t bytes)
+{
+    return charge(p, bytes, 0);
+}
+
+void
+bw_mem_uncharge(POOL *p, size_t bytes)
+{
+    uncharge(p, bytes, 0);
+}
+
+/*
+ * Hold budget for an allocation to be made later.  Reserved bytes count
+ * against the limits until bw_mem_unreserve().
+ */
+int
+bw_mem_reserve(POOL *p, size_t bytes)
+{
+    return charge(p, bytes, 1);
+}
+
+void
+bw_mem_unreserve(POOL *p, size_t bytes)
+{
+    uncharge(p, bytes, 1);
+}
+
+/*
+ * Memory for pool "p", including pools linked to it (NULL: the whole process)
+ */
+void
+bw_mem_get_usage(POOL *p, struct io_metrics_mem_t *usage)
+{
+    memset(usage, 0, sizeof(struct io_metrics_mem_t));
+
+    pthread_mutex_lock(&mem_lock);
+    struct account_t *a = (p) ? get_account(p, 0) : &global_account;
+    if (a) {
+        usage->current = a->current;
+        usage->peak = a->peak;
+        usage->reserved = a->reserved;
+        usage->limit = a->limit;
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
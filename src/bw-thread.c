@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "machine.h"
+#include "bw-thread.h"
+
+#define LOGEX_TAG "BW-THREAD"
+#include "bw-log.h"
+
+// From <numaif.h>, which is only installed with libnuma
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+
+#define NUMA_MAX_NODES 1024
+
+// Preferred NUMA node of this thread (-1: none)
+static __thread int numa_node = -1;
+
+void
+bw_thread_attr_init(struct bw_thread_attr_t *attr)
+{
+    memset(attr, 0, sizeof(struct bw_thread_attr_t));
+    attr->policy = BW_SCHED_OTHER;
+}
+
+/*
+ * Set the CPU set from a list of CPU numbers (an empty list clears it)
+ */
+int
+bw_thread_attr_set_cpus(struct bw_thread_attr_t *attr, const int *cpus, int n_cpus)
+{
+    memset(attr->cpus, 0, sizeof(attr->cpus));
+    attr->n_cpus = 0;
+
+    int i = 0;
+    for (; i < n_cpus; i++) {
+        int cpu = cpus[i];
+        if (cpu < 0 || cpu >= BW_MAX_CPUS) {
+            error("Invalid CPU %d", cpu);
+            return IO_ERROR;
+        }
+
+        uint64_t bit = 1ULL << (cpu % 64);
+        if (!(attr->cpus[cpu / 64] & bit)) {
+            attr->cpus[cpu / 64] |= bit;
+            attr->n_cpus++;
+        }
+    }
+    return IO_SUCCESS;
+}
+
+static inline int
+attr_has_cpu(const struct bw_thread_attr_t *attr, int cpu)
+{
+    return (attr->cpus[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/*
+ * NUMA node of a CPU, from sysfs (-1 if the system isn't NUMA)
+ */
+int
+bw_numa_node_of_cpu(int cpu)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (sscanf(e->d_name, "node%d", &node) == 1) {
+            break;
+        }
+        node = -1;
+    }
+    closedir(dir);
+
+    return node;
+}
+
+int
+bw_numa_get_node()
+{
+    return numa_node;
+}
+
+static int
+set_preferred_node(int node)
+{
+    if (node >= NUMA_MAX_NODES) {
+        return IO_ERROR;
+    }
+
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1) != 0) {
+        return IO_ERROR;
+    }
+
+    numa_node = node;
+    return IO_SUCCESS;
+}
+
+/*
+ * Move a buffer to a NUMA node.  Only whole pages are moved; pages that
+ * haven't been touched yet are allocated there when they are.
+ */
+void
+bw_numa_place(void *addr, size_t bytes, int node)
+{
+    if (node < 0 || node >= NUMA_MAX_NODES || bytes == 0) {
+        return;
+    }
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + bytes) & ~(page - 1);
+    if (end <= start) {
+        return;
+    }
+
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, (void *)start, end - start, MPOL_PREFERRED, mask,
+            NUMA_MAX_NODES + 1, MPOL_MF_MOVE) != 0) {
+        trace("mbind to node %d failed (%s)", node, strerror(errno));
+    }
+}
+
+/*
+ * Apply affinity, scheduling policy and NUMA placement to the calling thread.
+ * Returns IO_ERROR if any part failed; the rest is still applied.
+ */
+int
+bw_thread_apply(const struct bw_thread_attr_t *attr)
+{
+    int ret = IO_SUCCESS;
+    pthread_t self = pthread_self();
+
+    int first_cpu = -1;
+    if (attr->n_cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        int cpu = 0;
+        for (; cpu < BW_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (attr_has_cpu(attr, cpu)) {
+                CPU_SET(cpu, &set);
+                first_cpu = (first_cpu < 0) ? cpu : first_cpu;
+            }
+        }
+
+        int rc = pthread_setaffinity_np(self, sizeof(cpu_set_t), &set);
+        if (rc != 0) {
+            warn("Failed to set CPU affinity (%s)", strerror(rc));
+            ret = IO_ERROR;
+        }
+    }
+
+    if (attr->policy != BW_SCHED_OTHER) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = attr->priority;
+
+        int rc = pthread_setschedparam(self, attr->policy, &param);
+        if (rc != 0) {
+            warn("Failed to set %s priority %d (%s)",
+                (attr->policy == BW_SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR",
+                attr->priority, strerror(rc));
+            ret = IO_ERROR;
+        }
+    }
+
+    if (attr->numa && first_cpu >= 0) {
+        int node = bw_numa_node_of_cpu(first_cpu);
+        if (node < 0) {
+            trace("CPU %d has no NUMA node", first_cpu);
+        } else if (set_preferred_node(node) < IO_SUCCESS) {
+            warn("Failed to prefer NUMA node %d (%s)", node, strerror(errno));
+            ret = IO_ERROR;
+        } else {
+            trace("Allocating on NUMA node %d", node);
+        }
+    }
+
+    return ret;
+}
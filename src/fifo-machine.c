@@ -241,7 +241,7 @@ create_fifo(void *arg)
 {
     struct fifoiom_args *args = (struct fifoiom_args *)arg;
 
-    POOL *p = create_subpool(_fifo_machine->alloc);
+    POOL *p = bw_create_subpool(_fifo_machine->alloc);
     if (!p) {
         printf("ERROR: Failed to create memory pool\n");
         return 0;
@@ -252,7 +252,7 @@ create_fifo(void *arg)
 
     if (!desc) {
         printf("ERROR: Failed to allocate %#zx bytes for fifo descriptor\n", sizeof(struct fifo_desc_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -263,19 +263,19 @@ create_fifo(void *arg)
     desc->flags = args->flags;
 
     if (machine_desc_init(p, _fifo_machine, (IO_DESC *)desc) < IO_SUCCESS) {
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_read_init(p, "_fifo", fifo_read, (IO_DESC *)desc)) {
         printf("ERROR: Failed to initialize read filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_write_init(p, "_fifo", fifo_write, (IO_DESC *)desc)) {
         printf("ERROR: Failed to initialize write filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
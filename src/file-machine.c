@@ -438,7 +438,7 @@ create_file(void *arg)
 {
     struct fileiom_args *args = (struct fileiom_args *)arg;
 
-    POOL *p = create_subpool(_file_machine->alloc);
+    POOL *p = bw_create_subpool(_file_machine->alloc);
     if (!p) {
         printf("ERROR: Failed to create memory pool\n");
         return 0;
@@ -449,7 +449,7 @@ create_file(void *arg)
 
     if (!desc) {
         printf("ERROR: Failed to allocate %#zx bytes for file descriptor\n", sizeof(struct file_desc_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -474,19 +474,19 @@ create_file(void *arg)
     desc->flags = args->flags;
 
     if (machine_desc_init(p, _file_machine, (IO_DESC *)desc) < IO_SUCCESS) {
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_read_init(p, "_file", file_read, (IO_DESC *)desc)) {
         printf("ERROR: Failed to initialize read filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_write_init(p, "_file", file_write, (IO_DESC *)desc)) {
         printf("ERROR: Failed to initialize write filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -708,7 +708,7 @@ file_rotate_filter(IO_HANDLE h)
         return NULL;
     }
 
-    POOL *p = create_subpool(_file_machine->alloc);
+    POOL *p = bw_create_subpool(_file_machine->alloc);
 
     char name[64];
     snprintf(name, 64, "file-machine-%d rotate filter", h);
@@ -730,7 +730,7 @@ file_dir_rotate_filter(IO_HANDLE h, const char *basedir)
         return NULL;
     }
 
-    POOL *p = create_subpool(_file_machine->alloc);
+    POOL *p = bw_create_subpool(_file_machine->alloc);
 
     char name[64];
     snprintf(name, 64, "file-machine-%d dir rotate filter", h);
@@ -16,7 +16,7 @@ struct io_filter_t *
 create_filter(void *alloc, const char *name, io_filter_fn fn)
 {
     POOL *pool = (POOL *)alloc;
-    POOL *fpool = create_subpool(pool);
+    POOL *fpool = bw_create_subpool(pool);
 
     struct io_filter_t *filter = pcalloc(pool, sizeof(struct io_filter_t));
     filter->direction = IOF_BIDIRECTIONAL;
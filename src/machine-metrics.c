@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -9,6 +10,7 @@
 #include "bw-util.h"
 
 #include "machine.h"
+#include "bw-mem.h"
 
 #define METRIC_CALC_ALLOC 10
 #define TIMEVAL_US(t) ((double)(t.tv_sec * 1000000) + (double)(t.tv_usec))
@@ -110,7 +112,7 @@ track_new_metric(IO_METRICS *m)
 
     pthread_mutex_lock(&machine_metrics_lock);
     if (!g->pool) {
-        g->pool = create_pool();
+        g->pool = bw_create_pool();
     }
 
     if (g->len >= g->size) {
@@ -183,6 +185,75 @@ machine_metrics_create(POOL *pool)
     return m;
 }
 
+/*
+ * Count data dropped by an overflow policy.  Lock-free, so it can be called
+ * from buffer write paths.
+ */
+void
+machine_metrics_drop(struct io_metrics_t *m, size_t bytes, size_t blocks)
+{
+    if (!m) {
+        return;
+    }
+
+    __atomic_fetch_add(&m->drop.bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->drop.blocks, blocks, __ATOMIC_RELAXED);
+}
+
+void
+machine_metrics_get_drop(struct io_metrics_t *m, struct io_metrics_drop_t *drop)
+{
+    if (!m) {
+        memset(drop, 0, sizeof(struct io_metrics_drop_t));
+        return;
+    }
+
+    drop->bytes = __atomic_load_n(&m->drop.bytes, __ATOMIC_RELAXED);
+    drop->blocks = __atomic_load_n(&m->drop.blocks, __ATOMIC_RELAXED);
+}
+
+/*
+ * Buffer memory held by machine "h": its own allocations and those of pools
+ * linked to it
+ */
+void
+machine_metrics_get_mem(IO_HANDLE h, struct io_metrics_mem_t *mem)
+{
+    IO_DESC *d = machine_get_desc(h);
+    if (!d) {
+        memset(mem, 0, sizeof(struct io_metrics_mem_t));
+        return;
+    }
+    bw_mem_get_usage(d->pool, mem);
+}
+
+/*
+ * Count entries moved by machines that queue whole entries (e.g. handle
+ * queues), alongside the byte counts.  Lock-free, like machine_metrics_drop().
+ */
+void
+machine_metrics_entries(struct io_metrics_t *m, size_t in, size_t out)
+{
+    if (!m) {
+        return;
+    }
+
+    __atomic_fetch_add(&m->entries.in, in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->entries.out, out, __ATOMIC_RELAXED);
+}
+
+void
+machine_metrics_get_entries(struct io_metrics_t *m, struct io_metrics_entries_t *entries)
+{
+    if (!m) {
+        memset(entries, 0, sizeof(struct io_metrics_entries_t));
+        return;
+    }
+
+    entries->in = __atomic_load_n(&m->entries.in, __ATOMIC_RELAXED);
+    entries->out = __atomic_load_n(&m->entries.out, __ATOMIC_RELAXED);
+}
+
 static void
 start_timer(size_t ms, struct timer_t *timer)
 {
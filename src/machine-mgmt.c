@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "machine.h"
 
@@ -34,13 +35,31 @@ DECLARE_NOIMPL(lock)
 DECLARE_NOIMPL(unlock)
 
 // Map handles to machine pointers
+//  Handles index a flat table of slots.  The low bits of a handle select the
+//  slot, the high bits hold the slot generation, so a handle that outlives its
+//  machine no longer matches once the slot is reused.  Readers never lock: the
+//  slot chunks are never moved, and slot fields are published with atomics.
 #define MACHINE_CHUNK 0x100
-static int handle_count = 0;
-static int handle_alloc = 0;
-static struct handle_map_t {
-    IO_HANDLE handle;
-    IOM *machine;
-} *handle_map = NULL;
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_MASK 0x7ff
+#define HANDLE_CHUNK_MAX ((HANDLE_INDEX_MASK + 1) / MACHINE_CHUNK)
+
+#define HANDLE_INDEX(h) ((uint32_t)(h) & HANDLE_INDEX_MASK)
+#define HANDLE_GEN(h) (((uint32_t)(h) >> HANDLE_INDEX_BITS) & HANDLE_GEN_MASK)
+
+struct handle_slot_t {
+    IO_HANDLE handle;       // Live handle for this slot (0 when free)
+    IOM *machine;           // Machine that owns the handle
+    IO_DESC *desc;          // Registered descriptor (NULL if none)
+    uint32_t gen;           // Generation of the next handle in this slot
+    uint32_t next_free;     // Free list link
+};
+
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct handle_slot_t *handle_chunks[HANDLE_CHUNK_MAX];
+static uint32_t handle_next_index = 1;  // Index 0 is reserved (handle 0 is invalid)
+static uint32_t handle_free = 0;        // Head of the free slot list (0 == empty)
 
 // Keep track of registered machines
 static int machine_count = 0;
@@ -61,19 +80,118 @@ get_machine(const char *name)
     return NULL;
 }
 
+static struct handle_slot_t *
+get_slot(uint32_t index)
+{
+    struct handle_slot_t *chunk = __atomic_load_n(
+        &handle_chunks[index / MACHINE_CHUNK], __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        return NULL;
+    }
+    return chunk + (index % MACHINE_CHUNK);
+}
+
+static struct handle_slot_t *
+get_live_slot(IO_HANDLE handle)
+{
+    if (handle <= 0) {
+        return NULL;
+    }
+
+    struct handle_slot_t *slot = get_slot(HANDLE_INDEX(handle));
+    if (!slot) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle) {
+        return NULL;
+    }
+    return slot;
+}
+
 static IOM *
 get_machine_by_handle(IO_HANDLE handle)
 {
-    int i;
-    for (i = 0; i < handle_count; i++) {
-        struct handle_map_t *hm = handle_map + i;
-        if (hm->handle == handle) {
-            return hm->machine;
-        }
+    struct handle_slot_t *slot = get_live_slot(handle);
+    if (!slot) {
+        return NULL;
     }
-    return NULL;
+
+    IOM *machine = __atomic_load_n(&slot->machine, __ATOMIC_ACQUIRE);
+
+    // Slot was released (or reused) while reading
+    if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle) {
+        return NULL;
+    }
+    return machine;
 }
 
+/*
+ * Lock-free lookup of the descriptor registered to a handle
+ */
+IO_DESC *
+machine_handle_get_desc(IO_HANDLE handle)
+{
+    struct handle_slot_t *slot = get_live_slot(handle);
+    if (!slot) {
+        return NULL;
+    }
+
+    IO_DESC *desc = __atomic_load_n(&slot->desc, __ATOMIC_ACQUIRE);
+
+    // Slot was released (or reused) while reading
+    if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle) {
+        return NULL;
+    }
+    return desc;
+}
+
+/*
+ * Attach a descriptor to a live handle
+ */
+int
+machine_handle_set_desc(IO_HANDLE handle, IO_DESC *desc)
+{
+    int ret = IO_ERROR;
+
+    pthread_mutex_lock(&handle_lock);
+    struct handle_slot_t *slot = get_live_slot(handle);
+    if (slot) {
+        __atomic_store_n(&slot->desc, desc, __ATOMIC_RELEASE);
+        ret = IO_SUCCESS;
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    return ret;
+}
+
+/*
+ * Invalidate a handle and return its slot to the free list.  Returns the
+ * descriptor that was registered to the handle, if any.
+ */
+IO_DESC *
+machine_handle_release(IO_HANDLE handle)
+{
+    IO_DESC *desc = NULL;
+
+    pthread_mutex_lock(&handle_lock);
+    struct handle_slot_t *slot = get_live_slot(handle);
+    if (slot) {
+        desc = slot->desc;
+
+        // Readers re-check the handle after loading, so clear it first
+        __atomic_store_n(&slot->handle, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->desc, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->machine, NULL, __ATOMIC_RELEASE);
+
+        slot->gen = (slot->gen + 1) & HANDLE_GEN_MASK;
+        slot->next_free = handle_free;
+        handle_free = HANDLE_INDEX(handle);
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    return desc;
+}
 
 const IOM *
 get_machine_ref(IO_HANDLE handle)
@@ -87,7 +205,7 @@ machine_register(const char *name)
 {
     // Init master pool
     if (!bingewatch_pool) {
-        bingewatch_pool = create_pool();
+        bingewatch_pool = bw_create_pool();
     }
     
     // Check for name
@@ -101,7 +219,7 @@ machine_register(const char *name)
     machine = (IOM*)pcalloc(bingewatch_pool, sizeof(IOM));
 
     // Create memory pool for machine
-    machine->alloc = create_subpool(bingewatch_pool);
+    machine->alloc = bw_create_subpool(bingewatch_pool);
     // Set name
     machine->name = (char *)palloc(machine->alloc, strlen(name) + 1);
     strcpy(machine->name, name);
@@ -131,36 +249,79 @@ machine_register(const char *name)
 IO_HANDLE
 request_handle(IOM *machine)
 {
-    static size_t handle_counter = 0;
+    IO_HANDLE h = 0;
 
-    if (!handle_map) {
-        handle_alloc = MACHINE_CHUNK;
-        handle_map = (struct handle_map_t *)palloc(bingewatch_pool, handle_alloc * sizeof(struct handle_map_t));
-    }
+    pthread_mutex_lock(&handle_lock);
+
+    // Reuse a released slot before growing the table
+    uint32_t index = handle_free;
+    struct handle_slot_t *slot = NULL;
+    if (index) {
+        slot = get_slot(index);
+        handle_free = slot->next_free;
+
+    } else if (handle_next_index <= HANDLE_INDEX_MASK) {
+        index = handle_next_index;
+
+        struct handle_slot_t **chunk = &handle_chunks[index / MACHINE_CHUNK];
+        if (!*chunk) {
+            if (!bingewatch_pool) {
+                bingewatch_pool = bw_create_pool();
+            }
 
-    if (handle_count == handle_alloc) {
-        handle_alloc += MACHINE_CHUNK;
-        handle_map = (struct handle_map_t *)repalloc(handle_map, handle_alloc * sizeof(struct handle_map_t), bingewatch_pool);
+            size_t bytes = MACHINE_CHUNK * sizeof(struct handle_slot_t);
+            struct handle_slot_t *new = pcalloc(bingewatch_pool, bytes);
+            if (!new) {
+                error("Failed to allocate handle table");
+                goto do_return;
+            }
+            __atomic_store_n(chunk, new, __ATOMIC_RELEASE);
+        }
+
+        handle_next_index++;
+        slot = get_slot(index);
+
+    } else {
+        error("Out of io handles");
+        goto do_return;
     }
 
-    struct handle_map_t *m = handle_map + handle_count++;
-    m->handle = ++handle_counter;
-    m->machine = machine;
+    h = (IO_HANDLE)((slot->gen << HANDLE_INDEX_BITS) | index);
+    slot->next_free = 0;
+    __atomic_store_n(&slot->desc, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->machine, machine, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->handle, h, __ATOMIC_RELEASE);
 
-    return m->handle;
+do_return:
+    pthread_mutex_unlock(&handle_lock);
+    return h;
 }
 
 void
 machine_cleanup()
 {
-    int i = 0;   
-    for (; i < handle_count; i++) {
-        struct handle_map_t *hm = handle_map + i;
-        if (!hm->machine->destroy) {
+    // Snapshot live handles, since destroying a machine releases its slot
+    pthread_mutex_lock(&handle_lock);
+    uint32_t n = handle_next_index;
+    IO_HANDLE *live = (n > 1) ? malloc(n * sizeof(IO_HANDLE)) : NULL;
+    uint32_t count = 0;
+    for (uint32_t i = 1; live && i < n; i++) {
+        struct handle_slot_t *slot = get_slot(i);
+        if (slot && slot->handle) {
+            live[count++] = slot->handle;
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        IOM *machine = get_machine_by_handle(live[i]);
+        if (!machine || !machine->destroy) {
             continue;
         }
-        hm->machine->destroy(hm->handle);
+        machine->destroy(live[i]);
     }
+
+    free(live);
 }
 
 void
@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "machine.h"
 #include "filter.h"
@@ -14,8 +19,7 @@
 #define machine_warn(d, h, x, ...) warn("%s %d: " x, d->machine->name, h, ##__VA_ARGS__)
 #define machine_trace(d, h, x, ...) trace("%s %d: " x, d->machine->name, h, ##__VA_ARGS__)
 
-struct machine_desc_t *machine_descriptors = NULL;
-static pthread_mutex_t machine_desc_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static int machine_log_level_init = 0;
 
 // Add a new descriptor
 void
@@ -26,7 +30,9 @@ machine_register_desc(struct machine_desc_t *addme, IO_HANDLE *handle)
         bw_init_logging();
     }
 
-    if (!machine_descriptors && ENVEX_EXISTS("BW_MACHINE_LOG_LEVEL")) {
+    if (!machine_log_level_init && ENVEX_EXISTS("BW_MACHINE_LOG_LEVEL")) {
+        machine_log_level_init = 1;
+
         char default_lvl[64];
         ENVEX_COPY(default_lvl, 64, "BW_LOG_LEVEL", "error");
 
@@ -43,50 +49,28 @@ machine_register_desc(struct machine_desc_t *addme, IO_HANDLE *handle)
     }
     addme->handle = h;
 
-    if (addme->io_read) {
+    // One-sided machines only have a read or a write filter
+    if (addme->io_read && addme->io_read->obj) {
         struct io_filter_t *f = (struct io_filter_t *)addme->io_read->obj;
         f->obj = &addme->handle;
     }
 
-    if (addme->io_write) {
+    if (addme->io_write && addme->io_write->obj) {
         struct io_filter_t *f = (struct io_filter_t *)addme->io_write->obj;
         f->obj = &addme->handle;
     }
 
-    *handle = h;
+    // Publish the descriptor in the handle table
+    machine_handle_set_desc(h, addme);
 
-    pthread_mutex_lock(&machine_desc_list_lock);
-    struct machine_desc_t *d = machine_descriptors;
-    if (!d) {
-        machine_descriptors = addme;
-    } else {
-        while (d->next) {
-            d = d->next;
-        }
-        d->next = addme;
-    }
-    pthread_mutex_unlock(&machine_desc_list_lock);
+    *handle = h;
 }
 
 // Get a pointer to a descriptor with the specified handle
 struct machine_desc_t *
 machine_get_desc(IO_HANDLE h)
 {
-    pthread_mutex_lock(&machine_desc_list_lock);
-    struct machine_desc_t *d = machine_descriptors;
-
-    while (d) {
-        IO_HANDLE dh = d->handle;
-
-        if (dh == h) {
-            break;
-        }
-
-        d = d->next;
-    }
-    pthread_mutex_unlock(&machine_desc_list_lock);
-
-    return d;
+    return machine_handle_get_desc(h);
 }
 
 static void
@@ -96,65 +80,49 @@ free_machine_desc(struct machine_desc_t *desc) {
     }
 
     pthread_mutex_destroy(&desc->lock);
-    free_pool(desc->pool);
+
+    bw_free_pool(desc->pool);
 }
 
 // Free the descriptor 
 void
 machine_destroy_desc(IO_HANDLE h)
 {
-    struct machine_desc_t *d = machine_descriptors;
-    struct machine_desc_t *dp = NULL;
-
-    pthread_mutex_lock(&machine_desc_list_lock);
-    while (d) {
-        if (d->handle == h) {
-            break;
-        }
-        dp = d;
-
-        d = d->next;
-    }
+    // Remove the handle from the table.  New lookups fail from here on.
+    struct machine_desc_t *d = machine_handle_release(h);
 
     // handle not found
     if (!d) {
-        pthread_mutex_unlock(&machine_desc_list_lock);
         return;
+    }
 
-    // handle in first slot
-    } else if (!dp) {
-        machine_descriptors = d->next;
-
-    } else if (d && dp) {
-        dp->next = d->next;
+    // Parked readers hold the descriptor: wake them, and don't let them park again
+    if (d->event) {
+        pthread_mutex_lock(&d->event->lock);
+        __atomic_store_n(&d->event->closed, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&d->event->lock);
+        machine_desc_notify(d);
     }
-    pthread_mutex_unlock(&machine_desc_list_lock);
 
-    while (d->in_use) {
+    while (__atomic_load_n(&d->in_use, __ATOMIC_ACQUIRE)) {
         usleep(500000);
         continue;
     }
 
     info("Destroying machine %d", h);
-    pthread_mutex_lock(&machine_desc_list_lock);
     free_machine_desc(d);
-    pthread_mutex_unlock(&machine_desc_list_lock);
 }
 
 void
 machine_desc_acquire(struct machine_desc_t *d)
 {
-    pthread_mutex_lock(&d->lock);
-    d->in_use++;
-    pthread_mutex_unlock(&d->lock);
+    __atomic_add_fetch(&d->in_use, 1, __ATOMIC_ACQ_REL);
 }
 
 void
 machine_desc_release(struct machine_desc_t *d)
 {
-    pthread_mutex_lock(&d->lock);
-    d->in_use--;
-    pthread_mutex_unlock(&d->lock);
+    __atomic_sub_fetch(&d->in_use, 1, __ATOMIC_ACQ_REL);
 }
 
 void
@@ -338,6 +306,156 @@ do_return:
     return ret;
 }
 
+/*
+ * Block borrowing
+ *
+ * Buffer machines can lend out their blocks, so a segment copies data once per
+ * hop instead of staging it in a private buffer.  Borrowing bypasses the
+ * filter chain, so it is only offered while the machine's own filter is the
+ * whole chain and the descriptor is enabled.  Otherwise use read()/write().
+ */
+static int
+can_borrow(struct io_desc *io, void *fn)
+{
+    if (!io || !fn) {
+        return 0;
+    }
+
+    if (io->state != IO_DESC_ENABLED) {
+        return 0;
+    }
+
+    struct io_filter_t *f = (struct io_filter_t *)io->obj;
+    return (f && !f->next) ? 1 : 0;
+}
+
+int
+machine_desc_can_borrow_read(IO_DESC *d)
+{
+    return (d) ? can_borrow(d->io_read, d->machine->acquire_read_block) : 0;
+}
+
+int
+machine_desc_can_borrow_write(IO_DESC *d)
+{
+    return (d) ? can_borrow(d->io_write, d->machine->acquire_write_block) : 0;
+}
+
+/*
+ * Borrow the next full block.  Unread data is b->data + b->offset through
+ * b->data + b->bytes.  On IO_SUCCESS, the block must be returned with
+ * machine_desc_release_read_block(); otherwise *b is NULL.
+ */
+int
+machine_desc_acquire_read_block(IO_DESC *d, size_t bytes, struct __block_t **b)
+{
+    machine_desc_acquire(d);
+    int ret = d->machine->acquire_read_block(d->handle, bytes, b);
+    if (ret != IO_SUCCESS || !*b) {
+        *b = NULL;
+        machine_desc_release(d);
+    }
+    return ret;
+}
+
+int
+machine_desc_release_read_block(IO_DESC *d, struct __block_t *b, size_t bytes)
+{
+    int ret = d->machine->release_read_block(d->handle, b, bytes);
+
+    if (d->metrics) {
+        IO_METRICS *m = &d->metrics->out;
+        m->fn(m, bytes, bytes);
+    }
+
+    machine_desc_release(d);
+    return ret;
+}
+
+/*
+ * Borrow an empty block, of at least "bytes" if the machine can size blocks.
+ * On IO_SUCCESS, the block must be returned with
+ * machine_desc_commit_write_block(), with 0 bytes if nothing was written.
+ */
+int
+machine_desc_acquire_write_block(IO_DESC *d, size_t bytes, struct __block_t **b)
+{
+    machine_desc_acquire(d);
+    int ret = d->machine->acquire_write_block(d->handle, bytes, b);
+    if (ret != IO_SUCCESS || !*b) {
+        *b = NULL;
+        machine_desc_release(d);
+    }
+    return ret;
+}
+
+int
+machine_desc_commit_write_block(IO_DESC *d, struct __block_t *b, size_t bytes)
+{
+    int ret = d->machine->commit_write_block(d->handle, b, bytes);
+
+    if (d->metrics) {
+        IO_METRICS *m = &d->metrics->in;
+        m->fn(m, bytes, bytes);
+    }
+
+    machine_desc_release(d);
+    return ret;
+}
+
+/*
+ * Block metadata: the record for the data returned by the last read, and the
+ * record to attach to the data in the next write.  IO_ERROR if the machine
+ * doesn't carry metadata.
+ */
+int
+machine_desc_get_read_meta(IO_DESC *d, struct block_meta_t *meta)
+{
+    if (!d || !d->machine->get_read_meta) {
+        return IO_ERROR;
+    }
+    return d->machine->get_read_meta(d->handle, meta);
+}
+
+int
+machine_desc_set_write_meta(IO_DESC *d, const struct block_meta_t *meta)
+{
+    if (!d || !d->machine->set_write_meta) {
+        return IO_ERROR;
+    }
+    return d->machine->set_write_meta(d->handle, meta);
+}
+
+int
+machine_get_read_meta(IO_HANDLE h, struct block_meta_t *meta)
+{
+    return machine_desc_get_read_meta(machine_get_desc(h), meta);
+}
+
+int
+machine_set_write_meta(IO_HANDLE h, const struct block_meta_t *meta)
+{
+    return machine_desc_set_write_meta(machine_get_desc(h), meta);
+}
+
+/*
+ * Move a record forward past "bytes" of data
+ */
+void
+block_meta_advance(struct block_meta_t *meta, size_t bytes)
+{
+    if (!(meta->flags & BLOCK_META_VALID) || meta->sample_bytes == 0) {
+        return;
+    }
+
+    uint64_t n = bytes / meta->sample_bytes;
+    meta->sample_index += n;
+    if (meta->sample_rate > 0) {
+        meta->time_ns += (uint64_t)((double)n * 1e9 / meta->sample_rate + .5);
+    }
+    meta->flags &= ~BLOCK_META_DISCONT;
+}
+
 void
 machine_disable_read(IO_HANDLE h)
 {
@@ -353,6 +471,7 @@ machine_disable_read(IO_HANDLE h)
             IO_METRICS *m = &d->metrics->out;
             machine_metrics_update(m);
         }
+        machine_desc_notify(d);
     }
 }
 
@@ -371,6 +490,7 @@ machine_disable_write(IO_HANDLE h)
             IO_METRICS *m = &d->metrics->in;
             machine_metrics_update(m);
         }
+        machine_desc_notify(d);
     }
 }
 
@@ -390,6 +510,188 @@ machine_stop(IO_HANDLE h)
     if (d->io_read) {
         io_desc_set_state(d, d->io_read, IO_DESC_DISABLING);
     }
+
+    machine_desc_notify(d);
+}
+
+/*
+ * Enable readiness notifications for a descriptor
+ */
+int
+machine_desc_event_init(IO_DESC *d)
+{
+    struct io_event_t *e = (struct io_event_t *)pcalloc(d->pool, sizeof(struct io_event_t));
+    if (!e) {
+        error("Failed to allocate event");
+        return IO_ERROR;
+    }
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    d->event = e;
+
+    return IO_SUCCESS;
+}
+
+/*
+ * Enable readiness notifications shared between processes.  "words" (two
+ * uint32_t: the event count and the number of waiters) must be in shared
+ * memory that every process maps.
+ */
+int
+machine_desc_event_init_shared(IO_DESC *d, uint32_t *words)
+{
+    if (machine_desc_event_init(d) < IO_SUCCESS) {
+        return IO_ERROR;
+    }
+
+    d->event->shared = words;
+    return IO_SUCCESS;
+}
+
+static inline uint32_t *
+event_seq(struct io_event_t *e)
+{
+    return (e->shared) ? &e->shared[0] : &e->seq;
+}
+
+static inline uint32_t *
+event_waiters(struct io_event_t *e)
+{
+    return (e->shared) ? &e->shared[1] : &e->waiters;
+}
+
+/*
+ * Signal that the machine state changed (new data, stop, etc.)
+ *   The lock is only taken when a reader is parked.
+ */
+void
+machine_desc_notify(IO_DESC *d)
+{
+    struct io_event_t *e = d->event;
+    if (!e) {
+        return;
+    }
+
+    __atomic_add_fetch(event_seq(e), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(event_waiters(e), __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    // Waiters may be in other processes
+    if (e->shared) {
+        syscall(SYS_futex, event_seq(e), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+void
+machine_notify(IO_HANDLE h)
+{
+    struct machine_desc_t *d = machine_get_desc(h);
+    if (!d) {
+        return;
+    }
+    machine_desc_notify(d);
+}
+
+/*
+ * Snapshot the event count.  Take the snapshot before reading, and pass it to
+ * machine_desc_event_wait() so a notification between the two isn't lost.
+ */
+int
+machine_desc_event_seq(IO_DESC *d, uint32_t *seq)
+{
+    struct io_event_t *e = d->event;
+    if (!e) {
+        return IO_ERROR;
+    }
+
+    *seq = __atomic_load_n(event_seq(e), __ATOMIC_SEQ_CST);
+    return IO_SUCCESS;
+}
+
+/*
+ * Park on the shared event count.  The kernel only sleeps if the count still
+ * equals "seq", so a notification can't be missed.
+ */
+static int
+event_wait_shared(struct io_event_t *e, uint32_t seq, size_t timeout_us)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    int ret = IO_SUCCESS;
+
+    __atomic_add_fetch(event_waiters(e), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(event_seq(e), __ATOMIC_SEQ_CST) == seq &&
+            !__atomic_load_n(&e->closed, __ATOMIC_SEQ_CST) &&
+            syscall(SYS_futex, event_seq(e), FUTEX_WAIT, seq, &ts, NULL, 0) != 0 &&
+            errno == ETIMEDOUT) {
+        ret = IO_NODATA;
+    }
+    __atomic_sub_fetch(event_waiters(e), 1, __ATOMIC_SEQ_CST);
+
+    return ret;
+}
+
+/*
+ * Park until the event count moves past "seq", or the timeout expires.  The
+ * descriptor is held while parked, and destroying the machine wakes it:
+ * IO_ERROR once the machine is being destroyed.
+ */
+int
+machine_desc_event_wait(IO_DESC *d, uint32_t seq, size_t timeout_us)
+{
+    struct io_event_t *e = d->event;
+    if (!e) {
+        return IO_ERROR;
+    }
+
+    machine_desc_acquire(d);
+    if (__atomic_load_n(&e->closed, __ATOMIC_SEQ_CST)) {
+        machine_desc_release(d);
+        return IO_ERROR;
+    }
+
+    if (e->shared) {
+        int ret = event_wait_shared(e, seq, timeout_us);
+        machine_desc_release(d);
+        return ret;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_us / 1000000;
+    ts.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    int ret = IO_SUCCESS;
+
+    pthread_mutex_lock(&e->lock);
+    __atomic_add_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&e->seq, __ATOMIC_SEQ_CST) == seq && !e->closed) {
+        if (pthread_cond_timedwait(&e->cond, &e->lock, &ts) == ETIMEDOUT) {
+            ret = IO_NODATA;
+            break;
+        }
+    }
+    if (e->closed) {
+        ret = IO_ERROR;
+    }
+    __atomic_sub_fetch(&e->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&e->lock);
+
+    machine_desc_release(d);
+    return ret;
 }
 
 IO_HANDLE
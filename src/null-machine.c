@@ -23,7 +23,7 @@ null_write(IO_FILTER_ARGS)
 static IO_HANDLE
 create_null(void *arg)
 {
-    POOL *p = create_subpool(_null_machine->alloc);
+    POOL *p = bw_create_subpool(_null_machine->alloc);
     if (!p) {
         printf("ERROR: Failed to create memory pool\n");
         return 0;
@@ -32,7 +32,7 @@ create_null(void *arg)
     struct machine_desc_t *desc = pcalloc(p, sizeof(struct machine_desc_t));
     if (!desc) {
         printf("ERROR: Failed to allocate %#zx bytes for file descriptor\n", sizeof(struct machine_desc_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -40,19 +40,19 @@ create_null(void *arg)
     desc->pool = p;
 
     if (machine_desc_init(p, _null_machine, desc) < IO_SUCCESS) {
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_read_init(p, "_null", null_read, desc)) {
         printf("ERROR: Failed to initialize read filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
     if (!filter_write_init(p, "_null", null_write, desc)) {
         printf("ERROR: Failed to initialize write filter\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
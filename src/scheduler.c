@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "machine.h"
+#include "scheduler.h"
+
+#define LOGEX_TAG "BW-SCHED"
+#include "bw-log.h"
+
+#define SCHED_MIN_WORKERS 2
+#define SCHED_BACKOFF_MIN_US 20     // First nap when every task is idle
+#define SCHED_BACKOFF_MAX_US 1000   // Matches the segment poll interval
+#define SCHED_PARK_US 100000        // Upper bound on parking with nothing queued
+
+struct sched_worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;           // Run queue lock
+    struct sched_task_t *head;      // Run queue
+    struct sched_task_t *tail;
+    size_t n_tasks;                 // Tasks in the run queue
+    int id;
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+static struct sched_worker_t *workers = NULL;
+static int n_workers = 0;
+static int next_worker = 0;         // Round-robin for new tasks
+static size_t n_queued = 0;         // Tasks waiting in a run queue, not claimed
+static int n_parked = 0;            // Workers waiting on sched_cond
+
+static void
+push_task(struct sched_worker_t *w, struct sched_task_t *t)
+{
+    t->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail) {
+        w->tail->next = t;
+    } else {
+        w->head = t;
+    }
+    w->tail = t;
+    w->n_tasks++;
+    __atomic_add_fetch(&n_queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static struct sched_task_t *
+pop_task(struct sched_worker_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    struct sched_task_t *t = w->head;
+    if (t) {
+        w->head = t->next;
+        if (!w->head) {
+            w->tail = NULL;
+        }
+        w->n_tasks--;
+        __atomic_sub_fetch(&n_queued, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return t;
+}
+
+/*
+ * Take a waiting task from another worker.  The task stays with the thief.
+ */
+static struct sched_task_t *
+steal_task(struct sched_worker_t *self)
+{
+    int i = 1;
+    for (; i < n_workers; i++) {
+        struct sched_worker_t *victim = &workers[(self->id + i) % n_workers];
+        if (__atomic_load_n(&victim->n_tasks, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        struct sched_task_t *t = pop_task(victim);
+        if (t) {
+            trace("Worker %d stole a task from worker %d", self->id, victim->id);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Park until a task is queued.  Tasks a worker is running are not counted,
+ * so spare workers sleep instead of spinning next to a busy one.
+ */
+static void
+park_worker()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (SCHED_PARK_US % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    __atomic_add_fetch(&n_parked, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&n_queued, __ATOMIC_SEQ_CST) == 0) {
+        if (pthread_cond_timedwait(&sched_cond, &sched_lock, &ts) != 0) {
+            break;
+        }
+    }
+    __atomic_sub_fetch(&n_parked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Wake one parked worker after a push.  A parker re-checks n_queued under
+ * sched_lock before it waits, so taking the lock here cannot miss it.
+ */
+static void
+wake_worker()
+{
+    if (__atomic_load_n(&n_parked, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+static void *
+worker_run(void *arg)
+{
+    struct sched_worker_t *w = (struct sched_worker_t *)arg;
+
+    size_t idle = 0;
+    size_t backoff = SCHED_BACKOFF_MIN_US;
+
+    while (1) {
+        struct sched_task_t *t = pop_task(w);
+        if (!t) {
+            t = steal_task(w);
+        }
+
+        if (!t) {
+            park_worker();
+            continue;
+        }
+
+        int status = t->fn(t->arg);
+        if (SCHED_TASK_DONE == status) {
+            continue;
+        }
+
+        // This worker takes its own task back next; only wake a spare
+        // worker when there is more queued here than that
+        push_task(w, t);
+        if (__atomic_load_n(&w->n_tasks, __ATOMIC_RELAXED) > 1) {
+            wake_worker();
+        }
+
+        if (SCHED_TASK_IDLE != status) {
+            idle = 0;
+            backoff = SCHED_BACKOFF_MIN_US;
+            continue;
+        }
+
+        // Back off once every task this worker holds came up empty
+        if (++idle > __atomic_load_n(&w->n_tasks, __ATOMIC_RELAXED)) {
+            usleep(backoff);
+            backoff = (backoff * 2 > SCHED_BACKOFF_MAX_US) ?
+                SCHED_BACKOFF_MAX_US : backoff * 2;
+            idle = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the workers on first use.  BW_SCHED_WORKERS sets the pool size
+ * (default: one per online CPU).  Caller holds sched_lock.
+ */
+static int
+init_workers()
+{
+    double v;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ENVEX_DOUBLE(v, "BW_SCHED_WORKERS", (double)cpus);
+
+    int n = (int)v;
+    if (n < SCHED_MIN_WORKERS) {
+        n = SCHED_MIN_WORKERS;
+    }
+
+    workers = calloc(n, sizeof(struct sched_worker_t));
+    if (!workers) {
+        error("Failed to allocate workers");
+        return IO_ERROR;
+    }
+
+    int i = 0;
+    for (; i < n; i++) {
+        struct sched_worker_t *w = &workers[i];
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    n_workers = n;
+
+    for (i = 0; i < n; i++) {
+        struct sched_worker_t *w = &workers[i];
+        if (pthread_create(&w->thread, NULL, worker_run, (void *)w) != 0) {
+            error("Failed to start worker %d", i);
+            return IO_ERROR;
+        }
+        pthread_detach(w->thread);
+    }
+
+    info("Started %d scheduler workers", n);
+    return IO_SUCCESS;
+}
+
+/*
+ * Queue a task on the worker pool
+ */
+int
+sched_submit(struct sched_task_t *task)
+{
+    pthread_mutex_lock(&sched_lock);
+    if (!workers && init_workers() < IO_SUCCESS) {
+        pthread_mutex_unlock(&sched_lock);
+        return IO_ERROR;
+    }
+
+    struct sched_worker_t *w = &workers[next_worker];
+    next_worker = (next_worker + 1) % n_workers;
+
+    push_task(w, task);
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+
+    return IO_SUCCESS;
+}
+
+int
+sched_get_workers()
+{
+    pthread_mutex_lock(&sched_lock);
+    int n = n_workers;
+    pthread_mutex_unlock(&sched_lock);
+
+    return n;
+}
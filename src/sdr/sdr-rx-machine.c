@@ -11,6 +11,7 @@
 #include "sdr-machine.h"
 #include "simple-buffers.h"
 #include "block-list-buffer.h"
+#include "bw-copy.h"
 
 #define LOGEX_TAG "BW-SDRRX"
 #include "logging.h"
@@ -31,27 +32,8 @@ struct hw_fill_t {
 static struct sdr_channel_t *
 get_channel(IO_HANDLE h)
 {
-    struct sdr_channel_t *ret = NULL;
-
-    // Get device list
-    struct sdr_device_t *d = devices;
-
-    while (d && !ret) {
-        pthread_mutex_lock(&d->lock);
-
-        for (int i = 0; i < d->n_chan; i++) {
-            IO_DESC *chan = (IO_DESC *)d->channels[i];
-            if (chan->handle == h) {
-                ret = (struct sdr_channel_t *)chan;
-                break;
-            }
-        }
-
-        pthread_mutex_unlock(&d->lock);
-        d = d->next;
-    }
-
-    return ret;
+    // Device handles have no descriptor, so only channels are found here
+    return (struct sdr_channel_t *)machine_get_desc(h);
 }
 
 static void
@@ -169,7 +151,7 @@ cleanup_device(struct sdr_device_t *device)
         dp->next = d->next;
     }
 
-    free_pool(d->pool);
+    bw_free_pool(d->pool);
 }
 
 static void
@@ -259,7 +241,7 @@ sdr_create(IOM *machine, void *arg)
         return 0;
     }
 
-    POOL *var_pool = create_subpool(machine->alloc);
+    POOL *var_pool = bw_create_subpool(machine->alloc);
     if (!var_pool) {
         error("Failed to create sdr rx memory pool");
         return 0;
@@ -270,7 +252,7 @@ sdr_create(IOM *machine, void *arg)
     }
 
     // Device Init
-    POOL *device_pool = create_subpool(machine->alloc);
+    POOL *device_pool = bw_create_subpool(machine->alloc);
     if (!device_pool) {
         error("Failed to create sdr rx device memory pool");
         return 0;
@@ -279,39 +261,39 @@ sdr_create(IOM *machine, void *arg)
     struct sdr_device_t *device = api->device(device_pool, arg);
     if (!device) {
         error("Failed to create sdr rx device descriptor");
-        free_pool(device_pool);
+        bw_free_pool(device_pool);
         return 0;
     }
     pthread_mutex_init(&device->lock, NULL);
     device->pool = device_pool;
 
     // Channel Init
-    POOL *channel_pool = create_subpool(machine->alloc);
+    POOL *channel_pool = bw_create_subpool(machine->alloc);
     if (!channel_pool) {
         error("Failed to create sdr rx channel memory pool");
-        free_pool(device_pool);
+        bw_free_pool(device_pool);
         return 0;
     }
 
     struct sdr_channel_t *chan = api->channel(channel_pool, device, arg);
     if (!chan) {
         error("Failed to create new sdr rx channel");
-        free_pool(device_pool);
-        free_pool(channel_pool);
+        bw_free_pool(device_pool);
+        bw_free_pool(channel_pool);
         return 0;
     }
 
     if (machine_desc_init(channel_pool, machine, (IO_DESC *)chan) < IO_SUCCESS) {
         error("Failed to initialize mechine descriptor");
-        free_pool(device_pool);
-        free_pool(channel_pool);
+        bw_free_pool(device_pool);
+        bw_free_pool(channel_pool);
         return 0;
     }
 
     if (init_filters(chan, device, api->rx_filter) < IO_SUCCESS) {
         error("Failed to initialize sdr rx filter");
-        free_pool(device_pool);
-        free_pool(channel_pool);
+        bw_free_pool(device_pool);
+        bw_free_pool(channel_pool);
         return 0;
     }
 
@@ -385,6 +367,25 @@ get_gain(IO_HANDLE h, float *gain)
     return 0;
 }
 
+/*
+ * Metadata for the samples returned by a hardware read
+ */
+static void
+take_hw_meta(struct sdr_channel_t *chan, int ret, size_t n_samp, struct block_meta_t *meta)
+{
+    struct block_meta_t *m = &chan->hw_meta;
+    m->flags |= BLOCK_META_VALID;
+    m->sample_rate = chan->rate;
+    m->sample_bytes = sizeof(float complex);
+    m->source_id = (uint32_t)chan->_d.handle;
+    if (ret == IO_DATABREAK) {
+        m->flags |= BLOCK_META_DISCONT;
+    }
+
+    *meta = *m;
+    block_meta_advance(m, n_samp * sizeof(float complex));
+}
+
 static void *
 fill_from_hw(void *args)
 {
@@ -417,6 +418,7 @@ fill_from_hw(void *args)
             goto do_exit;
         }
 
+        take_hw_meta(chan, wp->d_ret, n_samp, &wp->meta);
         wp->bytes = n_samp * sizeof(float complex);
         wp = wp->next;
     }
@@ -466,19 +468,26 @@ read_from_buffer(struct sdr_channel_t *chan, float complex *buf, size_t *n_samp)
         }
 
         if (rp->d_ret < IO_SUCCESS) {
+            rp->offset = 0;
             rp->bytes = 0;
             rp = rp->next;
             ret = rp->d_ret;
             goto do_return;
         }
 
-        size_t rp_samp = rp->bytes / sizeof(float complex);
+        if (total_samples == 0) {
+            chan->rmeta = rp->meta;
+            block_meta_advance(&chan->rmeta, rp->offset);
+        }
+
+        char *src = rp->data + rp->offset;
+        size_t rp_samp = BLOCK_UNREAD(rp) / sizeof(float complex);
         size_t n = (remaining >= rp_samp) ? rp_samp : remaining;
         size_t bytes = n * sizeof(float complex);
 
         switch (rp->d_ret) {
         case IO_SUCCESS:
-            memcpy(data, rp->data, bytes);
+            bw_memcpy(data, src, bytes);
             break;
 
         case IO_DATABREAK:
@@ -486,12 +495,13 @@ read_from_buffer(struct sdr_channel_t *chan, float complex *buf, size_t *n_samp)
             if (total_samples > 0) {
                 goto do_return;
             }
-            memcpy(data, rp->data, bytes);
+            bw_memcpy(data, src, bytes);
             break;
 
         default:
-            memcpy(data, rp->data, bytes);
+            bw_memcpy(data, src, bytes);
             total_samples += n;
+            rp->offset = 0;
             rp->bytes = 0;
             rp = rp->next;
             ret = rp->d_ret;
@@ -502,16 +512,15 @@ read_from_buffer(struct sdr_channel_t *chan, float complex *buf, size_t *n_samp)
         remaining -= n;
         total_samples += n;
 
-        // If all bytes were consumed, go to next buffer
-        if (rp->bytes - bytes == 0) {
+        // If all bytes were consumed, recycle the block and go to the next one
+        if (BLOCK_UNREAD(rp) == bytes) {
+            rp->offset = 0;
             rp->bytes = 0;
             rp = rp->next;
 
-        // If bytes are remaining, copy to front of buffer
+        // If bytes are remaining, advance the read offset
         } else {
-            char *src = rp->data + bytes;
-            rp->bytes -= bytes;
-            memcpy(rp->data, src, rp->bytes);
+            rp->offset += bytes;
         }
     }
 
@@ -593,6 +602,9 @@ sdrrx_read(IO_FILTER_ARGS)
     switch (chan->mode) {
     case SDR_MODE_UNBUFFERED:
         ret = api->hw_read(chan, data, &n_samp);
+        if (ret >= IO_SUCCESS) {
+            take_hw_meta(chan, ret, n_samp, &chan->rmeta);
+        }
         break;
     case SDR_MODE_BUFFERED:
         ret = read_from_buffer(chan, data, &n_samp);
@@ -639,6 +651,18 @@ sdr_init_api_functions(IOM *machine, SDR_API *api)
     api->get_net_gain = get_gain;
 }
 
+static int
+sdr_get_read_meta(IO_HANDLE h, struct block_meta_t *meta)
+{
+    struct sdr_channel_t *chan = get_channel(h);
+    if (!chan) {
+        return IO_ERROR;
+    }
+
+    *meta = chan->rmeta;
+    return IO_SUCCESS;
+}
+
 void
 sdr_init_machine_functions(IOM *machine)
 {
@@ -646,6 +670,7 @@ sdr_init_machine_functions(IOM *machine)
     machine->unlock = sdr_unlock;
     machine->destroy = sdr_destroy;
     machine->write = sdr_rx_write;
+    machine->get_read_meta = sdr_get_read_meta;
 }
 
 int
@@ -675,6 +700,10 @@ sdrrx_reset(IO_HANDLE h) {
         return 1;
     }
 
+    // Sample counting restarts with the stream
+    memset(&chan->hw_meta, 0, sizeof(struct block_meta_t));
+    chan->hw_meta.flags = BLOCK_META_DISCONT;
+
     struct blb_rw_t *rw = (struct blb_rw_t *)chan->buffer;
     blb_rw_empty(rw);
     return 0;
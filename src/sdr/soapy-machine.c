@@ -209,6 +209,12 @@ read_from_hw(struct sdr_channel_t *sdr, void *buf, size_t *n_samp)
             goto do_return;
         }
 
+        // Hardware time of the first sample
+        if (total_samp == 0 && (flags & SOAPY_SDR_HAS_TIME)) {
+            sdr->hw_meta.time_ns = (uint64_t)timeNs;
+            sdr->hw_meta.flags |= BLOCK_META_TIME;
+        }
+
         long long expected = (long long)(chan->expected_timestamp + .5);
         int diff = (int)(timeNs - expected);
         chan->expected_timestamp = (double)timeNs + (double)samples_read * chan->ns_per_sample;
@@ -381,7 +387,7 @@ create_device(POOL *p, void *args)
     struct soapy_device_t *dev = pcalloc(p, sizeof(struct soapy_device_t));
     if (!dev) {
         error("Failed to allocate %zu bytes for sdr device\n", sizeof(struct soapy_device_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
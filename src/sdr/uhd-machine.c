@@ -244,6 +244,18 @@ read_from_hw(struct sdr_channel_t *sdr, void *buf, size_t *n_samp)
             return IO_ERROR;
         }
 
+        // Hardware time of the first sample
+        bool has_time = false;
+        if (total_samp == 0 &&
+                uhd_rx_metadata_has_time_spec(chan->rx_metadata, &has_time) == 0 && has_time) {
+            int64_t full_secs;
+            double frac_secs;
+            uhd_rx_metadata_time_spec(chan->rx_metadata, &full_secs, &frac_secs);
+            sdr->hw_meta.time_ns = (uint64_t)full_secs * 1000000000ULL +
+                (uint64_t)(frac_secs * 1e9 + .5);
+            sdr->hw_meta.flags |= BLOCK_META_TIME;
+        }
+
         if (overflow) {
             if (!sdr->allow_overruns) {
                 error("Overrun Detected");
@@ -4,8 +4,13 @@
 
 #include "machine.h"
 #include "segment.h"
-#include "ring-buf.h"
+#include "block-list-buffer.h"
+#include "simple-buffers.h"
+#include "bw-copy.h"
+#include "bw-mem.h"
 #include "bw-util.h"
+#include "scheduler.h"
+#include "bw-thread.h"
 #include "stream-state.h"
 
 #define LOGEX_TAG "BW-SEG"
@@ -23,6 +28,7 @@ static int metrics_enabled = 0;
  }
 
 #define seg_error(s, x, ...) error("%s%s%s: " x, *s->group, s->gsep, s->name, ##__VA_ARGS__)
+#define seg_warn(s, x, ...) warn("%s%s%s: " x, *s->group, s->gsep, s->name, ##__VA_ARGS__)
 #define seg_info(s, x, ...) info("%s%s%s: " x, *s->group, s->gsep, s->name, ##__VA_ARGS__)
 #define seg_trace(s, x, ...) trace("%s%s%s: " x, *s->group, s->gsep, s->name, ##__VA_ARGS__)
 #define seg_debug(s, x, ...) debug("%s%s%s: " x, *s->group, s->gsep, s->name, ##__VA_ARGS__)
@@ -31,12 +37,32 @@ static int metrics_enabled = 0;
 
 #define SEGMENT_ERROR(s) s->error.fn(s->error.arg)
 
+#define SEGMENT_STOPPED(s) if (s->stop.fn) { s->stop.fn(s->stop.arg); }
+
 #define SEG_GRP(x) ((x->group) ? *x->group"-" : "")
 #define SEGMENT_NAME_LEN 1024
 #define SEGMENT_DEFAULT_BUFLEN 10*MB
 
+// Empty-read wait policy
+#define SEGMENT_POLL_US 1000            // Sleep for sources without read events
+#define SEGMENT_DEFAULT_SPIN 64         // Event checks before parking
+#define SEGMENT_DEFAULT_PARK_US 100000  // Upper bound on a single park
+
+// Pooled segments give up their worker after this many transfers
+#define SEGMENT_TASK_QUANTUM 16
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
 static int segment_counter = 0;
 
+static size_t default_spin = SEGMENT_DEFAULT_SPIN;
+static size_t default_park_us = SEGMENT_DEFAULT_PARK_US;
+static int wait_policy_init = 0;
+
 enum segment_direction_e {
     SEG_DIR_IN,
     SEG_DIR_OUT,
@@ -56,14 +82,26 @@ struct seg_callback_t {
 struct io_segment_t {
     struct seg_callback_t error;
     struct seg_callback_t complete;
+    struct seg_callback_t stop;
 
     // Thread variables
     pthread_t thread;               // Thread for this segment
     pthread_mutex_t lock;           // Segment lock
     pthread_fn fn;                  // Function for running the segment
 
+    // Worker pool (instead of a thread)
+    char pooled;                    // Run as a task on the worker pool
+    char done;                      // Pooled segment has finished
+    pthread_cond_t done_cond;       // Signalled when done is set
+    struct sched_task_t task;
+
+    // Thread placement (dedicated threads only)
+    struct bw_thread_attr_t attr;
+    char placed;                    // Affinity, priority or NUMA was requested
+
     // State machine
     enum stream_state_e *state;    // Pointer to stream state
+    pthread_barrier_t *start;      // Stream start barrier
     char running;                  // This controls the main loop
     char do_complete;              // This controls the main loop
 
@@ -76,14 +114,47 @@ struct io_segment_t {
     struct io_segment_t *next;  // Next segment in list
     size_t default_buf_len;
 
+    // Empty-read wait policy
+    size_t spin;                // Event checks before parking
+    size_t park_us;             // Max time parked on the source event
+
     // Input
     IO_HANDLE in;                 // Input IOM
 
     // Output
     IO_HANDLE out;                 // Output IOM
     IO_HANDLE out1;                // Output IOM
+
+    // Run state
+    IO_DESC *src;
+    IO_DESC *dst;
+    IO_DESC *dst1;
+    size_t buflen;              // Staging buffer length
+    POOL *run_pool;             // Staging buffer pool
+    char *buf;                  // Staging buffer (only allocated if needed)
+    size_t reserved;            // Budget held for the staging buffer
 };
 
+static void
+set_running(struct io_segment_t *s, char running)
+{
+    pthread_mutex_lock(&s->lock);
+    s->running = running;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Block until the stream releases all of its segments
+ */
+static void
+wait_for_start(struct io_segment_t *s)
+{
+    set_running(s, 1);
+    if (s->start) {
+        pthread_barrier_wait(s->start);
+    }
+}
+
 /*
  * Stop IO Machines and set running flag to false
  */
@@ -107,7 +178,7 @@ stop_segment(struct io_segment_t *s)
     }
 
     seg_trace(s, "Stop command issued");
-    s->running = 0;
+    set_running(s, 0);
     s->do_complete = 0;
 }
 
@@ -129,6 +200,36 @@ read_from_source(struct io_segment_t *seg, IO_DESC *src, char *buf, size_t *byte
     }
 }
 
+/*
+ * Wait for the source to signal new data.  Spin on the event count for a
+ * short time, then park on it.  Sources without events fall back to polling.
+ */
+static void
+wait_for_data(struct io_segment_t *seg, IO_DESC *src, uint32_t *seq)
+{
+    // Nothing to wait for if the read completed or failed
+    if (seg->do_complete || !seg->running) {
+        return;
+    }
+
+    if (!seq) {
+        usleep(SEGMENT_POLL_US);
+        return;
+    }
+
+    size_t spin = seg->spin;
+    while (spin--) {
+        uint32_t cur;
+        machine_desc_event_seq(src, &cur);
+        if (cur != *seq) {
+            return;
+        }
+        CPU_RELAX();
+    }
+
+    machine_desc_event_wait(src, *seq, seg->park_us);
+}
+
 static void
 write_to_dest(struct io_segment_t *seg, IO_DESC *dst, char *buf, size_t *bytes)
 {
@@ -164,75 +265,179 @@ write_to_dest(struct io_segment_t *seg, IO_DESC *dst, char *buf, size_t *bytes)
     *bytes = wr_bytes;
 }
 
-static void *
-segment_run_source(void *arg)
+/*
+ * Fill destination blocks directly from a buffer.  Stops early (short count)
+ * if the destination is full.
+ */
+static void
+write_to_dest_blocks(struct io_segment_t *seg, IO_DESC *dst, char *buf, size_t *bytes)
 {
-    /* Arg management */
-    struct io_segment_t *seg = (struct io_segment_t *)arg;
-    IO_DESC *src = machine_get_desc(seg->in);
-    IO_DESC *rb = machine_get_desc(seg->out);
+    size_t remaining = *bytes;
+    size_t wr_bytes = 0;
+    char *ptr = buf;
+
+    while (remaining) {
+        struct __block_t *b;
+        enum io_status status = machine_desc_acquire_write_block(dst, remaining, &b);
+        if (!b) {
+            if (status < IO_SUCCESS) {
+                seg_error(seg, "Write error (%d)", status);
+                SEGMENT_ERROR(seg);
+                stop_segment(seg);
+            }
+            break;
+        }
 
-    size_t buflen = (src->io_read->size > rb->io_write->size) ?
-        src->io_read->size : rb->io_write->size;
+        size_t _bytes = (remaining < b->size) ? remaining : b->size;
+        bw_memcpy_stream(b->data, ptr, _bytes);
+        machine_desc_commit_write_block(dst, b, _bytes);
 
-    //if (0 == buflen) {
-    //    buflen = seg->default_buf_len;
-    //}
+        remaining -= _bytes;
+        ptr += _bytes;
+        wr_bytes += _bytes;
+    }
 
-    seg_trace(seg, "Starting segment source");
+    *bytes = wr_bytes;
+}
 
-    seg->running = 1;
-    while (seg->running) {
-        enum stream_state_e state = *seg->state;
-        if (STREAM_READY == state) {
-            continue;
-        }
+/*
+ * Pass source metadata on to the destination(s), if the source has any
+ */
+static inline void
+forward_meta(const struct block_meta_t *meta, IO_DESC *dst, IO_DESC *dst1)
+{
+    if (!(meta->flags & BLOCK_META_VALID)) {
+        return;
+    }
+
+    machine_desc_set_write_meta(dst, meta);
+    if (dst1) {
+        machine_desc_set_write_meta(dst1, meta);
+    }
+}
+
+/*
+ * Borrow a block from the source and copy it straight into the destination(s).
+ * Bytes that could not be written stay in the source block for the next pass.
+ */
+static size_t
+forward_source_block(struct io_segment_t *seg, IO_DESC *src, IO_DESC *dst, IO_DESC *dst1,
+    uint32_t **seqp)
+{
+    struct __block_t *b;
+    enum io_status status = machine_desc_acquire_read_block(src, 0, &b);
+    if (!b) {
+        if (IO_COMPLETE == status) {
+            seg_info(seg, "Read complete");
+            seg->do_complete = 1;
 
-        if (seg->do_complete) {
-            SEGMENT_COMPLETE(seg);
+        } else if (status < IO_SUCCESS) {
+            seg_error(seg, "Read error (%d)", status);
+            SEGMENT_ERROR(seg);
             stop_segment(seg);
-            continue;
         }
+        return 0;
+    }
 
-        if (!STREAM_IS_RUNNING(state)) {
-            seg_trace(seg, "Stream stopped");
-            seg->running = 0;
-            continue;
+    char *data = b->data + b->offset;
+    size_t src_bytes = BLOCK_UNREAD(b);
+    size_t bytes = src_bytes;
+
+    struct block_meta_t meta = b->meta;
+    block_meta_advance(&meta, b->offset);
+    forward_meta(&meta, dst, dst1);
+
+    if (!dst1 && machine_desc_can_borrow_write(dst)) {
+        write_to_dest_blocks(seg, dst, data, &bytes);
+    } else {
+        write_to_dest(seg, dst, data, &bytes);
+        if (dst1 && bytes) {
+            size_t bytes1 = bytes;
+            write_to_dest(seg, dst1, data, &bytes1);
         }
+    }
+
+    machine_desc_release_read_block(src, b, bytes);
+
+    // Destination is full, not the source empty
+    if (bytes < src_bytes) {
+        *seqp = NULL;
+    }
+    return bytes;
+}
 
-        const struct __block_t *b;
-        if (rb_acquire_write_block(seg->out, buflen, &b) < 0) {
-            seg_error(seg, "Write error (%d)", IO_ERROR);
+/*
+ * Borrow a destination block and read the source straight into it
+ */
+static size_t
+fill_dest_block(struct io_segment_t *seg, IO_DESC *src, IO_DESC *dst, size_t buflen,
+    uint32_t **seqp)
+{
+    struct __block_t *b;
+    enum io_status status = machine_desc_acquire_write_block(dst, buflen, &b);
+    if (!b) {
+        if (status < IO_SUCCESS) {
+            seg_error(seg, "Write error (%d)", status);
             SEGMENT_ERROR(seg);
             stop_segment(seg);
-            goto no_data;
         }
 
-        if (!b) {
-            goto no_data;
-        }
+        // Destination is full, not the source empty
+        *seqp = NULL;
+        return 0;
+    }
 
-        size_t bytes = b->size;
-        read_from_source(seg, src, b->data, &bytes);
-        rb_release_write_block(seg->out, bytes);
+    size_t bytes = b->size;
+    read_from_source(seg, src, b->data, &bytes);
 
-        if (bytes == 0) {
-            goto no_data;
-        }
-        continue;
+    struct block_meta_t meta;
+    if (bytes && machine_desc_get_read_meta(src, &meta) == IO_SUCCESS &&
+            (meta.flags & BLOCK_META_VALID)) {
+        b->meta = meta;
+    }
+    machine_desc_commit_write_block(dst, b, bytes);
+
+    return bytes;
+}
+
+/*
+ * Read into the segment buffer, then write it to the destination(s)
+ */
+static size_t
+copy_through_buffer(struct io_segment_t *seg, IO_DESC *src, IO_DESC *dst, IO_DESC *dst1,
+    char *buf, size_t buflen)
+{
+    size_t bytes = buflen;
+    read_from_source(seg, src, buf, &bytes);
 
-    no_data:
-        usleep(1000);
+    if (bytes == 0) {
+        return 0;
     }
 
-    pthread_exit(NULL);
+    struct block_meta_t meta;
+    if (machine_desc_get_read_meta(src, &meta) == IO_SUCCESS) {
+        forward_meta(&meta, dst, dst1);
+    }
+
+    size_t src_bytes = bytes;
+    write_to_dest(seg, dst, buf, &bytes);
+    if (bytes == 0) {
+        return src_bytes;
+    } else if (bytes != src_bytes) {
+        error("Partial write");
+    }
+
+    if (dst1) {
+        bytes = src_bytes;
+        write_to_dest(seg, dst1, buf, &bytes);
+    }
+
+    return src_bytes;
 }
 
-static void *
-segment_run(void *arg)
+static void
+segment_run_init(struct io_segment_t *seg)
 {
-    /* Arg management */
-    struct io_segment_t *seg = (struct io_segment_t *)arg;
     IO_DESC *src = machine_get_desc(seg->in);
     IO_DESC *dst = machine_get_desc(seg->out);
     IO_DESC *dst1 = machine_get_desc(seg->out1);
@@ -248,70 +453,154 @@ segment_run(void *arg)
         buflen = seg->default_buf_len;
     }
 
-    /* Initialization */
-    POOL *pool = create_pool();
-    char *buf = palloc(pool, buflen);
-    if (!buf) {
-        seg_error(seg, "Failed to allocate buffer");
-        SEGMENT_ERROR(seg);
+    seg->src = src;
+    seg->dst = dst;
+    seg->dst1 = dst1;
+    seg->buflen = buflen;
+
+    /* Initialization: the staging buffer is only allocated if it's needed */
+    seg->run_pool = bw_create_pool();
+    seg->buf = NULL;
+    seg->reserved = 0;
+
+    // Charged to the stream.  Hold budget for a staging buffer that will be needed.
+    bw_mem_link(seg->run_pool, seg->pool);
+    if (!machine_desc_can_borrow_read(src) && (dst1 || !machine_desc_can_borrow_write(dst))) {
+        if (bw_mem_reserve(seg->run_pool, buflen) == IO_SUCCESS) {
+            seg->reserved = buflen;
+        } else {
+            seg_warn(seg, "Staging buffer is over the memory budget");
+        }
     }
 
-    //pthread_mutex_lock(&seg->lock);
-    //gettimeofday(&seg->in_stats.t0, NULL);
-    //gettimeofday(&seg->out_stats.t0, NULL);
-    //pthread_mutex_unlock(&seg->lock);
-
     seg_trace(seg, "Starting segment");
+}
 
-    seg->running = 1;
-    while (seg->running) {
-        enum stream_state_e state = *seg->state;
-        if (STREAM_READY == state) {
-            continue;
-        }
+static void
+segment_run_fini(struct io_segment_t *seg)
+{
+    bw_free_pool(seg->run_pool);
+    seg->run_pool = NULL;
+    seg->buf = NULL;
+
+    SEGMENT_STOPPED(seg);
+}
+
+/*
+ * Move data from the input to the output(s), copying once per hop where the
+ * machines allow it:
+ *   - Borrowable source: its blocks are written directly to the output(s)
+ *   - Borrowable output: the source is read directly into its blocks
+ *   - Otherwise: the data is staged in a segment buffer
+ *
+ * Returns the bytes moved.  When nothing moved, *seqp is the source event
+ * count to wait on (NULL to poll).
+ */
+static size_t
+segment_step(struct io_segment_t *seg, uint32_t *seq, uint32_t **seqp)
+{
+    IO_DESC *src = seg->src;
+    IO_DESC *dst = seg->dst;
+    IO_DESC *dst1 = seg->dst1;
 
-        if (seg->do_complete) {
-            SEGMENT_COMPLETE(seg);
+    *seqp = NULL;
+
+    enum stream_state_e state = *seg->state;
+
+    if (seg->do_complete) {
+        SEGMENT_COMPLETE(seg);
+        stop_segment(seg);
+        return 0;
+    }
+
+    if (!STREAM_IS_RUNNING(state)) {
+        seg_trace(seg, "Stream stopped");
+        set_running(seg, 0);
+        return 0;
+    }
+
+    *seqp = (machine_desc_event_seq(src, seq) == IO_SUCCESS) ? seq : NULL;
+
+    if (machine_desc_can_borrow_read(src)) {
+        return forward_source_block(seg, src, dst, dst1, seqp);
+
+    } else if (!dst1 && machine_desc_can_borrow_write(dst)) {
+        return fill_dest_block(seg, src, dst, seg->buflen, seqp);
+    }
+
+    if (!seg->buf) {
+        bw_mem_unreserve(seg->run_pool, seg->reserved);
+        seg->reserved = 0;
+
+        seg->buf = bw_mem_alloc(seg->run_pool, seg->buflen, 0);
+        if (!seg->buf) {
+            seg_error(seg, "Failed to allocate buffer");
+            SEGMENT_ERROR(seg);
             stop_segment(seg);
-            continue;
+            return 0;
         }
+        bw_numa_place(seg->buf, seg->buflen, bw_numa_get_node());
+    }
+    return copy_through_buffer(seg, src, dst, dst1, seg->buf, seg->buflen);
+}
 
-        if (!STREAM_IS_RUNNING(state)) {
-            seg_trace(seg, "Stream stopped");
-            seg->running = 0;
-            continue;
-        }
+static void *
+segment_run(void *arg)
+{
+    /* Arg management */
+    struct io_segment_t *seg = (struct io_segment_t *)arg;
 
-        size_t bytes = buflen;
-        read_from_source(seg, src, buf, &bytes);
+    // Place the thread first, so its buffers are allocated on its node
+    if (seg->placed) {
+        bw_thread_apply(&seg->attr);
+    }
+    segment_run_init(seg);
 
-        if (bytes == 0) {
-            usleep(1000);
-            /*
-            if (*seg->state == STREAM_FINISHING) {
-                seg_trace(seg, "Source empty");
-                seg->running = 0;
-            }
-            */
-            continue;
-        }
+    wait_for_start(seg);
+    while (seg->running) {
+        uint32_t seq;
+        uint32_t *seqp;
+        size_t bytes = segment_step(seg, &seq, &seqp);
 
-        size_t src_bytes = bytes;
-        write_to_dest(seg, dst, buf, &bytes);
         if (bytes == 0) {
-            continue;
-        } else if (bytes != src_bytes) {
-            error("Partial write");
+            wait_for_data(seg, seg->src, seqp);
         }
+    }
+
+    segment_run_fini(seg);
+    pthread_exit(NULL);
+}
+
+/*
+ * Worker-pool task: run a few transfers, then give the worker back.  Instead
+ * of parking on an empty source, the segment yields.
+ */
+static int
+segment_task(void *arg)
+{
+    struct io_segment_t *seg = (struct io_segment_t *)arg;
 
-        if (seg->out1 > 0) {
-            bytes = src_bytes;
-            write_to_dest(seg, dst1, buf, &bytes);
+    int n = 0;
+    for (; n < SEGMENT_TASK_QUANTUM && seg->running; n++) {
+        uint32_t seq;
+        uint32_t *seqp;
+        if (segment_step(seg, &seq, &seqp) == 0) {
+            break;
         }
     }
 
-    free_pool(pool);
-    pthread_exit(NULL);
+    if (seg->running) {
+        return (n < SEGMENT_TASK_QUANTUM) ? SCHED_TASK_IDLE : SCHED_TASK_YIELD;
+    }
+
+    segment_run_fini(seg);
+
+    pthread_mutex_lock(&seg->lock);
+    seg->done = 1;
+    pthread_cond_broadcast(&seg->done_cond);
+    pthread_mutex_unlock(&seg->lock);
+
+    return SCHED_TASK_DONE;
 }
 
 void
@@ -330,26 +619,61 @@ segment_register_callback_error(void *segment, seg_callback fn, void *arg)
     s->error.arg = arg;
 }
 
+void
+segment_register_callback_stop(void *segment, seg_callback fn, void *arg)
+{
+    struct io_segment_t *s = (struct io_segment_t *)segment;
+    s->stop.fn = fn;
+    s->stop.arg = arg;
+}
+
+static void
+link_machine_mem(POOL *pool, IO_HANDLE h)
+{
+    IO_DESC *d = (h) ? machine_get_desc(h) : NULL;
+    if (d) {
+        bw_mem_link(d->pool, pool);
+    }
+}
+
 static IO_SEGMENT
 segment_create(POOL *pool, IO_HANDLE in, IO_HANDLE out, IO_HANDLE out1)
 {
     // Create a pool for the segment
-    POOL *p = create_subpool(pool);
+    POOL *p = bw_create_subpool(pool);
     struct io_segment_t *seg = pcalloc(pool, sizeof(struct io_segment_t));
 
     // Initialize segment
     pthread_mutex_init(&seg->lock, NULL);
+    pthread_cond_init(&seg->done_cond, NULL);
 
     pthread_mutex_lock(&seg->lock);
     seg->pool = pool;
     seg->in = in;
     seg->out = out;
     seg->out1 = out1;
+
+    // Buffer memory of the machines counts against the stream's budget
+    link_machine_mem(pool, in);
+    link_machine_mem(pool, out);
+    link_machine_mem(pool, out1);
     seg->id = segment_counter++;
     seg->group = &group;
     seg->gsep = "";
     seg->default_buf_len = SEGMENT_DEFAULT_BUFLEN;
     seg->fn = segment_run;
+    bw_thread_attr_init(&seg->attr);
+
+    if (!wait_policy_init) {
+        double v;
+        ENVEX_DOUBLE(v, "BW_SEGMENT_SPIN", (double)SEGMENT_DEFAULT_SPIN);
+        default_spin = (size_t)v;
+        ENVEX_DOUBLE(v, "BW_SEGMENT_PARK_US", (double)SEGMENT_DEFAULT_PARK_US);
+        default_park_us = (size_t)v;
+        wait_policy_init = 1;
+    }
+    seg->spin = default_spin;
+    seg->park_us = default_park_us;
 
     snprintf(seg->name, SEGMENT_NAME_LEN-1, "seg%d", seg->id);
 
@@ -376,26 +700,74 @@ segment_create_src(POOL *pool, IO_HANDLE src, IO_HANDLE *buf)
     IO_HANDLE src_buf = new_rb_machine();
 
     IO_SEGMENT seg = segment_create(pool, src, src_buf, 0);
-    struct io_segment_t *s = (struct io_segment_t *)seg;
-    s->fn = segment_run_source;
 
     *buf = src_buf;
     return seg;
 }
 
+/*
+ * Start the segment on its own thread, or queue it on the worker pool.
+ * Pooled segments don't wait on the start barrier (it would hold a worker),
+ * so the stream must be running before they start.
+ */
 void
-segment_start(IO_SEGMENT seg, enum stream_state_e *state)
+segment_start(IO_SEGMENT seg, enum stream_state_e *state, pthread_barrier_t *start)
 {
     struct io_segment_t *s = (struct io_segment_t *)seg;
     s->state = state;
-    pthread_create(&s->thread, NULL, s->fn, (void *)s);
+    s->start = start;
+
+    if (!s->pooled) {
+        pthread_create(&s->thread, NULL, s->fn, (void *)s);
+        return;
+    }
+
+    if (s->placed) {
+        seg_info(s, "Thread placement is ignored on the worker pool");
+    }
+
+    segment_run_init(s);
+    set_running(s, 1);
+
+    s->task.fn = segment_task;
+    s->task.arg = s;
+    if (sched_submit(&s->task) < IO_SUCCESS) {
+        seg_error(s, "Failed to schedule segment");
+        SEGMENT_ERROR(s);
+        stop_segment(s);
+        segment_task(s);
+    }
 }
 
 void
 segment_join(IO_SEGMENT seg)
 {
     struct io_segment_t *s = (struct io_segment_t *)seg;
-    pthread_join(s->thread, NULL);
+
+    if (!s->pooled) {
+        pthread_join(s->thread, NULL);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->done) {
+        pthread_cond_wait(&s->done_cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Run on the shared worker pool instead of a dedicated thread.  Set before
+ * the segment starts.
+ */
+void
+segment_set_pooled(IO_SEGMENT seg, int pooled)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+
+    pthread_mutex_lock(&s->lock);
+    s->pooled = (pooled) ? 1 : 0;
+    pthread_mutex_unlock(&s->lock);
 }
 
 static void
@@ -425,19 +797,27 @@ segment_print_metrics_internal(struct io_segment_t *seg, enum segment_direction_
         return;
     }
 
+    struct io_metrics_mem_t mem;
+    machine_metrics_get_mem(h, &mem);
+
+    char curstr[64];
+    char peakstr[64];
+    size_t_fmt(curstr, 64, mem.current);
+    size_t_fmt(peakstr, 64, mem.peak);
+
     // A segment's input is a machine's output, and visa versa
     char mstr[1024];
     switch (dir) {
     case SEG_DIR_IN:
         machine_metrics_fmt(&m->out, mstr, 1024,
             METRICS_FMT_TYPE_ONELINE | METRICS_CALC_TYPE_FULL);
-        seg_metrics(seg, "I: %s", mstr);
+        seg_metrics(seg, "I: %s, %sB mem (%sB peak)", mstr, curstr, peakstr);
         break;
     case SEG_DIR_OUT:
     case SEG_DIR_OUT1:
         machine_metrics_fmt(&m->in, mstr, 1024,
             METRICS_FMT_TYPE_ONELINE | METRICS_CALC_TYPE_FULL);
-        seg_metrics(seg, "O: %s", mstr);
+        seg_metrics(seg, "O: %s, %sB mem (%sB peak)", mstr, curstr, peakstr);
         break;
     default:
         break;
@@ -508,6 +888,45 @@ segment_set_name(IO_SEGMENT seg, char *name)
     snprintf(s->name, SEGMENT_NAME_LEN-1, "%s", name);
 }
 
+/*
+ * Thread placement.  Applied when the segment's thread starts.
+ */
+int
+segment_set_affinity(IO_SEGMENT seg, const int *cpus, int n_cpus)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+
+    pthread_mutex_lock(&s->lock);
+    int ret = bw_thread_attr_set_cpus(&s->attr, cpus, n_cpus);
+    s->placed = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+void
+segment_set_priority(IO_SEGMENT seg, int policy, int priority)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+
+    pthread_mutex_lock(&s->lock);
+    s->attr.policy = policy;
+    s->attr.priority = priority;
+    s->placed = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void
+segment_set_numa(IO_SEGMENT seg, int enable)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+
+    pthread_mutex_lock(&s->lock);
+    s->attr.numa = enable;
+    s->placed = 1;
+    pthread_mutex_unlock(&s->lock);
+}
+
 void
 segment_set_default_buflen(IO_SEGMENT seg, size_t len)
 {
@@ -518,6 +937,27 @@ segment_set_default_buflen(IO_SEGMENT seg, size_t len)
     pthread_mutex_unlock(&s->lock);
 }
 
+void
+segment_set_wait_policy(IO_SEGMENT seg, size_t spin, size_t park_us)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+
+    pthread_mutex_lock(&s->lock);
+    s->spin = spin;
+    s->park_us = park_us;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Wake a segment parked on its source
+ */
+void
+segment_wake(IO_SEGMENT seg)
+{
+    struct io_segment_t *s = (struct io_segment_t *)seg;
+    machine_notify(s->in);
+}
+
 void
 segment_enable_metrics(IO_SEGMENT seg)
 {
@@ -99,7 +99,7 @@ free_sock(struct sock_desc_t *sock) {
     }
 
     pthread_mutex_destroy(&sock->lock);
-    free_pool(sock->pool);
+    bw_free_pool(sock->pool);
 }
 
 // Free the sock descriptor 
@@ -244,7 +244,7 @@ tcp_write(IO_FILTER_ARGS)
 static enum io_status
 init_filters(struct sock_desc_t *sock)
 {
-    POOL *fpool = create_subpool(sock->pool);
+    POOL *fpool = bw_create_subpool(sock->pool);
 
     struct io_desc *d = NULL;
     d = (struct io_desc *)pcalloc(fpool, sizeof(struct io_desc));
@@ -300,7 +300,7 @@ init_filters(struct sock_desc_t *sock)
     return IO_SUCCESS;
 
 failure:
-    free_pool(fpool);
+    bw_free_pool(fpool);
     return IO_ERROR;
 }
 
@@ -309,7 +309,7 @@ create_sock(void *arg)
 {
     struct sockiom_args *args = (struct sockiom_args *)arg;
 
-    POOL *p = create_subpool(_socket_machine->alloc);
+    POOL *p = bw_create_subpool(_socket_machine->alloc);
     if (!p) {
         printf("ERROR: Failed to create memory pool\n");
         return 0;
@@ -318,7 +318,7 @@ create_sock(void *arg)
     struct sock_desc_t *sock = pcalloc(p, sizeof(struct sock_desc_t));
     if (!sock) {
         printf("ERROR: Failed to allocate %#zx bytes for sock descriptor\n", sizeof(struct sock_desc_t));
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
@@ -354,7 +354,7 @@ create_sock(void *arg)
 
     if (init_filters(sock) < IO_SUCCESS) {
         printf("ERROR: Failed to initialize filters\n");
-        free_pool(p);
+        bw_free_pool(p);
         return 0;
     }
 
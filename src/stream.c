@@ -1,5 +1,7 @@
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -10,6 +12,8 @@
 #include "segment.h"
 
 #include "simple-buffers.h"
+#include "bw-mem.h"
+#include "bw-util.h"
 
 #define LOGEX_TAG "BW-STREAM"
 #include "bw-log.h"
@@ -24,6 +28,9 @@ struct io_stream_t {
     // Thread variables
     pthread_t thread;           // Thread for stream state machine
     pthread_mutex_t lock;       // Stream lock (shared with segments)
+    pthread_cond_t cond;        // Signalled on every state change
+    pthread_barrier_t start;    // Releases all segments at once
+    int started;                // Stream thread has been created
 
     // State machine
     enum stream_state_e state;  // Stream state
@@ -39,10 +46,15 @@ struct io_stream_t {
     int segment_len;            // Segment entries
 
     enum stream_status_e status;
+    enum stream_scheduler_e scheduler;  // Threads or worker pool
 
     struct io_stream_t *next;   // Next stream in list
 } *streams = NULL;
 
+/*
+ * Change the stream state and wake anyone waiting on it.  Caller holds the
+ * stream lock.
+ */
 static void
 set_state(struct io_stream_t *stream, enum stream_state_e new_state)
 {
@@ -56,6 +68,15 @@ set_state(struct io_stream_t *stream, enum stream_state_e new_state)
         stream->name, STREAM_STATE_PRINT(stream->state), STREAM_STATE_PRINT(new_state));
 
     stream->state = new_state;
+    pthread_cond_broadcast(&stream->cond);
+
+    // Segments parked on their sources must see the stream stop
+    if (!STREAM_IS_RUNNING(new_state)) {
+        int s = 0;
+        for (; s < stream->n_segment; s++) {
+            segment_wake(stream->segments[s]);
+        }
+    }
 }
 
 static void
@@ -100,42 +121,88 @@ callback_error(void *arg)
     pthread_mutex_unlock(&stream->lock);
 }
 
+static void
+callback_stop(void *arg)
+{
+    // Wake the state machine so it can re-check running segments
+    struct io_stream_t *stream = (struct io_stream_t *)arg;
+    pthread_mutex_lock(&stream->lock);
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static int
+segments_running(struct io_stream_t *st)
+{
+    int s = 0;
+    for (; s < st->n_segment; s++) {
+        if (segment_is_running(st->segments[s])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void *
 main_state_machine(void *args)
 {
     struct io_stream_t *st = (struct io_stream_t *)args;
+    pthread_mutex_lock(&st->lock);
     set_state(st, STREAM_READY);
+    pthread_mutex_unlock(&st->lock);
 
-    // Start segments
     int s = 0;
-    for (; s < st->n_segment; s++) {
-        IO_SEGMENT seg = st->segments[s];
-        segment_start(seg, &st->state);
-    }
+    int pooled = (STREAM_SCHED_POOL == st->scheduler);
+
+    if (pooled) {
+        // Pooled segments can't block on a barrier, so run first, then start
+        pthread_mutex_lock(&st->lock);
+        if (STREAM_READY == st->state) {
+            set_state(st, STREAM_RUNNING);
+        }
+        pthread_mutex_unlock(&st->lock);
 
-    set_state(st, STREAM_RUNNING);
+        for (; s < st->n_segment; s++) {
+            IO_SEGMENT seg = st->segments[s];
+            segment_set_pooled(seg, 1);
+            segment_start(seg, &st->state, NULL);
+        }
+    } else {
+        // Start segments.  Each one blocks on the start barrier.
+        pthread_barrier_init(&st->start, NULL, st->n_segment + 1);
+
+        for (; s < st->n_segment; s++) {
+            IO_SEGMENT seg = st->segments[s];
+            segment_start(seg, &st->state, &st->start);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        if (STREAM_READY == st->state) {
+            set_state(st, STREAM_RUNNING);
+        }
+        pthread_mutex_unlock(&st->lock);
+
+        // Release the segments
+        pthread_barrier_wait(&st->start);
+    }
 
     // Wait for
     //  1) A segment to signal completion
     //  2) A segment to signal error
     //  3) A shutdown from the main thread
+    pthread_mutex_lock(&st->lock);
     while (STREAM_RUNNING == st->state) {
-        // TODO: Use condition
-        usleep(1000);
+        pthread_cond_wait(&st->cond, &st->lock);
     }
 
     // Wait for segments to complete final transactions
     if (STREAM_FINISHING == st->state) {
-        s = 0;
-        while (s < st->n_segment) {
-            IO_SEGMENT seg = st->segments[s];
-
-            if (!segment_is_running(seg)) {
-                trace("%s: Segment %d not running", st->name, s);
-                s++;
-            }
+        while (segments_running(st)) {
+            pthread_cond_wait(&st->cond, &st->lock);
         }
+        trace("%s: Segments not running", st->name);
     }
+    pthread_mutex_unlock(&st->lock);
 
     // Join stream segments
     for (s = 0; s < st->n_segment; s++) {
@@ -144,7 +211,13 @@ main_state_machine(void *args)
         segment_print_metrics(seg);
     }
 
+    if (!pooled) {
+        pthread_barrier_destroy(&st->start);
+    }
+
+    pthread_mutex_lock(&st->lock);
     set_state(st, STREAM_STOPPED);
+    pthread_mutex_unlock(&st->lock);
     pthread_exit(NULL);
 }
 
@@ -173,9 +246,10 @@ get_stream(IO_STREAM h)
 IO_STREAM
 new_stream()
 {
-    POOL *p = create_pool();
+    POOL *p = bw_create_pool();
     struct io_stream_t *stream = pcalloc(p, sizeof(struct io_stream_t));
     pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
 
     // Init stream struct
     pthread_mutex_lock(&stream->lock);
@@ -231,6 +305,7 @@ register_callbacks(struct io_stream_t *st, IO_SEGMENT seg)
 {
     segment_register_callback_complete(seg, callback_complete, st);
     segment_register_callback_error(seg, callback_error, st);
+    segment_register_callback_stop(seg, callback_stop, st);
 }
 
 static void
@@ -299,6 +374,69 @@ io_stream_add_tee_segment(IO_STREAM h, IO_HANDLE in, IO_HANDLE out, IO_HANDLE ou
     return 0;
 }
 
+/*
+ * Copy "in" to every handle in "out" through a broadcast ring, so the data is
+ * buffered once no matter how many outputs there are.
+ *   policy: BCAST_STALL (slowest output paces the stream) or BCAST_DROP
+ *   max_lag_bytes: how far a BCAST_DROP output may fall behind (0 = the ring)
+ */
+int
+io_stream_add_fanout_segment(IO_STREAM h, IO_HANDLE in, IO_HANDLE *out, int n_out,
+    int policy, size_t max_lag_bytes)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return 1;
+    }
+
+    if (n_out < 1) {
+        error("%s: Fanout needs at least one output", st->name);
+        return 1;
+    }
+
+    int ret = 1;
+    IO_HANDLE *readers = NULL;
+
+    IO_HANDLE ring = new_bcast_machine(0, 0);
+    if (!ring) {
+        error("%s: Failed to create broadcast ring", st->name);
+        return 1;
+    }
+
+    readers = calloc(n_out, sizeof(IO_HANDLE));
+    if (!readers) {
+        error("%s: Failed to allocate broadcast readers", st->name);
+        goto free_and_return;
+    }
+
+    // Readers start at the writer's position, so add them before any data
+    int i = 0;
+    for (; i < n_out; i++) {
+        readers[i] = bcast_add_reader(ring, policy, max_lag_bytes);
+        if (!readers[i]) {
+            error("%s: Failed to create broadcast reader", st->name);
+            goto free_and_return;
+        }
+    }
+
+    for (i = 0; i < n_out; i++) {
+        create_segment_1_1(st, readers[i], out[i]);
+    }
+    create_segment_1_1(st, in, ring);
+
+    ret = 0;
+
+free_and_return:
+    // Destroying the ring takes its readers with it
+    if (ret != 0) {
+        bcast_machine->destroy(ring);
+    }
+    free(readers);
+    return ret;
+}
+
 int
 start_stream(IO_STREAM h)
 {
@@ -310,7 +448,10 @@ start_stream(IO_STREAM h)
     }
 
     // Run the stream as its own thread
+    pthread_mutex_lock(&st->lock);
+    st->started = 1;
     pthread_create(&st->thread, NULL, main_state_machine, (void *)st);
+    pthread_mutex_unlock(&st->lock);
     return IO_SUCCESS;
 }
 
@@ -343,37 +484,43 @@ stream_get_status(IO_STREAM h)
 static void
 stop_stream_internal(struct io_stream_t *st)
 {
+    pthread_mutex_lock(&st->lock);
     trace("%s: Stopping stream (state == %s)", st->name, STREAM_STATE_PRINT(st->state));
     while (1) {
         switch (st->state) {
         // wait for stream to start running
         case STREAM_INIT:
+            if (!st->started) {
+                set_state(st, STREAM_DONE);
+                break;
+            }
         case STREAM_READY:
-            // TODO: Use condition
-            usleep(1000);
+            pthread_cond_wait(&st->cond, &st->lock);
             continue;
 
         // send completion signal to the stream
         case STREAM_RUNNING:
         case STREAM_FINISHING:
             set_state(st, STREAM_DONE);
-            return;
+            break;
 
         case STREAM_DONE:
-            return;
+            break;
 
         case STREAM_STATE_ERROR:
             error("%s: Error during STOP command", st->name);
             st->status = STREAM_ERROR_STOP_FAILURE;
-            return;
+            break;
 
         case STREAM_STOPPED:
             warn("%s: Stream already stopped", st->name);
 
         default:
-            return;
+            break;
         }
+        break;
     }
+    pthread_mutex_unlock(&st->lock);
 }
 
 /*
@@ -421,7 +568,9 @@ stream_cleanup()
     // Wait for streams to complete
     struct io_stream_t *st = streams;
     while (st) {
-        pthread_join(st->thread, NULL);
+        if (st->started) {
+            pthread_join(st->thread, NULL);
+        }
 
         int s = 0;
         for (; s < st->n_segment; s++) {
@@ -431,7 +580,7 @@ stream_cleanup()
         
         void *destroy_me = st->pool;
         st = st->next;
-        free_pool(destroy_me);
+        bw_free_pool(destroy_me);
     }
 
     streams = NULL;
@@ -468,6 +617,153 @@ stream_set_default_buflen(IO_STREAM h, size_t len)
     }
 }
 
+/*
+ * Set how long segments spin, then park, when their source is empty
+ */
+void
+stream_set_wait_policy(IO_STREAM h, size_t spin, size_t park_us)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return;
+    }
+
+    int s = 0;
+    for (; s < st->n_segment; s++) {
+        IO_SEGMENT seg = st->segments[s];
+        segment_set_wait_policy(seg, spin, park_us);
+    }
+}
+
+/*
+ * Run the stream's segments on dedicated threads (default), or as tasks on a
+ * shared pool of worker threads.  Pooled segments yield instead of parking
+ * when their source is empty.  Set before the stream starts.
+ */
+void
+stream_set_scheduler(IO_STREAM h, int sched)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return;
+    }
+
+    pthread_mutex_lock(&st->lock);
+    if (STREAM_INIT != st->state) {
+        warn("%s: Scheduler must be set before the stream starts", st->name);
+    } else {
+        st->scheduler = (STREAM_SCHED_POOL == sched) ? STREAM_SCHED_POOL : STREAM_SCHED_THREAD;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+int
+stream_get_segment_count(IO_STREAM h)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return 0;
+    }
+
+    return st->n_segment;
+}
+
+/*
+ * Thread placement.  "segment" is the index of the segment in the order it was
+ * added (a src segment adds two), or STREAM_ALL_SEGMENTS.  Set before the
+ * stream starts.
+ */
+static int
+segment_range(struct io_stream_t *st, int segment, int *first, int *last)
+{
+    if (STREAM_ALL_SEGMENTS == segment) {
+        *first = 0;
+        *last = st->n_segment;
+        return IO_SUCCESS;
+    }
+
+    if (segment < 0 || segment >= st->n_segment) {
+        error("%s: Segment %d not found", st->name, segment);
+        return IO_ERROR;
+    }
+
+    *first = segment;
+    *last = segment + 1;
+    return IO_SUCCESS;
+}
+
+int
+stream_set_affinity(IO_STREAM h, int segment, const int *cpus, int n_cpus)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return IO_ERROR;
+    }
+
+    int s, last;
+    if (segment_range(st, segment, &s, &last) < IO_SUCCESS) {
+        return IO_ERROR;
+    }
+
+    for (; s < last; s++) {
+        IO_SEGMENT seg = st->segments[s];
+        if (segment_set_affinity(seg, cpus, n_cpus) < IO_SUCCESS) {
+            return IO_ERROR;
+        }
+    }
+    return IO_SUCCESS;
+}
+
+int
+stream_set_priority(IO_STREAM h, int segment, int policy, int priority)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return IO_ERROR;
+    }
+
+    int s, last;
+    if (segment_range(st, segment, &s, &last) < IO_SUCCESS) {
+        return IO_ERROR;
+    }
+
+    for (; s < last; s++) {
+        IO_SEGMENT seg = st->segments[s];
+        segment_set_priority(seg, policy, priority);
+    }
+    return IO_SUCCESS;
+}
+
+/*
+ * Allocate each segment's buffers on the NUMA node of its pinned CPUs
+ */
+void
+stream_set_numa(IO_STREAM h, int enable)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return;
+    }
+
+    int s = 0;
+    for (; s < st->n_segment; s++) {
+        IO_SEGMENT seg = st->segments[s];
+        segment_set_numa(seg, enable);
+    }
+}
+
 void
 stream_enable_metrics(IO_STREAM h)
 {
@@ -500,6 +796,47 @@ stream_print_metrics(IO_STREAM h)
         IO_SEGMENT seg = st->segments[s];
         segment_print_metrics(seg);
     }
+
+    struct io_metrics_mem_t mem;
+    stream_get_mem(h, &mem);
+
+    char curstr[64];
+    char peakstr[64];
+    char resstr[64];
+    size_t_fmt(curstr, 64, mem.current);
+    size_t_fmt(peakstr, 64, mem.peak);
+    size_t_fmt(resstr, 64, mem.reserved);
+    info("%s: %sB mem (%sB peak, %sB reserved)", st->name, curstr, peakstr, resstr);
+}
+
+/*
+ * Cap the buffer memory of the stream's machines and segments (0: none).
+ * Allocations past the cap are refused, as if memory had run out.
+ */
+void
+stream_set_mem_limit(IO_STREAM h, size_t bytes)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        error("Stream %d not found", h);
+        return;
+    }
+
+    bw_mem_set_pool_limit(st->pool, bytes);
+}
+
+void
+stream_get_mem(IO_STREAM h, struct io_metrics_mem_t *mem)
+{
+    // Get stream from handle
+    struct io_stream_t *st = get_stream(h);
+    if (!st) {
+        memset(mem, 0, sizeof(struct io_metrics_mem_t));
+        return;
+    }
+
+    bw_mem_get_usage(st->pool, mem);
 }
 
 void
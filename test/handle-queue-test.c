@@ -1,3 +1,5 @@
+#include <string.h>
+#include <unistd.h>
 #include <testex.h>
 
 #include "simple-buffers.h"
@@ -58,6 +60,173 @@ testex_return:
     return ret;
 }
 
+int
+entry_test()
+{
+    int ret = TESTEX_FAILURE;
+
+    IO_HANDLE h = new_hq_machine();
+
+    // Ownership transfer: the reader gets the producer's buffer
+    HQ_ENTRY e;
+    ASSERT_SUCCESS(hq_entry_alloc(h, 1000, &e));
+    memset(e.buf, 0x5a, 1000);
+    void *buf = e.buf;
+    ASSERT_SUCCESS(hq_write_entry(h, &e));
+
+    HQ_ENTRY r;
+    size_t bytes = sizeof(HQ_ENTRY);
+    ASSERT_SUCCESS(hq_machine->read(h, &r, &bytes));
+    ASSERT_EQUAL(bytes, sizeof(HQ_ENTRY));
+    ASSERT_EQUAL(r.buf, buf);
+    ASSERT_EQUAL(r.bytes, 1000);
+    ASSERT_EQUAL(((char *)r.buf)[999], 0x5a);
+
+    // Released buffers are recycled for entries of the same size class
+    hq_entry_release(&r);
+    bytes = 700;
+    ASSERT_SUCCESS(hq_machine->write(h, buf, &bytes));
+    bytes = sizeof(HQ_ENTRY);
+    hq_machine->read(h, &r, &bytes);
+    ASSERT_EQUAL(r.buf, buf);
+    ASSERT_EQUAL(r.bytes, 700);
+    hq_entry_release(&r);
+
+    // Entries too big for the slab get their own pool
+    ASSERT_SUCCESS(hq_entry_alloc(h, 4*MB, &e));
+    ASSERT_NOT_EQUAL(e.pool, NULL);
+    hq_entry_release(&e);
+    ASSERT_EQUAL(e.buf, NULL);
+
+    ret = TESTEX_SUCCESS;
+
+testex_return:
+    hq_machine->destroy(h);
+    return ret;
+}
+
+static int
+push_at(IO_HANDLE h, struct timeval *base, long us)
+{
+    HQ_ENTRY e;
+    if (hq_entry_alloc(h, sizeof(long), &e) != IO_SUCCESS) {
+        return IO_ERROR;
+    }
+
+    *(long *)e.buf = us;
+    e.tv = *base;
+    e.tv.tv_usec += us;
+    return hq_write_entry(h, &e);
+}
+
+static long
+pop_us(IO_HANDLE h)
+{
+    HQ_ENTRY e;
+    size_t bytes = sizeof(HQ_ENTRY);
+    if (hq_machine->read(h, &e, &bytes) != IO_SUCCESS || bytes == 0) {
+        return -1;
+    }
+
+    long us = *(long *)e.buf;
+    hq_entry_release(&e);
+    return us;
+}
+
+int
+priority_test()
+{
+    int ret = TESTEX_FAILURE;
+
+    // 1ms reorder window, entries held for at most 50ms
+    IO_HANDLE h = new_hq_priority_machine(1000, 50);
+    struct timeval base = {1000, 0};
+
+    ASSERT_SUCCESS(push_at(h, &base, 3000));
+    ASSERT_SUCCESS(push_at(h, &base, 1000));
+    ASSERT_SUCCESS(push_at(h, &base, 2000));
+
+    // Entries a full window behind the newest come out in order
+    ASSERT_EQUAL(pop_us(h), 1000);
+    ASSERT_EQUAL(pop_us(h), 2000);
+    ASSERT_EQUAL(pop_us(h), -1);
+
+    // The newest is released by the latency limit
+    usleep(60000);
+    ASSERT_EQUAL(pop_us(h), 3000);
+
+    // Stopping drains everything, in order
+    long i = 0;
+    for (; i < 600; i++) {
+        ASSERT_SUCCESS(push_at(h, &base, 10000 + ((i * 7919) % 600)));
+    }
+    hq_machine->stop(h);
+    for (i = 0; i < 600; i++) {
+        ASSERT_EQUAL(pop_us(h), 10000 + i);
+    }
+    ASSERT_EQUAL(pop_us(h), -1);
+
+    ret = TESTEX_SUCCESS;
+
+testex_return:
+    hq_machine->destroy(h);
+    return ret;
+}
+
+int
+batch_test()
+{
+    int ret = TESTEX_FAILURE;
+
+    IO_HANDLE h = new_hq_machine();
+    machine_metrics_enable(h);
+
+    HQ_ENTRY e[64];
+    size_t i = 0;
+    for (; i < 64; i++) {
+        ASSERT_SUCCESS(hq_entry_alloc(h, sizeof(size_t), &e[i]));
+        *(size_t *)e[i].buf = i;
+    }
+
+    size_t n = 64;
+    ASSERT_SUCCESS(hq_write_entries(h, e, &n));
+    ASSERT_EQUAL(n, 64);
+
+    // Batches come out in FIFO order, and stop short when the queue is empty
+    HQ_ENTRY r[48];
+    n = 48;
+    ASSERT_SUCCESS(hq_read_entries(h, r, &n));
+    ASSERT_EQUAL(n, 48);
+    for (i = 0; i < n; i++) {
+        ASSERT_EQUAL(*(size_t *)r[i].buf, i);
+        hq_entry_release(&r[i]);
+    }
+
+    n = 48;
+    ASSERT_SUCCESS(hq_read_entries(h, r, &n));
+    ASSERT_EQUAL(n, 16);
+    for (i = 0; i < n; i++) {
+        ASSERT_EQUAL(*(size_t *)r[i].buf, 48 + i);
+        hq_entry_release(&r[i]);
+    }
+
+    struct io_metrics_entries_t count;
+    machine_metrics_get_entries(machine_metrics(h), &count);
+    ASSERT_EQUAL(count.in, 64);
+    ASSERT_EQUAL(count.out, 64);
+
+    hq_machine->stop(h);
+    n = 48;
+    ASSERT_EQUAL(hq_read_entries(h, r, &n), IO_COMPLETE);
+    ASSERT_EQUAL(n, 0);
+
+    ret = TESTEX_SUCCESS;
+
+testex_return:
+    hq_machine->destroy(h);
+    return ret;
+}
+
 int
 main(int nargs, char *argv[])
 {
@@ -65,6 +234,9 @@ main(int nargs, char *argv[])
     testex_setup();
 
     testex_add(basic_test);
+    testex_add(entry_test);
+    testex_add(priority_test);
+    testex_add(batch_test);
 
     testex_run();
     testex_cleanup();
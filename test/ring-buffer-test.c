@@ -1,7 +1,17 @@
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
 
 #include "machine.h"
 #include "simple-buffers.h"
+#include "block-list-buffer.h"
+#include "ring-buf.h"
+#include "bw-mem.h"
+#include "bw-copy.h"
 #include "test.h"
 #include "logging.h"
 
@@ -56,6 +66,117 @@ do_return:
     return ret;
 }
 
+int
+partial_read_test()
+{
+    int ret = 1;
+
+    size_t bytes = 1*MB;
+    char *data = malloc(bytes);
+    char *out = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 13 + 1);
+    }
+
+    IO_HANDLE h = new_rb_machine();
+    if (h == 0) {
+        goto do_return;
+    }
+
+    size_t b = bytes;
+    rb_machine->write(h, data, &b);
+
+    // Small reads walk the read offset through each block
+    size_t off = 0;
+    while (off < bytes) {
+        b = 1000;
+        rb_machine->read(h, out + off, &b);
+        if (b == 0) {
+            break;
+        }
+        off += b;
+    }
+
+    if (off != bytes || memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    if (rb_get_bytes(h) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    rb_machine->stop(h);
+    rb_machine->destroy(h);
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+borrow_test()
+{
+    int ret = 1;
+
+    size_t bytes = 4*KB;
+    char *data = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)i;
+    }
+
+    IO_HANDLE h = new_rb_machine();
+    IO_DESC *d = machine_get_desc(h);
+    if (!machine_desc_can_borrow_read(d) || !machine_desc_can_borrow_write(d)) {
+        goto do_return;
+    }
+
+    // Borrow a write block and fill it in place
+    struct __block_t *b;
+    if (machine_desc_acquire_write_block(d, bytes, &b) != IO_SUCCESS || b->size < bytes) {
+        goto do_return;
+    }
+    memcpy(b->data, data, bytes);
+    machine_desc_commit_write_block(d, b, bytes);
+
+    if (rb_get_bytes(h) != bytes) {
+        goto do_return;
+    }
+
+    // Consume half of a borrowed read block, then the rest
+    if (machine_desc_acquire_read_block(d, 0, &b) != IO_SUCCESS) {
+        goto do_return;
+    }
+    if (BLOCK_UNREAD(b) != bytes || memcmp(b->data + b->offset, data, bytes) != 0) {
+        machine_desc_release_read_block(d, b, 0);
+        goto do_return;
+    }
+    machine_desc_release_read_block(d, b, bytes / 2);
+
+    if (machine_desc_acquire_read_block(d, 0, &b) != IO_SUCCESS) {
+        goto do_return;
+    }
+    if (BLOCK_UNREAD(b) != bytes / 2 || memcmp(b->data + b->offset, data + bytes / 2, bytes / 2) != 0) {
+        machine_desc_release_read_block(d, b, 0);
+        goto do_return;
+    }
+    machine_desc_release_read_block(d, b, bytes / 2);
+
+    // Drained
+    if (machine_desc_acquire_read_block(d, 0, &b) != IO_NODATA || b != NULL) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    rb_machine->stop(h);
+    rb_machine->destroy(h);
+    free(data);
+    return ret;
+}
+
 int
 realloc_test()
 {
@@ -177,6 +298,1415 @@ do_return:
     return ret;
 }
 
+int
+stale_handle_test()
+{
+    int ret = 1;
+    IO_HANDLE h1 = 0;
+
+    IO_HANDLE h0 = new_rb_machine();
+    if (h0 == 0) {
+        goto do_return;
+    }
+    rb_machine->destroy(h0);
+
+    // Destroyed handles must not resolve, even when the slot is reused
+    h1 = new_rb_machine();
+    if (h1 == 0 || h1 == h0) {
+        goto do_return;
+    }
+
+    if (get_machine_ref(h0) || machine_get_desc(h0)) {
+        goto do_return;
+    }
+
+    if (get_machine_ref(h1) != rb_machine) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    rb_machine->destroy(h1);
+    return ret;
+}
+
+struct spsc_test_args {
+    IO_HANDLE h;
+    char *data;
+    size_t bytes;
+};
+
+static void *
+spsc_producer(void *arg)
+{
+    struct spsc_test_args *a = (struct spsc_test_args *)arg;
+
+    size_t off = 0;
+    while (off < a->bytes) {
+        size_t b = a->bytes - off;
+        if (b > 100000) {
+            b = 100000;
+        }
+        spsc_machine->write(a->h, a->data + off, &b);
+        off += b;
+    }
+
+    spsc_machine->stop(a->h);
+    return NULL;
+}
+
+int
+spsc_test()
+{
+    int ret = 1;
+
+    size_t bytes = 16*MB;
+    char *data = malloc(bytes);
+    char *out = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 31 + 7);
+    }
+
+    IO_HANDLE h = new_spsc_machine(1*MB, 64*KB);
+    if (h == 0) {
+        goto do_return;
+    }
+
+    struct spsc_test_args args = {h, data, bytes};
+    pthread_t producer;
+    pthread_create(&producer, NULL, spsc_producer, &args);
+
+    // Odd-sized reads exercise partial block consumption
+    size_t off = 0;
+    int rc = IO_SUCCESS;
+    while (rc == IO_SUCCESS && off < bytes) {
+        size_t b = 77777;
+        if (b > bytes - off) {
+            b = bytes - off;
+        }
+        rc = spsc_machine->read(h, out + off, &b);
+        off += b;
+    }
+
+    pthread_join(producer, NULL);
+
+    if (off != bytes || memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    // Drained and stopped
+    size_t b = bytes;
+    if (spsc_machine->read(h, out, &b) != IO_COMPLETE || b != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    spsc_machine->destroy(h);
+    free(data);
+    free(out);
+    return ret;
+}
+
+struct bcast_test_args {
+    IO_HANDLE h;
+    char *data;
+    size_t bytes;
+    size_t got;
+    int same;
+};
+
+static void *
+bcast_writer(void *arg)
+{
+    struct bcast_test_args *a = (struct bcast_test_args *)arg;
+
+    size_t off = 0;
+    while (off < a->bytes) {
+        size_t b = a->bytes - off;
+        if (b > 64*KB) {
+            b = 64*KB;
+        }
+        bcast_machine->write(a->h, a->data + off, &b);
+        off += b;
+    }
+
+    bcast_machine->stop(a->h);
+    return NULL;
+}
+
+static void *
+bcast_reader(void *arg)
+{
+    struct bcast_test_args *a = (struct bcast_test_args *)arg;
+    char *out = malloc(a->bytes);
+
+    size_t off = 0;
+    int rc = IO_SUCCESS;
+    while (rc == IO_SUCCESS && off < a->bytes) {
+        size_t b = 77777;
+        if (b > a->bytes - off) {
+            b = a->bytes - off;
+        }
+        rc = bcast_machine->read(a->h, out + off, &b);
+        off += b;
+    }
+
+    // Drained and stopped
+    size_t b = a->bytes;
+    rc = bcast_machine->read(a->h, out, &b);
+
+    a->got = off;
+    a->same = (rc == IO_COMPLETE && memcmp(a->data, out, a->bytes) == 0);
+
+    free(out);
+    return NULL;
+}
+
+int
+broadcast_test()
+{
+    int ret = 1;
+
+    size_t bytes = 16*MB;
+    char *data = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 13 + 5);
+    }
+
+    IO_HANDLE h = new_bcast_machine(1*MB, 64*KB);
+    if (h == 0) {
+        goto do_return;
+    }
+
+    // Two readers that see everything, and one that never reads
+    struct bcast_test_args r0 = {bcast_add_reader(h, BCAST_STALL, 0), data, bytes};
+    struct bcast_test_args r1 = {bcast_add_reader(h, BCAST_STALL, 0), data, bytes};
+    IO_HANDLE idle = bcast_add_reader(h, BCAST_DROP, 256*KB);
+    if (!r0.h || !r1.h || !idle) {
+        goto do_return;
+    }
+
+    struct bcast_test_args w = {h, data, bytes};
+    pthread_t writer, reader0, reader1;
+    pthread_create(&reader0, NULL, bcast_reader, &r0);
+    pthread_create(&reader1, NULL, bcast_reader, &r1);
+    pthread_create(&writer, NULL, bcast_writer, &w);
+
+    pthread_join(writer, NULL);
+    pthread_join(reader0, NULL);
+    pthread_join(reader1, NULL);
+
+    if (r0.got != bytes || !r0.same || r1.got != bytes || !r1.same) {
+        goto do_return;
+    }
+
+    // The idle reader skips ahead to within 256 KB of the end
+    size_t b = bytes;
+    char *out = malloc(bytes);
+    bcast_machine->read(idle, out, &b);
+    int same = (memcmp(data + bytes - b, out, b) == 0);
+    free(out);
+
+    if (b != 256*KB || !same) {
+        goto do_return;
+    }
+
+    if (bcast_get_dropped(idle) != (bytes - 256*KB) / (64*KB)) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    bcast_machine->destroy(h);
+    free(data);
+    return ret;
+}
+
+int
+mirror_test()
+{
+    int ret = 1;
+
+    size_t size = 1*MB;
+    size_t bytes = 16*MB;
+    char *data = malloc(bytes);
+    char *out = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 11 + 3);
+    }
+
+    IO_HANDLE h = new_mirror_machine(size);
+    if (h == 0 || mirror_get_size(h) != size) {
+        goto do_return;
+    }
+
+    // Move the cursors near the end, so the next span wraps
+    size_t b = size - 1000;
+    mirror_machine->write(h, data, &b);
+    mirror_machine->read(h, out, &b);
+    if (b != size - 1000) {
+        goto do_return;
+    }
+
+    // A wrapped span reads back as one contiguous range, in place
+    b = 5000;
+    mirror_machine->write(h, data, &b);
+
+    const void *ptr;
+    size_t avail;
+    if (mirror_acquire_read(h, &ptr, &avail) != IO_SUCCESS || avail != 5000) {
+        goto do_return;
+    }
+    if (memcmp(ptr, data, 5000) != 0) {
+        goto do_return;
+    }
+    mirror_release_read(h, 5000);
+
+    // Full capacity fits, one more byte doesn't
+    void *wptr;
+    if (mirror_acquire_write(h, &wptr, &avail) != IO_SUCCESS || avail != size) {
+        goto do_return;
+    }
+    memcpy(wptr, data, size);
+    mirror_commit_write(h, size);
+
+    b = 1;
+    mirror_machine->write(h, data, &b);
+    if (b != 0 || mirror_get_bytes(h) != size) {
+        goto do_return;
+    }
+
+    b = bytes;
+    mirror_machine->read(h, out, &b);
+    if (b != size || memcmp(out, data, size) != 0) {
+        goto do_return;
+    }
+
+    // Odd-sized reads and writes through the generic interface
+    size_t woff = 0;
+    size_t roff = 0;
+    while (roff < bytes) {
+        size_t w = bytes - woff;
+        w = (w > 77777) ? 77777 : w;
+        mirror_machine->write(h, data + woff, &w);
+        woff += w;
+
+        size_t r = 55555;
+        mirror_machine->read(h, out + roff, &r);
+        roff += r;
+    }
+
+    if (memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    // Drained and stopped
+    mirror_machine->stop(h);
+    b = bytes;
+    if (mirror_machine->read(h, out, &b) != IO_COMPLETE || b != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    mirror_machine->destroy(h);
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+alloc_flags_test()
+{
+    int ret = 1;
+
+    size_t bytes = 4*MB;
+    char *data = malloc(bytes);
+    char *out = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 5 + 1);
+    }
+
+    // Allocated up front; huge pages and mlock fall back quietly
+    uint32_t flags = BF_HUGEPAGE | BF_PREFAULT | BF_MLOCK;
+    IO_HANDLE h = new_rb_machine_flags(8*MB, 1*MB, flags);
+    IO_HANDLE f = new_fbb_machine_flags(8*MB, 1*MB, flags);
+    if (h == 0 || f == 0) {
+        goto do_return;
+    }
+
+    if (rb_get_size(h) < 8*MB) {
+        goto do_return;
+    }
+
+    size_t b = bytes;
+    rb_machine->write(h, data, &b);
+    b = bytes;
+    rb_machine->read(h, out, &b);
+    if (b != bytes || memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    // One block at a time
+    memset(out, 0, bytes);
+    for (size_t off = 0; off < bytes; off += MB) {
+        b = MB;
+        fbb_machine->write(f, data + off, &b);
+        b = MB;
+        fbb_machine->read(f, out + off, &b);
+        if (b != MB) {
+            goto do_return;
+        }
+    }
+
+    if (memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    rb_machine->destroy(h);
+    fbb_machine->destroy(f);
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+reclaim_test()
+{
+    int ret = 1;
+
+    size_t chunk = 1*MB;
+    char *data = malloc(chunk);
+    char *out = malloc(chunk);
+    memset(data, 0x5a, chunk);
+
+    // 2 blocks up front, growing to an 8 MB cap
+    const IOM *m = get_rb_machine();
+    struct rbiom_args args = {2*MB, 1*MB, 0, 8*MB, 20};
+    IO_HANDLE h = m->create(&args);
+    if (h == 0) {
+        goto do_return;
+    }
+
+    // Fill until the cap holds writes back (one block always stays free)
+    size_t filled = 0;
+    while (filled < 16*MB) {
+        size_t b = chunk;
+        int status = m->write(h, data, &b);
+        if (b == 0) {
+            if (status != IO_NODATA) {
+                goto do_return;
+            }
+            break;
+        }
+        filled += b;
+    }
+
+    if (filled != 7*MB || rb_get_size(h) != 8*MB) {
+        goto do_return;
+    }
+
+    while (filled) {
+        size_t b = chunk;
+        m->read(h, out, &b);
+        if (b == 0) {
+            goto do_return;
+        }
+        filled -= b;
+    }
+
+    // Light traffic after the burst: the expansion is released
+    int i = 0;
+    for (; i < 50 && rb_get_size(h) > 2*MB; i++) {
+        usleep(25000);
+
+        size_t b = chunk;
+        m->write(h, data, &b);
+        b = chunk;
+        m->read(h, out, &b);
+        if (b != chunk || memcmp(data, out, chunk) != 0) {
+            goto do_return;
+        }
+    }
+
+    if (rb_get_size(h) != 2*MB) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    m->destroy(h);
+    free(data);
+    free(out);
+    return ret;
+}
+
+static int
+overflow_check(const IOM *m, IO_HANDLE h, enum bf_overflow_e policy, char *data, char *out)
+{
+    // 4 blocks hold 3 records; 5 are written
+    size_t i = 0;
+    for (; i < 5; i++) {
+        size_t b = MB;
+        m->write(h, data + i*MB, &b);
+        if (b != MB) {
+            return 1;
+        }
+    }
+
+    size_t first = (policy == BF_OVERFLOW_DROP_OLDEST) ? 2 : 0;
+    for (i = first; i < first + 3; i++) {
+        size_t b = MB;
+        m->read(h, out, &b);
+        if (b != MB || memcmp(out, data + i*MB, MB) != 0) {
+            return 1;
+        }
+    }
+
+    struct io_metrics_drop_t drop;
+    machine_metrics_get_drop(m->metrics(h), &drop);
+    if (drop.bytes != 2*MB || drop.blocks != 2) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+overflow_test()
+{
+    int ret = 1;
+
+    char *data = malloc(5*MB);
+    char *out = malloc(MB);
+    for (size_t i = 0; i < 5*MB; i++) {
+        data[i] = (char)(i / MB + 1);
+    }
+
+    enum bf_overflow_e policy[] = {
+        BF_OVERFLOW_DROP_NEWEST,
+        BF_OVERFLOW_DROP_OLDEST,
+        BF_OVERFLOW_BLOCK,
+    };
+
+    int i = 0;
+    for (; i < 3; i++) {
+        IO_HANDLE h = new_rb_machine_flags(4*MB, 1*MB, 0);
+        rb_set_overflow(h, policy[i], 10);
+        int rc = overflow_check(rb_machine, h, policy[i], data, out);
+        rb_machine->destroy(h);
+
+        IO_HANDLE f = new_fbb_machine(4*MB, 1*MB);
+        fbb_set_overflow(f, policy[i], 10);
+        rc |= overflow_check(fbb_machine, f, policy[i], data, out);
+        fbb_machine->destroy(f);
+
+        if (rc) {
+            goto do_return;
+        }
+    }
+
+    ret = 0;
+
+do_return:
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+spill_test()
+{
+    int ret = 1;
+
+    size_t n = 10;
+    char *data = malloc(n*MB);
+    char *out = malloc(n*MB);
+    for (size_t i = 0; i < n*MB; i++) {
+        data[i] = (char)(i * 3 + i / MB);
+    }
+
+    // 4 blocks hold 3 MB; the rest goes to the spill file
+    IO_HANDLE h = new_rb_machine_flags(4*MB, 1*MB, 0);
+    if (h == 0 || rb_set_spill(h, NULL) != IO_SUCCESS) {
+        goto do_return;
+    }
+
+    size_t i = 0;
+    for (; i < n; i++) {
+        size_t b = MB;
+        rb_machine->write(h, data + i*MB, &b);
+        if (b != MB) {
+            goto do_return;
+        }
+    }
+
+    if (rb_get_spilled(h) != (n - 3)*MB || rb_get_size(h) != 4*MB) {
+        goto do_return;
+    }
+
+    // Spilled data is paged back in, in order, through the flush
+    rb_machine->stop(h);
+
+    size_t got = 0;
+    while (got < n*MB) {
+        size_t b = n*MB - got;
+        rb_machine->read(h, out + got, &b);
+        if (b == 0) {
+            break;
+        }
+        got += b;
+    }
+
+    if (got != n*MB || memcmp(data, out, n*MB) != 0 || rb_get_spilled(h) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    rb_machine->destroy(h);
+    free(data);
+    free(out);
+    return ret;
+}
+
+static int
+meta_check(const IOM *m, IO_HANDLE h, size_t rdlen, char *data, char *out)
+{
+    struct block_meta_t meta;
+    memset(&meta, 0, sizeof(struct block_meta_t));
+    meta.flags = BLOCK_META_VALID | BLOCK_META_TIME;
+    meta.time_ns = 1000;
+    meta.sample_rate = 1e6;
+    meta.sample_bytes = 8;
+    meta.source_id = 7;
+    if (machine_set_write_meta(h, &meta) != IO_SUCCESS) {
+        return 1;
+    }
+
+    size_t i = 0;
+    for (; i < 2; i++) {
+        size_t b = MB;
+        m->write(h, data + i*MB, &b);
+        if (b != MB) {
+            return 1;
+        }
+    }
+
+    // Each read reports the sample index and time of its first byte
+    for (i = 0; i < 2*MB / rdlen; i++) {
+        size_t b = rdlen;
+        m->read(h, out, &b);
+        if (b != rdlen || machine_get_read_meta(h, &meta) != IO_SUCCESS) {
+            return 1;
+        }
+
+        uint64_t index = i * rdlen / 8;
+        if (!(meta.flags & BLOCK_META_VALID) || meta.source_id != 7 ||
+                meta.sample_index != index || meta.time_ns != 1000 + index * 1000) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+meta_test()
+{
+    int ret = 1;
+
+    char *data = calloc(2*MB, 1);
+    char *out = malloc(MB);
+
+    IO_HANDLE h = new_rb_machine(4*MB, 1*MB);
+    int rc = meta_check(rb_machine, h, MB/2, data, out);
+    rb_machine->destroy(h);
+
+    IO_HANDLE f = new_fbb_machine(4*MB, 1*MB);
+    rc |= meta_check(fbb_machine, f, MB, data, out);
+    fbb_machine->destroy(f);
+
+    if (rc) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    free(data);
+    free(out);
+    return ret;
+}
+
+/*
+ * Reader process: attach to the ring by name and read until the writer stops
+ */
+static int
+shm_reader(const char *name, const char *data, size_t bytes)
+{
+    IO_HANDLE h = new_shm_machine(name, 0);
+    if (h == 0) {
+        return 1;
+    }
+
+    IO_DESC *d = machine_get_desc(h);
+    char *out = malloc(bytes);
+    size_t total = 0;
+    while (total <= bytes) {
+        uint32_t seq;
+        machine_desc_event_seq(d, &seq);
+
+        size_t b = 100000;
+        int rc = shm_machine->read(h, out + total, &b);
+        total += b;
+        if (rc == IO_COMPLETE) {
+            break;
+        }
+        if (b == 0) {
+            machine_desc_event_wait(d, seq, 100000);
+        }
+    }
+
+    int ret = (total == bytes && memcmp(out, data, bytes) == 0) ? 0 : 1;
+    free(out);
+    shm_machine->destroy(h);
+    return ret;
+}
+
+int
+shm_test()
+{
+    int ret = 1;
+
+    size_t size = 1*MB;
+    size_t bytes = 16*MB;
+    char *data = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 13 + 5);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/bw-shm-test-%d", (int)getpid());
+
+    IO_HANDLE h = new_shm_machine(name, size);
+    if (h == 0 || shm_get_size(h) != size) {
+        goto do_return;
+    }
+
+    // A second attachment sees the same ring
+    IO_HANDLE a = new_shm_machine(name, 0);
+    char chk[5000];
+    size_t b = sizeof(chk);
+    shm_machine->write(h, data, &b);
+    if (a == 0 || shm_get_bytes(a) != sizeof(chk)) {
+        goto do_return;
+    }
+
+    shm_machine->read(a, chk, &b);
+    shm_machine->stop(a);
+    shm_machine->destroy(a);
+    if (b != sizeof(chk) || memcmp(chk, data, b) != 0) {
+        goto do_return;
+    }
+
+    // Stopping a reader leaves the ring open: the next reader isn't done
+    a = new_shm_machine(name, 0);
+    b = sizeof(chk);
+    int rc = shm_machine->read(a, chk, &b);
+    shm_machine->destroy(a);
+    if (rc == IO_COMPLETE || b != 0) {
+        goto do_return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(shm_reader(name, data, bytes));
+    }
+
+    // Odd-sized writes, so they wrap the ring
+    size_t total = 0;
+    while (total < bytes) {
+        b = bytes - total;
+        b = (b < 300000) ? b : 300000;
+        shm_machine->write(h, data + total, &b);
+        total += b;
+        if (b == 0) {
+            usleep(100);
+        }
+    }
+    shm_machine->stop(h);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    if (h) {
+        shm_machine->destroy(h);
+    }
+    free(data);
+    return ret;
+}
+
+int
+afpb_test()
+{
+    int ret = 1;
+
+    char pkt[8][116];
+    for (int i = 0; i < 8; i++) {
+        memset(pkt[i], 'a' + i, sizeof(pkt[i]));
+    }
+
+    // 4 packets of 16-byte headers and 100-byte payloads
+    IO_HANDLE h = new_afpb_machine(16, 100, 4);
+    if (h == 0) {
+        return 1;
+    }
+
+    int i = 0;
+    for (; i < 4; i++) {
+        size_t b = sizeof(pkt[i]);
+        if (afpb_machine->write(h, pkt[i], &b) != IO_SUCCESS || b != sizeof(pkt[i])) {
+            goto do_return;
+        }
+    }
+
+    // Full
+    size_t b = sizeof(pkt[4]);
+    afpb_machine->write(h, pkt[4], &b);
+    if (b != 0) {
+        goto do_return;
+    }
+
+    // Borrow two in place, copy one out
+    struct afpb_packet p0, p1;
+    if (afpb_next_full_packet(h, &p0) != IO_SUCCESS ||
+            afpb_next_full_packet(h, &p1) != IO_SUCCESS) {
+        goto do_return;
+    }
+    if (p0.header_len != 16 || p0.payload_len != 100 ||
+            memcmp(p0.header, pkt[0], 16) != 0 || memcmp(p0.payload, pkt[0] + 16, 100) != 0 ||
+            memcmp(p1.header, pkt[1], 16) != 0) {
+        goto do_return;
+    }
+
+    char out[256];
+    b = sizeof(out);
+    afpb_machine->read(h, out, &b);
+    if (b != sizeof(pkt[2]) || memcmp(out, pkt[2], b) != 0) {
+        goto do_return;
+    }
+
+    // Packets can be returned out of order, and their slots reused
+    afpb_done_with_packet(p1.packet);
+    afpb_done_with_packet(p0.packet);
+    for (i = 4; i < 7; i++) {
+        b = sizeof(pkt[i]);
+        afpb_machine->write(h, pkt[i], &b);
+        if (b != sizeof(pkt[i])) {
+            goto do_return;
+        }
+    }
+
+    afpb_machine->stop(h);
+
+    struct afpb_packet p;
+    for (i = 3; i < 7; i++) {
+        if (afpb_next_full_packet(h, &p) != IO_SUCCESS ||
+                memcmp(p.payload, pkt[i] + 16, 100) != 0) {
+            goto do_return;
+        }
+        afpb_done_with_packet(p.packet);
+    }
+
+    if (afpb_next_full_packet(h, &p) != IO_COMPLETE) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    afpb_machine->destroy(h);
+    return ret;
+}
+
+int
+avbb_test()
+{
+    int ret = 1;
+
+    size_t bytes = 4*MB;
+    char *data = malloc(bytes);
+    char *out = malloc(64*KB);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 7 + 1);
+    }
+
+    // Records of up to 64 kB, in an arena that holds 4 of the largest
+    IO_HANDLE h = new_avbb_machine(64*KB, 4);
+    if (h == 0) {
+        goto do_return;
+    }
+
+    // Burst-sized records come back one per read, at their own length
+    size_t wr = 0;
+    size_t rd = 0;
+    size_t len = 1;
+    while (rd < bytes) {
+        while (wr < bytes) {
+            size_t b = (len < bytes - wr) ? len : bytes - wr;
+            avbb_machine->write(h, data + wr, &b);
+            if (b == 0) {
+                break;
+            }
+            wr += b;
+            len = (len * 37 + 11) % (64*KB) + 1;
+        }
+
+        // Short records pack densely: far more than 4 fit
+        size_t b = 64*KB;
+        avbb_machine->read(h, out, &b);
+        if (b == 0 || memcmp(out, data + rd, b) != 0) {
+            goto do_return;
+        }
+        rd += b;
+    }
+
+    // A read too small for a record leaves it for a bigger one
+    size_t b = 1000;
+    avbb_machine->write(h, data, &b);
+
+    b = 999;
+    if (avbb_machine->read(h, out, &b) != IO_ERROR || b != 0) {
+        goto do_return;
+    }
+
+    b = 64*KB;
+    avbb_machine->read(h, out, &b);
+    if (b != 1000 || memcmp(out, data, b) != 0) {
+        goto do_return;
+    }
+
+    // Borrowed records can be consumed a piece at a time
+    b = 1000;
+    avbb_machine->write(h, data, &b);
+
+    struct __block_t *blk;
+    if (avbb_machine->acquire_read_block(h, 0, &blk) != IO_SUCCESS || BLOCK_UNREAD(blk) != 1000) {
+        goto do_return;
+    }
+    avbb_machine->release_read_block(h, blk, 400);
+
+    b = 64*KB;
+    avbb_machine->read(h, out, &b);
+    if (b != 600 || memcmp(out, data + 400, 600) != 0 || avbb_get_bytes(h) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    if (h) {
+        avbb_machine->destroy(h);
+    }
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+fbb_scatter_test()
+{
+    int ret = 1;
+
+    size_t bytes = 200*KB;
+    char *data = malloc(bytes);
+    char *out = malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(i * 11 + 3);
+    }
+
+    // Oversize writes are split across 64 kB blocks
+    IO_HANDLE h = new_fbb_machine(1*MB, 64*KB);
+    IO_HANDLE hf = 0;
+    if (h == 0) {
+        goto do_return;
+    }
+
+    size_t b = bytes;
+    fbb_machine->write(h, data, &b);
+    if (b != bytes) {
+        goto do_return;
+    }
+
+    b = bytes;
+    fbb_machine->read(h, out, &b);
+    if (b != 64*KB || memcmp(out, data, b) != 0) {
+        goto do_return;
+    }
+
+    // Reads smaller than a block take it a piece at a time
+    size_t off = b;
+    while (off < bytes) {
+        b = 1000;
+        fbb_machine->read(h, out + off, &b);
+        if (b == 0) {
+            break;
+        }
+        off += b;
+    }
+    if (off != bytes || memcmp(out, data, bytes) != 0) {
+        goto do_return;
+    }
+
+    // BF_BLOCKFILL packs MTU-sized writes into full blocks
+    hf = new_fbb_machine_fill(1*MB, 64*KB);
+    if (hf == 0) {
+        goto do_return;
+    }
+
+    for (off = 0; off < bytes; off += b) {
+        b = (1500 < bytes - off) ? 1500 : bytes - off;
+        fbb_machine->write(hf, data + off, &b);
+        if (b == 0) {
+            goto do_return;
+        }
+    }
+
+    // Full blocks first, then the partly filled one once the reader catches up
+    size_t blocks = 0;
+    off = 0;
+    while (off < bytes) {
+        b = bytes;
+        fbb_machine->read(hf, out + off, &b);
+        if (b == 0) {
+            break;
+        }
+        if (off + b < bytes && b != 64*KB) {
+            goto do_return;
+        }
+        off += b;
+        blocks++;
+    }
+    if (off != bytes || blocks != 4 || memcmp(out, data, bytes) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    if (h) {
+        fbb_machine->destroy(h);
+    }
+    if (hf) {
+        fbb_machine->destroy(hf);
+    }
+    free(data);
+    free(out);
+    return ret;
+}
+
+int
+block_list_test()
+{
+    int ret = 1;
+    POOL *p = bw_create_pool();
+
+    // Descriptors are one cache-aligned array, linked in order
+    struct __block_t *blocks = block_list_alloc(p, 16);
+    if (!blocks || ((uintptr_t)blocks & 63) != 0) {
+        goto do_return;
+    }
+
+    for (int i = 0; i < 15; i++) {
+        if (blocks[i].next != &blocks[i + 1]) {
+            goto do_return;
+        }
+    }
+    if (blocks[15].next != NULL) {
+        goto do_return;
+    }
+
+    if (block_data_fastalloc(p, blocks, 4*KB) != 16 * 4*KB) {
+        goto do_return;
+    }
+    forge_ring(blocks);
+    if (blocks[15].next != blocks || blocks[15].data != blocks[0].data + 15 * 4*KB) {
+        goto do_return;
+    }
+
+    block_list_free(p, blocks);
+    ret = 0;
+
+do_return:
+    bw_free_pool(p);
+    return ret;
+}
+
+int
+mem_budget_test()
+{
+    int ret = 1;
+    POOL *stream = bw_create_pool();
+    POOL *seg = bw_create_pool();
+    IO_HANDLE h0 = 0;
+    IO_HANDLE h1 = 0;
+
+    struct io_metrics_mem_t mem;
+    bw_mem_get_usage(NULL, &mem);
+    size_t process = mem.current;
+    size_t process_reserved = mem.reserved;
+
+    // Buffers linked to a stream count against its cap
+    bw_mem_set_pool_limit(stream, 3*MB);
+
+    h0 = new_fbb_machine(1*MB, 256*KB);
+    h1 = new_fbb_machine(1*MB, 256*KB);
+    if (h0 == 0 || h1 == 0) {
+        goto do_return;
+    }
+    bw_mem_link(machine_get_desc(h0)->pool, stream);
+    bw_mem_link(machine_get_desc(h1)->pool, stream);
+    bw_mem_link(seg, stream);
+
+    machine_metrics_get_mem(h0, &mem);
+    if (mem.current != 1*MB || mem.peak != 1*MB) {
+        goto do_return;
+    }
+
+    bw_mem_get_usage(stream, &mem);
+    if (mem.current != 2*MB || mem.limit != 3*MB) {
+        goto do_return;
+    }
+
+    // Reservations count too
+    if (bw_mem_reserve(seg, 512*KB) != IO_SUCCESS || bw_mem_reserve(seg, 1*MB) == IO_SUCCESS) {
+        goto do_return;
+    }
+    if (bw_mem_alloc(seg, 1*MB, 0) != NULL || errno != EDQUOT) {
+        goto do_return;
+    }
+    bw_mem_unreserve(seg, 512*KB);
+
+    void *buf = bw_mem_alloc(seg, 1*MB, 0);
+    if (!buf) {
+        goto do_return;
+    }
+
+    // Freed buffers return their budget; the peak stays
+    fbb_machine->destroy(h0);
+    h0 = 0;
+    bw_mem_free(seg, buf);
+    bw_mem_get_usage(stream, &mem);
+    if (mem.current != 1*MB || mem.peak != 3*MB || mem.reserved != 0) {
+        goto do_return;
+    }
+
+    // Process-wide cap
+    bw_mem_get_usage(NULL, &mem);
+    bw_mem_set_limit(mem.current + mem.reserved + 100*KB);
+    buf = bw_mem_alloc(seg, 1*MB, 0);
+    bw_mem_set_limit(0);
+    if (buf != NULL) {
+        goto do_return;
+    }
+
+    // Freeing a pool returns what it and its subpools hold
+    bw_mem_get_usage(stream, &mem);
+    size_t linked = mem.current;
+
+    POOL *owner = bw_create_pool();
+    POOL *sub = bw_create_subpool(owner);
+    bw_mem_link(owner, stream);
+    bw_mem_link(sub, owner);
+    if (!bw_mem_alloc(owner, 256*KB, 0) || !bw_mem_alloc(sub, 256*KB, BF_PREFAULT)) {
+        bw_free_pool(owner);
+        goto do_return;
+    }
+
+    bw_mem_get_usage(stream, &mem);
+    if (mem.current != linked + 512*KB) {
+        bw_free_pool(owner);
+        goto do_return;
+    }
+
+    bw_free_pool(owner);
+    bw_mem_get_usage(stream, &mem);
+    if (mem.current != linked) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    if (h0) {
+        fbb_machine->destroy(h0);
+    }
+    if (h1) {
+        fbb_machine->destroy(h1);
+    }
+    bw_free_pool(seg);
+    bw_free_pool(stream);
+
+    // Everything charged here is returned
+    bw_mem_get_usage(NULL, &mem);
+    if (mem.current != process || mem.reserved != process_reserved) {
+        ret = 1;
+    }
+    return ret;
+}
+
+int
+copy_kernel_test()
+{
+    int ret = 1;
+
+    const char *kernels[] = {"avx2", "sse2", "libc"};
+    const char *kernel = bw_copy_kernel_name();
+
+    // Sizes around the kernels' small-copy cutoff and the threshold, with
+    // every tail length mod 64 and mod 128 that matters
+    size_t threshold = 4*KB;
+    size_t sizes[] = {
+        255, 256, 257, threshold - 1, threshold, threshold + 1,
+        threshold + 63, threshold + 64, threshold + 65,
+        threshold + 127, threshold + 128, threshold + 129,
+        64*KB + 31, 64*KB + 96,
+    };
+    size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    size_t len = 64*KB + 256;
+    char *src = malloc(len);
+    char *dst = malloc(len);
+    char *ref = malloc(len);
+    size_t i = 0;
+    for (; i < len; i++) {
+        src[i] = (char)(i * 7 + (i >> 8));
+    }
+
+    bw_copy_set_nt_threshold(threshold);
+
+    size_t k = 0;
+    for (; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (bw_copy_set_kernel(kernels[k]) != IO_SUCCESS) {
+            continue;
+        }
+
+        size_t n = 0;
+        for (; n < n_sizes; n++) {
+            // Every destination head up to a 32-byte line, and unaligned sources
+            size_t d_off = 0;
+            for (; d_off < 33; d_off++) {
+                size_t s_off = 0;
+                for (; s_off < 3; s_off++) {
+                    size_t bytes = sizes[n];
+                    memset(dst, 0xa5, len);
+                    memcpy(ref, dst, len);
+                    memcpy(ref + d_off, src + s_off * 5, bytes);
+
+                    bw_memcpy_stream(dst + d_off, src + s_off * 5, bytes);
+                    if (memcmp(dst, ref, len) != 0) {
+                        error("%s: %zu bytes at +%zu from +%zu differ", kernels[k], bytes,
+                            d_off, s_off * 5);
+                        goto do_return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Unknown kernels are refused; libc is always there
+    if (bw_copy_set_kernel("avx512") == IO_SUCCESS || bw_copy_set_kernel("libc") != IO_SUCCESS) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    bw_copy_set_kernel(kernel);
+    bw_copy_set_nt_threshold(256*KB);
+    free(src);
+    free(dst);
+    free(ref);
+    return ret;
+}
+
+struct event_test_args {
+    IO_HANDLE h;
+    IO_DESC *d;
+    size_t timeout_us;
+    int status;
+};
+
+static long
+elapsed_ms(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void *
+event_reader(void *arg)
+{
+    struct event_test_args *a = (struct event_test_args *)arg;
+
+    uint32_t seq;
+    machine_desc_event_seq(a->d, &seq);
+    a->status = machine_desc_event_wait(a->d, seq, a->timeout_us);
+    return NULL;
+}
+
+static int
+wait_for_waiters(IO_DESC *d, uint32_t n)
+{
+    int ms = 0;
+    for (; ms < 5000; ms++) {
+        if (__atomic_load_n(&d->event->waiters, __ATOMIC_SEQ_CST) == n) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return 1;
+}
+
+int
+event_park_test()
+{
+    int ret = 1;
+    char data[4096];
+    memset(data, 0x3c, sizeof(data));
+
+    IO_HANDLE h = new_rb_machine();
+    IO_DESC *d = machine_get_desc(h);
+    if (!d || !d->event) {
+        goto do_return;
+    }
+
+    // A parked reader wakes on a write, long before its timeout
+    struct event_test_args r = {h, d, 10000000, IO_ERROR};
+    pthread_t t0;
+    pthread_create(&t0, NULL, event_reader, &r);
+    if (wait_for_waiters(d, 1) != 0) {
+        pthread_join(t0, NULL);
+        goto do_return;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    size_t b = sizeof(data);
+    rb_machine->write(h, data, &b);
+    pthread_join(t0, NULL);
+
+    if (r.status != IO_SUCCESS || elapsed_ms(&start) > 1000) {
+        goto do_return;
+    }
+
+    b = sizeof(data);
+    rb_machine->read(h, data, &b);
+    if (b != sizeof(data)) {
+        goto do_return;
+    }
+
+    // Destroying the machine releases every parked reader
+    struct event_test_args r1 = {h, d, 10000000, IO_SUCCESS};
+    struct event_test_args r2 = {h, d, 10000000, IO_SUCCESS};
+    pthread_t t1, t2;
+    pthread_create(&t1, NULL, event_reader, &r1);
+    pthread_create(&t2, NULL, event_reader, &r2);
+    if (wait_for_waiters(d, 2) != 0) {
+        pthread_join(t1, NULL);
+        pthread_join(t2, NULL);
+        goto do_return;
+    }
+
+    gettimeofday(&start, NULL);
+    rb_machine->destroy(h);
+    h = 0;
+    pthread_join(t1, NULL);
+    pthread_join(t2, NULL);
+
+    if (r1.status != IO_ERROR || r2.status != IO_ERROR || elapsed_ms(&start) > 2000) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    if (h) {
+        rb_machine->destroy(h);
+    }
+    return ret;
+}
+
+int
+bcast_park_test()
+{
+    int ret = 1;
+    char data[4096];
+    memset(data, 0x5a, sizeof(data));
+
+    IO_HANDLE h = new_bcast_machine(1*MB, 64*KB);
+    IO_HANDLE a = bcast_add_reader(h, BCAST_STALL, 0);
+    IO_HANDLE b = bcast_add_reader(h, BCAST_STALL, 0);
+    IO_DESC *da = machine_get_desc(a);
+    if (!da || !da->event || !b) {
+        goto do_return;
+    }
+
+    // Destroying one reader leaves the other parked
+    struct event_test_args r = {a, da, 10000000, IO_ERROR};
+    pthread_t t;
+    pthread_create(&t, NULL, event_reader, &r);
+    if (wait_for_waiters(da, 1) != 0) {
+        pthread_join(t, NULL);
+        goto do_return;
+    }
+
+    get_machine_ref(b)->destroy(b);
+    if (__atomic_load_n(&da->event->closed, __ATOMIC_SEQ_CST) ||
+            wait_for_waiters(da, 1) != 0) {
+        pthread_join(t, NULL);
+        goto do_return;
+    }
+
+    // ...and it still wakes on a write, and gets the data
+    size_t bytes = sizeof(data);
+    bcast_machine->write(h, data, &bytes);
+    pthread_join(t, NULL);
+    if (r.status != IO_SUCCESS) {
+        goto do_return;
+    }
+
+    char out[4096];
+    bytes = sizeof(out);
+    bcast_machine->read(a, out, &bytes);
+    if (bytes != sizeof(data) || memcmp(data, out, bytes) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    bcast_machine->destroy(h);
+    return ret;
+}
+
 int
 main(int nargs, char *argv[])
 {
@@ -185,8 +1715,28 @@ main(int nargs, char *argv[])
     test_setup();
 
     test_add(rw_test);
+    test_add(partial_read_test);
+    test_add(borrow_test);
     test_add(realloc_test);
     test_add(mem_limit_test);
+    test_add(stale_handle_test);
+    test_add(spsc_test);
+    test_add(broadcast_test);
+    test_add(mirror_test);
+    test_add(alloc_flags_test);
+    test_add(reclaim_test);
+    test_add(overflow_test);
+    test_add(spill_test);
+    test_add(meta_test);
+    test_add(shm_test);
+    test_add(afpb_test);
+    test_add(avbb_test);
+    test_add(fbb_scatter_test);
+    test_add(block_list_test);
+    test_add(mem_budget_test);
+    test_add(copy_kernel_test);
+    test_add(event_park_test);
+    test_add(bcast_park_test);
 
     test_run();
     test_cleanup();
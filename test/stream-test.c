@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include <memex.h>
 
@@ -10,6 +16,8 @@
 #include "simple-filters.h"
 #include "logging.h"
 #include "stream.h"
+#include "scheduler.h"
+#include "bw-thread.h"
 #include "test.h"
 
 #define LOGEX_TAG "STREAM-TEST"
@@ -33,7 +41,7 @@ stream_test()
 
     // Create stream
     IO_STREAM stream = new_stream();
-    io_stream_add_segment(stream, in, out, BW_NOFLAGS);
+    io_stream_add_segment(stream, in, out);
 
     // Fill in file with data
     size_t b = bytes;
@@ -89,7 +97,7 @@ buffered_stream_test()
 
     // Create stream
     IO_STREAM stream = new_stream();
-    io_stream_add_segment(stream, in, out, BW_NOFLAGS);
+    io_stream_add_segment(stream, in, out);
 
     // Fill in file with data
     size_t b = bytes;
@@ -148,9 +156,9 @@ multisegment_stream_test()
 
     // Create stream
     IO_STREAM stream = new_stream();
-    io_stream_add_segment(stream, in, buf1, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf1, buf2, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf2, out, BW_NOFLAGS);
+    io_stream_add_segment(stream, in, buf1);
+    io_stream_add_segment(stream, buf1, buf2);
+    io_stream_add_segment(stream, buf2, out);
 
     // Fill in file with data
     size_t b = bytes;
@@ -214,9 +222,9 @@ byte_count_stream_test()
 
     // Create stream
     IO_STREAM stream = new_stream();
-    io_stream_add_segment(stream, in, buf1, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf1, buf2, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf2, out, BW_NOFLAGS);
+    io_stream_add_segment(stream, in, buf1);
+    io_stream_add_segment(stream, buf1, buf2);
+    io_stream_add_segment(stream, buf2, out);
 
     start_stream(stream);
     join_stream(stream);
@@ -269,9 +277,9 @@ stream_metrics_test()
 
     // Create stream
     IO_STREAM stream = new_stream();
-    io_stream_add_segment(stream, in, buf1, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf1, buf2, BW_NOFLAGS);
-    io_stream_add_segment(stream, buf2, out, BW_NOFLAGS);
+    io_stream_add_segment(stream, in, buf1);
+    io_stream_add_segment(stream, buf1, buf2);
+    io_stream_add_segment(stream, buf2, out);
 
     stream_enable_metrics(stream);
 
@@ -291,6 +299,357 @@ do_return:
     return ret;
 }
 
+struct join_t {
+    IO_STREAM stream;
+    volatile int joined;
+};
+
+static void *
+join_thread(void *arg)
+{
+    struct join_t *j = (struct join_t *)arg;
+    join_stream(j->stream);
+    __atomic_store_n(&j->joined, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Join a stream, failing (instead of hanging) if it doesn't stop in time
+static int
+join_within(IO_STREAM stream, int ms)
+{
+    struct join_t *j = calloc(1, sizeof(struct join_t));
+    j->stream = stream;
+
+    pthread_t t;
+    pthread_create(&t, NULL, join_thread, j);
+
+    int waited = 0;
+    for (; waited < ms && !__atomic_load_n(&j->joined, __ATOMIC_ACQUIRE); waited++) {
+        usleep(1000);
+    }
+
+    if (!__atomic_load_n(&j->joined, __ATOMIC_ACQUIRE)) {
+        error("Stream %d did not stop", stream);
+        pthread_detach(t);
+        return 1;
+    }
+
+    pthread_join(t, NULL);
+    free(j);
+    return 0;
+}
+
+// Read "bytes" from a buffer machine, giving up after "ms"
+static size_t
+drain_within(IO_HANDLE h, char *data, size_t bytes, int ms)
+{
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+
+    size_t got = 0;
+    while (got < bytes) {
+        size_t b = bytes - got;
+        get_machine_ref(h)->read(h, data + got, &b);
+        got += b;
+
+        gettimeofday(&now, NULL);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+        if (b == 0 && elapsed > ms) {
+            break;
+        }
+        if (b == 0) {
+            usleep(100);
+        }
+    }
+    return got;
+}
+
+static int
+stream_state_test()
+{
+    int ret = 1;
+
+    size_t bytes = 1024 * 1024;
+    char *data = malloc(bytes);
+    char *rdata = malloc(bytes);
+    size_t i = 0;
+    for (; i < bytes; i++) {
+        data[i] = (char)(i * 13);
+    }
+
+    // Stopped before it starts: nothing to wait for
+    IO_STREAM stream = new_stream();
+    io_stream_add_segment(stream, new_rb_machine(), new_rb_machine());
+    if (stop_stream(stream) != IO_SUCCESS) {
+        goto do_return;
+    }
+
+    // Start, run, stop
+    IO_HANDLE in = new_rb_machine();
+    IO_HANDLE out = new_rb_machine();
+    stream = new_stream();
+    io_stream_add_segment(stream, in, out);
+    start_stream(stream);
+
+    size_t b = bytes;
+    rb_machine->write(in, data, &b);
+    if (b != bytes) {
+        goto do_return;
+    }
+
+    if (drain_within(out, rdata, bytes, 5000) != bytes || memcmp(data, rdata, bytes) != 0) {
+        goto do_return;
+    }
+
+    stop_stream(stream);
+    if (join_within(stream, 5000) != 0) {
+        goto do_return;
+    }
+
+    // Stopped while the segments may still be held on the start barrier, or
+    // parked on their empty sources: they are all released
+    int n = 0;
+    for (; n < 20; n++) {
+        IO_HANDLE a = new_rb_machine();
+        IO_HANDLE c = new_rb_machine();
+        IO_HANDLE d = new_rb_machine();
+        stream = new_stream();
+        io_stream_add_segment(stream, a, c);
+        io_stream_add_segment(stream, c, d);
+        io_stream_add_segment(stream, d, new_rb_machine());
+
+        start_stream(stream);
+        if (n % 2) {
+            usleep(1000);
+        }
+        stop_stream(stream);
+
+        if (join_within(stream, 5000) != 0) {
+            goto do_return;
+        }
+    }
+
+    ret = 0;
+
+do_return:
+    free(data);
+    free(rdata);
+    return ret;
+}
+
+static int
+pooled_stream_test()
+{
+    int ret = 1;
+
+    size_t bytes = 8 * 1024 * 1024;
+    size_t chunk = 1024 * 1024;
+    char *data = malloc(bytes);
+    char *rdata = malloc(bytes);
+    size_t i = 0;
+    for (; i < bytes; i++) {
+        data[i] = (char)(i * 7 + (i >> 12));
+    }
+
+    // Three hops through different buffers, on the worker pool
+    IO_HANDLE in = new_rb_machine();
+    IO_HANDLE buf1 = new_rb_machine();
+    IO_HANDLE buf2 = new_spsc_machine(2 * 1024 * 1024, 256 * 1024);
+    IO_HANDLE out = new_rb_machine();
+
+    IO_STREAM stream = new_stream();
+    io_stream_add_segment(stream, in, buf1);
+    io_stream_add_segment(stream, buf1, buf2);
+    io_stream_add_segment(stream, buf2, out);
+    stream_set_scheduler(stream, STREAM_SCHED_POOL);
+    start_stream(stream);
+
+    size_t off = 0;
+    for (; off < bytes; off += chunk) {
+        size_t b = chunk;
+        rb_machine->write(in, data + off, &b);
+        if (b != chunk) {
+            goto do_return;
+        }
+    }
+
+    // Everything arrives, in order
+    if (drain_within(out, rdata, bytes, 10000) != bytes || memcmp(data, rdata, bytes) != 0) {
+        goto do_return;
+    }
+
+    // Stopping the source completes the stream
+    rb_machine->stop(in);
+    if (join_within(stream, 5000) != 0) {
+        goto do_return;
+    }
+
+    // An idle pooled stream stops when asked
+    IO_HANDLE a = new_rb_machine();
+    IO_HANDLE c = new_rb_machine();
+    stream = new_stream();
+    io_stream_add_segment(stream, a, c);
+    io_stream_add_segment(stream, c, new_rb_machine());
+    stream_set_scheduler(stream, STREAM_SCHED_POOL);
+    start_stream(stream);
+    usleep(10000);
+    stop_stream(stream);
+    if (join_within(stream, 5000) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    free(data);
+    free(rdata);
+    return ret;
+}
+
+static double
+cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+struct nap_task_t {
+    struct sched_task_t task;
+    int runs;
+    volatile int done;
+};
+
+// Holds its worker for 10 ms a run, without using the CPU
+static int
+nap_task(void *arg)
+{
+    struct nap_task_t *nap = (struct nap_task_t *)arg;
+    usleep(10000);
+    if (--nap->runs > 0) {
+        return SCHED_TASK_YIELD;
+    }
+    nap->done = 1;
+    return SCHED_TASK_DONE;
+}
+
+static int
+idle_pool_test()
+{
+    // One task that is always running: nothing is ever queued, so the
+    // spare workers park instead of spinning
+    struct nap_task_t nap = {
+        .task = {.fn = nap_task, .arg = &nap},
+        .runs = 100,
+        .done = 0,
+    };
+
+    double cpu = cpu_seconds();
+    if (sched_submit(&nap.task) < IO_SUCCESS) {
+        return 1;
+    }
+
+    int ms = 0;
+    while (!nap.done && ms++ < 5000) {
+        usleep(1000);
+    }
+    cpu = cpu_seconds() - cpu;
+
+    if (!nap.done) {
+        error("Task did not finish");
+        return 1;
+    }
+
+    if (cpu > 0.25) {
+        error("Idle workers used %.3f s of CPU in 1 s", cpu);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+placement_stream_test()
+{
+    int ret = 1;
+
+    size_t bytes = 4 * 1024 * 1024;
+    size_t chunk = 1024 * 1024;
+    char *data = malloc(bytes);
+    char *rdata = malloc(bytes);
+    size_t i = 0;
+    for (; i < bytes; i++) {
+        data[i] = (char)(i * 11 + (i >> 10));
+    }
+
+    // Pin to a CPU this process may run on
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE - 1 && !CPU_ISSET(cpu, &set)) {
+        cpu++;
+    }
+
+    // One node, or none if the system isn't NUMA
+    int node = bw_numa_node_of_cpu(cpu);
+    if (node > 0) {
+        goto do_return;
+    }
+
+    // Placing a buffer leaves it usable
+    bw_numa_place(rdata, bytes, node);
+    memset(rdata, 0, bytes);
+
+    IO_HANDLE in = new_rb_machine();
+    IO_HANDLE mid = new_rb_machine();
+    IO_HANDLE out = new_rb_machine();
+
+    IO_STREAM stream = new_stream();
+    io_stream_add_segment(stream, in, mid);
+    io_stream_add_segment(stream, mid, out);
+    if (stream_get_segment_count(stream) != 2) {
+        goto do_return;
+    }
+
+    if (stream_set_affinity(stream, STREAM_ALL_SEGMENTS, &cpu, 1) != IO_SUCCESS ||
+            stream_set_affinity(stream, 2, &cpu, 1) == IO_SUCCESS) {
+        goto do_return;
+    }
+    stream_set_priority(stream, 0, BW_SCHED_OTHER, 0);
+    stream_set_numa(stream, 1);
+    start_stream(stream);
+
+    size_t off = 0;
+    for (; off < bytes; off += chunk) {
+        size_t b = chunk;
+        rb_machine->write(in, data + off, &b);
+    }
+
+    if (drain_within(out, rdata, bytes, 10000) != bytes || memcmp(data, rdata, bytes) != 0) {
+        goto do_return;
+    }
+
+    // The pinned segments allocated the middle buffer
+    struct io_metrics_mem_t mem;
+    stream_get_mem(stream, &mem);
+    if (mem.peak == 0) {
+        goto do_return;
+    }
+
+    rb_machine->stop(in);
+    if (join_within(stream, 5000) != 0) {
+        goto do_return;
+    }
+
+    ret = 0;
+
+do_return:
+    free(data);
+    free(rdata);
+    return ret;
+}
+
 int
 main(int nargs, char *argv[])
 {
@@ -303,6 +662,10 @@ main(int nargs, char *argv[])
     test_add(multisegment_stream_test);
     test_add(byte_count_stream_test);
     test_add(stream_metrics_test);
+    test_add(stream_state_test);
+    test_add(pooled_stream_test);
+    test_add(placement_stream_test);
+    test_add(idle_pool_test);
 
     test_run();
     test_cleanup();